@@ -0,0 +1,95 @@
+/* measures the copy and zero kernels of memops.c for a range of sizes, the
+ * crossover point is the size above which a non-temporal kernel beats the
+ * C library. Build with "make bench". */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "memops.h"
+
+#define MIN_SIZE (16 * 1024)
+#define MAX_SIZE (256 * 1024 * 1024)
+#define TOTAL_BYTES (1024ull * 1024 * 1024 * 2)
+
+static const char *names[MEMOPS_KERNELS] = {"libc", "rep", "sse2-nt", "avx2-nt"};
+
+static uint64_t getNanos(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &tp);
+	return ((uint64_t)tp.tv_sec) * 1000000000 + ((uint64_t)tp.tv_nsec);
+}
+
+/* GB/s of copying or zeroing 'size' bytes, -1 if the kernel is missing */
+static double measure(int kernel, int zero, char *dst, const char *src, size_t size)
+{
+	uint64_t rounds = TOTAL_BYTES / size;
+	uint64_t i, time;
+
+	if(rounds == 0) {
+		rounds = 1;
+	}
+
+	/* warm up, this also faults in the pages */
+	if(zero ? !memops_zero_with(kernel, dst, size) : !memops_copy_with(kernel, dst, src, size)) {
+		return -1.0;
+	}
+
+	time = getNanos();
+	for(i = 0; i < rounds; ++i) {
+		if(zero) {
+			memops_zero_with(kernel, dst, size);
+		}
+		else {
+			memops_copy_with(kernel, dst, src, size);
+		}
+	}
+	time = getNanos() - time;
+
+	return ((double)(rounds * size)) / (double)time;
+}
+
+int main(void)
+{
+	char *src = malloc(MAX_SIZE);
+	char *dst = malloc(MAX_SIZE);
+	int zero, kernel;
+	size_t size;
+
+	if(src == NULL || dst == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	memset(src, 1, MAX_SIZE);
+
+	printf("large blocks use %s\n", names[memops_get_kernel()]);
+
+	for(zero = 0; zero < 2; ++zero) {
+		printf("\n%s GB/s\n%12s", zero ? "zero" : "copy", "size");
+		for(kernel = 0; kernel < MEMOPS_KERNELS; ++kernel) {
+			printf("%10s", names[kernel]);
+		}
+		printf("\n");
+
+		for(size = MIN_SIZE; size <= MAX_SIZE; size *= 2) {
+			printf("%12zu", size);
+			for(kernel = 0; kernel < MEMOPS_KERNELS; ++kernel) {
+				double rate = measure(kernel, zero, dst, src, size);
+				if(rate < 0.0) {
+					printf("%10s", "-");
+				}
+				else {
+					printf("%10.2f", rate);
+				}
+			}
+			printf("\n");
+		}
+	}
+
+	free(src);
+	free(dst);
+	return 0;
+}
@@ -1,5 +1,6 @@
 #include <stddef.h> /* NULL, size_t */
-#include <string.h> /* memset */
+
+#include "memops.h"
 
 #define PAGE_SIZE 4096
 
@@ -55,7 +56,7 @@ void* calloc(size_t nmemb, size_t size)
 		return NULL;
 	}
 
-	memset(out, 0, fullsize);
+	memops_zero(out, fullsize);
 	return out;
 }
 
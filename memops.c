@@ -0,0 +1,314 @@
+#include <stddef.h> /* size_t */
+#include <stdint.h> /* uintptr_t */
+#include <string.h> /* memcpy, memset */
+
+#include "memops.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#	define MEMOPS_X86
+#	include <cpuid.h>
+#	include <immintrin.h>
+#endif
+
+/* blocks smaller than this go through the cache. Up to a few times the size
+ * of the last level cache the C library is still faster when nothing else
+ * runs, see bench/memops_bench, but it evicts the data of everyone else. */
+static size_t copyThreshold = 1024 * 1024 * 4;
+static size_t zeroThreshold = 1024 * 1024 * 4;
+
+#ifdef MEMOPS_X86
+static int hasAVX2(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	unsigned int lo, hi;
+
+	if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+		return 0;
+	}
+
+	/* the OS must save the ymm registers */
+	if(!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX)) {
+		return 0;
+	}
+	__asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	(void)hi;
+	if((lo & 6) != 6) {
+		return 0;
+	}
+
+	if(!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+		return 0;
+	}
+	return (ebx & bit_AVX2) != 0;
+}
+
+static int hasSSE2(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+		return 0;
+	}
+	return (edx & bit_SSE2) != 0;
+}
+
+static int hasERMS(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if(!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+		return 0;
+	}
+	return (ebx & (1 << 9)) != 0;
+}
+#endif
+
+/* bit mask of the supported kernels, cpuid is slow in virtual machines so
+ * it is only asked once. 0 until the cpu was checked. */
+static unsigned int supportedKernels = 0;
+
+static unsigned int getSupported(void)
+{
+	unsigned int out = __atomic_load_n(&supportedKernels, __ATOMIC_RELAXED);
+	if(out == 0) {
+		/* racing threads all come to the same result */
+		out = 1u << MEMOPS_LIBC;
+		#ifdef MEMOPS_X86
+		if(hasERMS()) {
+			out |= 1u << MEMOPS_REP;
+		}
+		if(hasSSE2()) {
+			out |= 1u << MEMOPS_SSE2_NT;
+		}
+		if(hasAVX2()) {
+			out |= 1u << MEMOPS_AVX2_NT;
+		}
+		#endif
+		__atomic_store_n(&supportedKernels, out, __ATOMIC_RELAXED);
+	}
+	return out;
+}
+
+static int supported(enum memops_kernel kernel)
+{
+	return (unsigned int)kernel < MEMOPS_KERNELS && (getSupported() & (1u << kernel)) != 0;
+}
+
+/* the kernel for large blocks, the widest non-temporal one */
+static int getKernel(void)
+{
+	if(supported(MEMOPS_AVX2_NT)) {
+		return MEMOPS_AVX2_NT;
+	}
+	if(supported(MEMOPS_SSE2_NT)) {
+		return MEMOPS_SSE2_NT;
+	}
+	return MEMOPS_LIBC;
+}
+
+#ifdef MEMOPS_X86
+static void repCopy(void *dst, const void *src, size_t size)
+{
+	__asm__ volatile("rep movsb" : "+D"(dst), "+S"(src), "+c"(size) : : "memory");
+}
+
+static void repZero(void *dst, size_t size)
+{
+	__asm__ volatile("rep stosb" : "+D"(dst), "+c"(size) : "a"(0) : "memory");
+}
+
+/* the non-temporal kernels need an aligned destination, the unaligned head
+ * and the tail are done by the C library */
+static size_t headBytes(const void *dst, size_t align, size_t size)
+{
+	size_t head = (align - (((uintptr_t)dst) & (align - 1))) & (align - 1);
+	return head < size ? head : size;
+}
+
+__attribute__((target("sse2")))
+static void sse2Copy(void *dst, const void *src, size_t size)
+{
+	const size_t head = headBytes(dst, 16, size);
+	char *d = (char*)dst;
+	const char *s = (const char*)src;
+
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	size -= head;
+
+	for(; size >= 64; size -= 64, d += 64, s += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(s + 0));
+		__m128i b = _mm_loadu_si128((const __m128i*)(s + 16));
+		__m128i c = _mm_loadu_si128((const __m128i*)(s + 32));
+		__m128i e = _mm_loadu_si128((const __m128i*)(s + 48));
+		_mm_stream_si128((__m128i*)(d + 0), a);
+		_mm_stream_si128((__m128i*)(d + 16), b);
+		_mm_stream_si128((__m128i*)(d + 32), c);
+		_mm_stream_si128((__m128i*)(d + 48), e);
+	}
+	_mm_sfence();
+
+	memcpy(d, s, size);
+}
+
+__attribute__((target("sse2")))
+static void sse2Zero(void *dst, size_t size)
+{
+	const size_t head = headBytes(dst, 16, size);
+	const __m128i zero = _mm_setzero_si128();
+	char *d = (char*)dst;
+
+	memset(d, 0, head);
+	d += head;
+	size -= head;
+
+	for(; size >= 64; size -= 64, d += 64) {
+		_mm_stream_si128((__m128i*)(d + 0), zero);
+		_mm_stream_si128((__m128i*)(d + 16), zero);
+		_mm_stream_si128((__m128i*)(d + 32), zero);
+		_mm_stream_si128((__m128i*)(d + 48), zero);
+	}
+	_mm_sfence();
+
+	memset(d, 0, size);
+}
+
+__attribute__((target("avx2")))
+static void avx2Copy(void *dst, const void *src, size_t size)
+{
+	const size_t head = headBytes(dst, 32, size);
+	char *d = (char*)dst;
+	const char *s = (const char*)src;
+
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	size -= head;
+
+	for(; size >= 128; size -= 128, d += 128, s += 128) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)(s + 0));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(s + 32));
+		__m256i c = _mm256_loadu_si256((const __m256i*)(s + 64));
+		__m256i e = _mm256_loadu_si256((const __m256i*)(s + 96));
+		_mm256_stream_si256((__m256i*)(d + 0), a);
+		_mm256_stream_si256((__m256i*)(d + 32), b);
+		_mm256_stream_si256((__m256i*)(d + 64), c);
+		_mm256_stream_si256((__m256i*)(d + 96), e);
+	}
+	_mm_sfence();
+	_mm256_zeroupper();
+
+	memcpy(d, s, size);
+}
+
+__attribute__((target("avx2")))
+static void avx2Zero(void *dst, size_t size)
+{
+	const size_t head = headBytes(dst, 32, size);
+	const __m256i zero = _mm256_setzero_si256();
+	char *d = (char*)dst;
+
+	memset(d, 0, head);
+	d += head;
+	size -= head;
+
+	for(; size >= 128; size -= 128, d += 128) {
+		_mm256_stream_si256((__m256i*)(d + 0), zero);
+		_mm256_stream_si256((__m256i*)(d + 32), zero);
+		_mm256_stream_si256((__m256i*)(d + 64), zero);
+		_mm256_stream_si256((__m256i*)(d + 96), zero);
+	}
+	_mm_sfence();
+	_mm256_zeroupper();
+
+	memset(d, 0, size);
+}
+#endif
+
+static void copyWith(int kernel, void *dst, const void *src, size_t size)
+{
+	switch(kernel) {
+	#ifdef MEMOPS_X86
+	case MEMOPS_REP:
+		repCopy(dst, src, size);
+		break;
+	case MEMOPS_SSE2_NT:
+		sse2Copy(dst, src, size);
+		break;
+	case MEMOPS_AVX2_NT:
+		avx2Copy(dst, src, size);
+		break;
+	#endif
+	default:
+		memcpy(dst, src, size);
+		break;
+	}
+}
+
+static void zeroWith(int kernel, void *dst, size_t size)
+{
+	switch(kernel) {
+	#ifdef MEMOPS_X86
+	case MEMOPS_REP:
+		repZero(dst, size);
+		break;
+	case MEMOPS_SSE2_NT:
+		sse2Zero(dst, size);
+		break;
+	case MEMOPS_AVX2_NT:
+		avx2Zero(dst, size);
+		break;
+	#endif
+	default:
+		memset(dst, 0, size);
+		break;
+	}
+}
+
+void memops_copy(void *dst, const void *src, size_t size)
+{
+	if(size < __atomic_load_n(&copyThreshold, __ATOMIC_RELAXED)) {
+		memcpy(dst, src, size);
+		return;
+	}
+	copyWith(getKernel(), dst, src, size);
+}
+
+void memops_zero(void *dst, size_t size)
+{
+	if(size < __atomic_load_n(&zeroThreshold, __ATOMIC_RELAXED)) {
+		memset(dst, 0, size);
+		return;
+	}
+	zeroWith(getKernel(), dst, size);
+}
+
+enum memops_kernel memops_get_kernel(void)
+{
+	return (enum memops_kernel)getKernel();
+}
+
+void memops_set_thresholds(size_t copy, size_t zero)
+{
+	__atomic_store_n(&copyThreshold, copy, __ATOMIC_RELAXED);
+	__atomic_store_n(&zeroThreshold, zero, __ATOMIC_RELAXED);
+}
+
+int memops_copy_with(enum memops_kernel kernel, void *dst, const void *src, size_t size)
+{
+	if(!supported(kernel)) {
+		return 0;
+	}
+	copyWith(kernel, dst, src, size);
+	return 1;
+}
+
+int memops_zero_with(enum memops_kernel kernel, void *dst, size_t size)
+{
+	if(!supported(kernel)) {
+		return 0;
+	}
+	zeroWith(kernel, dst, size);
+	return 1;
+}
@@ -0,0 +1,40 @@
+#ifndef   TREEALLOC_MEMOPS_HEADER
+#define   TREEALLOC_MEMOPS_HEADER
+
+/* copy and zero kernels for large blocks. Below the threshold of a kernel
+ * the C library is used, above it the data is written with non-temporal
+ * stores, so moving or clearing megabytes does not evict the whole last
+ * level cache. The kernels are chosen once via cpuid. */
+
+#include <stddef.h> /* size_t */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum memops_kernel
+{
+	MEMOPS_LIBC = 0,
+	MEMOPS_REP,       /* rep movsb / rep stosb */
+	MEMOPS_SSE2_NT,   /* 16 byte non-temporal stores */
+	MEMOPS_AVX2_NT,   /* 32 byte non-temporal stores */
+	MEMOPS_KERNELS
+};
+
+void memops_copy(void *dst, const void *src, size_t size);
+void memops_zero(void *dst, size_t size);
+
+/* the kernel chosen for large blocks and the thresholds in bytes */
+enum memops_kernel memops_get_kernel(void);
+void memops_set_thresholds(size_t copy, size_t zero);
+
+/* run a specific kernel regardless of the size, returns 0 if it is not
+ * supported by this cpu, used by the benchmark */
+int memops_copy_with(enum memops_kernel kernel, void *dst, const void *src, size_t size);
+int memops_zero_with(enum memops_kernel kernel, void *dst, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TREEALLOC_MEMOPS_HEADER */
@@ -0,0 +1,74 @@
+// allocRange() and allocLargest() of the block allocator: the largest run
+// is taken only if it holds the minimum, allocLargest() leaves the deferred
+// chunks alone, and allocRange() merges them only if no run is large enough
+
+#include <string.h>
+
+#include "tests/check.h"
+#include "tests/region.h"
+
+static const uintptr_t REGION_SIZE = 4 * 1024 * 1024;
+static const uintptr_t REGION_BLOCKS = REGION_SIZE >> 6;
+static const uintptr_t CHUNKS = 1000;
+
+static void *chunks[CHUNKS];
+
+int main()
+{
+	char *region = mapRegion(REGION_SIZE);
+
+	Blocks blocks;
+	blocks.init();
+	blocks.setDeferredLimit(REGION_BLOCKS);
+	blocks.free(region, REGION_BLOCKS);
+
+	// all of the region in chunks of two blocks
+	for(uintptr_t i = 0; i < CHUNKS; ++i) {
+		chunks[i] = blocks.alloc(2);
+		CHECK(chunks[i] != nullptr);
+	}
+	for(uintptr_t i = 0; i < CHUNKS; i += 2) {
+		blocks.free(chunks[i], 2);
+	}
+	const uintptr_t deferred = blocks.getDeferredCount();
+	CHECK(deferred == CHUNKS);
+
+	// the rest of the region is the largest run, the deferred chunks stay
+	uintptr_t got = 1024;
+	void *largest = blocks.allocLargest(4096, &got);
+	CHECK(largest != nullptr && ((uintptr_t)largest & 4095) == 0);
+	CHECK(got >= 1024 && got <= REGION_BLOCKS - CHUNKS * 2);
+	CHECK(blocks.getDeferredCount() == deferred);
+
+	// nothing else is that large, this fails without merging
+	got = 1024;
+	CHECK(blocks.allocLargest(4096, &got) == nullptr);
+	CHECK(blocks.getDeferredCount() == deferred);
+
+	// a range that a run holds does not merge either
+	got = 0;
+	void *range = blocks.allocRange(1, 10, 64, &got);
+	CHECK(range != nullptr && got >= 1 && got <= 10);
+	CHECK(blocks.getDeferredCount() == deferred);
+	blocks.free(range, got, false);
+
+	// the deferred chunks are merged if no run holds the minimum
+	for(uintptr_t i = 1; i < CHUNKS; i += 2) {
+		blocks.free(chunks[i], 2);
+	}
+	got = 0;
+	range = blocks.allocRange(CHUNKS * 2, ~((uintptr_t)0), 64, &got);
+	CHECK(range == region && got >= CHUNKS * 2);
+	CHECK(blocks.getDeferredCount() == 0);
+	CHECK(blocks.check());
+
+	// sizes that do not fit into the address space
+	got = 0;
+	CHECK(blocks.allocRange(~((uintptr_t)0), ~((uintptr_t)0), 64, &got) == nullptr);
+	CHECK(blocks.allocRange(0, 10, 64, &got) == nullptr);
+	CHECK(blocks.allocRange(10, 5, 64, &got) == nullptr);
+	CHECK(blocks.allocRange(1, 10, 3, &got) == nullptr);
+
+	unmapRegion(region, REGION_SIZE);
+	return CHECK_DONE();
+}
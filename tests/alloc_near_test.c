@@ -0,0 +1,107 @@
+/* treealloc_alloc_near() takes the free memory closest to the hint, and
+ * treealloc_alloc_within() only memory that lies in the given range, also
+ * if it is held by deferred chunks or has to be mapped first */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <malloc.h>
+
+#include "tests/check.h"
+#include "treealloc/treealloc.h"
+
+#define COUNT 64
+#define SIZE 1000
+
+static char *chunks[COUNT];
+
+static uintptr_t distance(const void *a, const void *b)
+{
+	return (uintptr_t)a < (uintptr_t)b ? (uintptr_t)b - (uintptr_t)a : (uintptr_t)a - (uintptr_t)b;
+}
+
+int main(void)
+{
+	static volatile size_t sizeMax = SIZE_MAX;
+	char *mem, *low, *high;
+	int i;
+
+	/* holes at every other place of a run of chunks, merged at once */
+	CHECK(mallopt(TREEALLOC_M_DEFERRED, 0) == 1);
+	for(i = 0; i < COUNT; ++i) {
+		chunks[i] = malloc(SIZE);
+		CHECK(chunks[i] != NULL);
+	}
+	for(i = 0; i < COUNT; i += 2) {
+		free(chunks[i]);
+	}
+
+	/* the hole next to the hint is reused, not the one at the start */
+	mem = treealloc_alloc_near(chunks[41], SIZE);
+	CHECK(mem != NULL && distance(mem, chunks[41]) <= 2 * (SIZE + 64));
+	if(mem != NULL) {
+		memset(mem, 1, SIZE);
+	}
+	free(mem);
+
+	/* far away hints and hints without memory still succeed */
+	mem = treealloc_alloc_near((void*)16, SIZE);
+	CHECK(mem != NULL);
+	free(mem);
+	mem = treealloc_alloc_near(chunks[1], 8 * 1024 * 1024);
+	CHECK(mem != NULL && malloc_usable_size(mem) >= 8 * 1024 * 1024);
+	free(mem);
+
+	/* a range that holds exactly the holes from chunk 10 to 20 */
+	low = chunks[9];
+	high = chunks[21];
+	for(i = 0; i < 6; ++i) {
+		mem = treealloc_alloc_within(low, high, SIZE);
+		CHECK(mem != NULL && mem > low && mem + SIZE <= high);
+		chunks[10 + 2 * i] = mem;
+	}
+	CHECK(treealloc_alloc_within(low, high, SIZE) == NULL);
+	CHECK(treealloc_alloc_within(chunks[1], chunks[3], 4 * SIZE) == NULL);
+
+	/* a deferred chunk in the range is found too */
+	CHECK(mallopt(TREEALLOC_M_DEFERRED, 256 * 1024) == 1);
+	free(chunks[12]);
+	mem = treealloc_alloc_within(low, high, SIZE);
+	CHECK(mem == chunks[12]);
+	chunks[12] = mem;
+
+	/* memory below 4 GB is mapped for it, the next request is placed in
+	 * the same mapping */
+	if(sizeof(void*) == 8) {
+		const uintptr_t limit = (uintptr_t)1 << 32;
+		char *other;
+		mem = treealloc_alloc_within(NULL, (void*)limit, SIZE);
+		CHECK(mem != NULL && (uintptr_t)mem + SIZE <= limit);
+		other = treealloc_alloc_within(NULL, (void*)limit, SIZE);
+		CHECK(other != NULL && distance(mem, other) < 1024 * 1024);
+		if(mem != NULL && other != NULL) {
+			memset(mem, 1, SIZE);
+			memset(other, 2, SIZE);
+		}
+		free(mem);
+		free(other);
+	}
+
+	CHECK(treealloc_alloc_near(chunks[1], 0) == NULL);
+	CHECK(treealloc_alloc_near(chunks[1], sizeMax) == NULL);
+	CHECK(treealloc_alloc_near(chunks[1], sizeMax - 20) == NULL);
+	CHECK(treealloc_alloc_within(low, high, 0) == NULL);
+	CHECK(treealloc_alloc_within(high, low, SIZE) == NULL);
+	CHECK(treealloc_alloc_within(low, high, sizeMax) == NULL);
+	CHECK(treealloc_alloc_within(low, high, sizeMax - 20) == NULL);
+	CHECK(treealloc_alloc_within(NULL, (void*)sizeMax, sizeMax - 20) == NULL);
+
+	for(i = 1; i < COUNT; i += 2) {
+		free(chunks[i]);
+	}
+	for(i = 10; i <= 20; i += 2) {
+		free(chunks[i]);
+	}
+
+	return CHECK_DONE();
+}
@@ -0,0 +1,65 @@
+/* treealloc_alloc_range() takes what one free run holds between the two
+ * sizes, maps new memory only if no run holds the smaller one, and rejects
+ * sizes that cannot be allocated */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <malloc.h>
+
+#include "tests/check.h"
+#include "treealloc/treealloc.h"
+
+#define KB 1024
+
+int main(void)
+{
+	static volatile size_t sizeMax = SIZE_MAX;
+	struct treealloc_sized_ptr sized;
+	void *hole, *guard;
+
+	/* a free run of about 200 KB between two allocations */
+	hole = malloc(200 * KB);
+	guard = malloc(100);
+	CHECK(hole != NULL && guard != NULL);
+	free(hole);
+
+	sized = treealloc_alloc_range(100 * KB, 150 * KB);
+	CHECK(sized.ptr != NULL && sized.size >= 100 * KB && sized.size < 150 * KB + 4 * KB);
+	CHECK(sized.ptr == NULL || malloc_usable_size(sized.ptr) == sized.size);
+	if(sized.ptr != NULL) {
+		memset(sized.ptr, 1, sized.size);
+	}
+	free(sized.ptr);
+
+	/* as much as the runs hold, at least the smaller size */
+	sized = treealloc_alloc_range(64, sizeMax);
+	CHECK(sized.ptr != NULL && sized.size >= 64);
+	if(sized.ptr != NULL) {
+		memset(sized.ptr, 2, sized.size);
+	}
+	free(sized.ptr);
+	sized = treealloc_alloc_range(64, sizeMax - 20);
+	CHECK(sized.ptr != NULL && sized.size >= 64);
+	free(sized.ptr);
+	sized = treealloc_alloc_range(100 * KB, (sizeMax >> 1) + 1);
+	CHECK(sized.ptr != NULL && sized.size >= 100 * KB);
+	free(sized.ptr);
+
+	/* no run holds this, new memory is mapped */
+	sized = treealloc_alloc_range(8 * KB * KB, 9 * KB * KB);
+	CHECK(sized.ptr != NULL && sized.size >= 8 * KB * KB);
+	free(sized.ptr);
+
+	sized = treealloc_alloc_range(0, 100);
+	CHECK(sized.ptr == NULL && sized.size == 0);
+	sized = treealloc_alloc_range(200, 100);
+	CHECK(sized.ptr == NULL && sized.size == 0);
+	sized = treealloc_alloc_range(sizeMax, sizeMax);
+	CHECK(sized.ptr == NULL && sized.size == 0);
+	sized = treealloc_alloc_range(sizeMax - 20, sizeMax);
+	CHECK(sized.ptr == NULL && sized.size == 0);
+	free(guard);
+
+	return CHECK_DONE();
+}
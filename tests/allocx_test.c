@@ -0,0 +1,96 @@
+/* the *allocx() calls: alignment and zeroing flags, in place resizing with
+ * xallocx(), and sizes or alignments that can never be allocated */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <malloc.h>
+
+#include "tests/check.h"
+#include "treealloc/treealloc.h"
+
+static int zeroed(const unsigned char *mem, size_t from, size_t to)
+{
+	for(; from < to; ++from) {
+		if(mem[from] != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int main(void)
+{
+	static volatile size_t sizeMax = SIZE_MAX;
+	unsigned char *mem, *moved;
+	size_t size, i;
+
+	/* nallocx() gives what mallocx() would give */
+	for(i = 1; i < 100000; i = i * 3 + 1) {
+		size = nallocx(i, 0);
+		CHECK(size >= i);
+		mem = mallocx(i, 0);
+		CHECK(mem != NULL && sallocx(mem, 0) == size);
+		dallocx(mem, 0);
+
+		size = nallocx(i, TREEALLOC_X_ALIGN(4096));
+		CHECK(size >= i);
+		mem = mallocx(i, TREEALLOC_X_ALIGN(4096));
+		CHECK(mem != NULL && ((uintptr_t)mem & 4095) == 0 && sallocx(mem, 0) >= size);
+		dallocx(mem, 0);
+	}
+
+	/* zeroing, also of the bytes gained by growing */
+	mem = malloc(5000);
+	CHECK(mem != NULL);
+	memset(mem, 0xff, 5000);
+	free(mem);
+	mem = mallocx(5000, TREEALLOC_X_ZERO);
+	CHECK(mem != NULL && zeroed(mem, 0, 5000));
+	memset(mem, 1, 5000);
+	mem = rallocx(mem, 50000, TREEALLOC_X_ZERO | TREEALLOC_X_LG_ALIGN(6));
+	CHECK(mem != NULL && ((uintptr_t)mem & 63) == 0);
+	CHECK(mem != NULL && mem[0] == 1 && mem[4999] == 1 && zeroed(mem, 5000, 50000));
+	moved = rallocx(mem, 100, 0);
+	CHECK(moved != NULL && moved[99] == 1);
+	mem = moved;
+
+	/* xallocx() never moves and returns the old size if it cannot grow */
+	CHECK(xallocx(mem, 10, 0, 0) >= 10);
+	size = xallocx(mem, 200, 100000, TREEALLOC_X_ZERO);
+	CHECK(size >= 200 || size == sallocx(mem, 0));
+	CHECK(xallocx(mem, sizeMax, 0, 0) == sallocx(mem, 0));
+	CHECK(xallocx(mem, 100, sizeMax, 0) >= 100);
+	CHECK(xallocx(mem, sizeMax - 20, 40, 0) == sallocx(mem, 0));
+	CHECK(xallocx(NULL, 100, 0, 0) == 0);
+	CHECK(xallocx(mem, 0, 0, 0) == 0);
+	dallocx(mem, TREEALLOC_X_NOCACHE);
+
+	/* requests that can never be allocated */
+	CHECK(nallocx(0, 0) == 0);
+	CHECK(nallocx(sizeMax, 0) == 0);
+	CHECK(nallocx(sizeMax - 20, 0) == 0);
+	CHECK(nallocx((sizeMax >> 1) + 1, 0) == 0);
+	CHECK(nallocx(100, TREEALLOC_X_LG_ALIGN(63)) == 0);
+	CHECK(nallocx(100, TREEALLOC_X_ENGINE(7)) == 0);
+	CHECK(nallocx(sizeMax, TREEALLOC_X_ENGINE(TREEALLOC_ENGINE_SMALL)) == 0);
+	CHECK(mallocx(0, 0) == NULL);
+	CHECK(mallocx(sizeMax, 0) == NULL);
+	CHECK(mallocx(sizeMax - 20, 0) == NULL);
+	CHECK(mallocx(100, TREEALLOC_X_LG_ALIGN(63)) == NULL);
+	CHECK(mallocx(sizeMax, TREEALLOC_X_ENGINE(TREEALLOC_ENGINE_LARGE)) == NULL);
+	CHECK(mallocx(100, TREEALLOC_X_ENGINE(7)) == NULL);
+
+	mem = mallocx(100, 0);
+	CHECK(mem != NULL);
+	memset(mem, 3, 100);
+	CHECK(rallocx(mem, sizeMax, 0) == NULL);
+	CHECK(rallocx(mem, sizeMax - 20, 0) == NULL);
+	CHECK(rallocx(mem, 0, 0) == NULL);
+	CHECK(mem[0] == 3 && mem[99] == 3);
+	dallocx(mem, 0);
+	dallocx(NULL, 0);
+	CHECK(sallocx(NULL, 0) == 0);
+
+	return CHECK_DONE();
+}
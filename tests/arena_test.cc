@@ -0,0 +1,54 @@
+// the arena on top of a block allocator: aligned bump allocation, chunks
+// larger than the default for large requests, reset() and release()
+
+#include <string.h>
+
+#include "tests/check.h"
+#include "tests/region.h"
+#include "treealloc/ArenaAllocator.h"
+
+int main()
+{
+	const uintptr_t regionSize = 16 * 1024 * 1024;
+	char *region = mapRegion(regionSize);
+
+	Blocks blocks;
+	blocks.init();
+	blocks.free(region, regionSize >> 6);
+	const uintptr_t freeBlocks = blocks.getFreeCount();
+
+	os::res::ArenaAllocator<Blocks> arena;
+	arena.init(&blocks, 1024);
+
+	for(uintptr_t i = 0; i < 10000; ++i) {
+		const uintptr_t alignment = ((uintptr_t)1) << (i % 8);
+		const uintptr_t size = (i % 97) + 1;
+		char *mem = (char*)arena.alloc(size, alignment);
+		CHECK(mem != NULL && ((uintptr_t)mem % alignment) == 0);
+		if(mem != NULL) {
+			memset(mem, (int)i, size);
+		}
+	}
+
+	// larger than a default chunk
+	char *large = (char*)arena.alloc(1024 * 1024);
+	CHECK(large != NULL);
+	CHECK(arena.getChunkBytes() > 1024 * 1024);
+
+	// sizes that overflow when rounded fail instead of wrapping around
+	CHECK(arena.alloc(~((uintptr_t)0)) == NULL);
+	CHECK(arena.alloc(~((uintptr_t)0) - 40, 16) == NULL);
+	CHECK(arena.alloc(~((uintptr_t)0) >> 1, ((uintptr_t)1) << 62) == NULL);
+	CHECK(arena.alloc(regionSize) == NULL);
+
+	// reset keeps the newest chunk, release gives everything back
+	arena.reset();
+	CHECK(arena.getChunkBytes() != 0);
+	CHECK(arena.alloc(64) != NULL);
+	arena.release();
+	CHECK(arena.getChunkBytes() == 0);
+	CHECK(blocks.getFreeCount() == freeBlocks);
+
+	unmapRegion(region, regionSize);
+	return CHECK_DONE();
+}
@@ -0,0 +1,58 @@
+/* treealloc_alloc_at_least() returns the usable size with the pointer, and
+ * it and the other allocation calls reject sizes that cannot be allocated
+ * instead of wrapping around */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <malloc.h>
+
+#include "tests/check.h"
+#include "treealloc/treealloc.h"
+
+int main(void)
+{
+	static volatile size_t sizeMax = SIZE_MAX;
+	struct treealloc_sized_ptr sized;
+	void *mem;
+	size_t i;
+
+	for(i = 1; i < 4 * 1024 * 1024; i = i * 5 + 3) {
+		sized = treealloc_alloc_at_least(i);
+		CHECK(sized.ptr != NULL && sized.size >= i);
+		CHECK(sized.ptr == NULL || malloc_usable_size(sized.ptr) == sized.size);
+		if(sized.ptr != NULL) {
+			memset(sized.ptr, 1, sized.size);
+		}
+		free(sized.ptr);
+	}
+
+	sized = treealloc_alloc_at_least(0);
+	CHECK(sized.ptr == NULL && sized.size == 0);
+	sized = treealloc_alloc_at_least(sizeMax);
+	CHECK(sized.ptr == NULL && sized.size == 0);
+	sized = treealloc_alloc_at_least(sizeMax - 20);
+	CHECK(sized.ptr == NULL && sized.size == 0);
+	sized = treealloc_alloc_at_least((sizeMax >> 1) + 1);
+	CHECK(sized.ptr == NULL && sized.size == 0);
+
+	/* the same check covers the other calls, also after small chunks were
+	 * freed to the lock-free stacks */
+	for(i = 0; i < 100; ++i) {
+		free(malloc(16 + i));
+	}
+	CHECK(malloc(sizeMax) == NULL);
+	CHECK(malloc(sizeMax - 20) == NULL);
+	CHECK(malloc((sizeMax >> 1) + 1) == NULL);
+	CHECK(memalign(64, sizeMax) == NULL);
+	CHECK(memalign((sizeMax >> 1) + 1, 16) == NULL);
+	CHECK(malloc_hint(sizeMax, TREEALLOC_LIFETIME_SHORT) == NULL);
+	CHECK(malloc_hint(sizeMax - 20, TREEALLOC_LIFETIME_PERMANENT) == NULL);
+	CHECK(calloc(1, sizeMax) == NULL);
+
+	mem = malloc(100);
+	CHECK(mem != NULL);
+	free(mem);
+
+	return CHECK_DONE();
+}
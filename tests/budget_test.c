@@ -0,0 +1,139 @@
+/* the memory budget: allocations fail instead of mapping beyond it, and the
+ * pressure callbacks can free memory so that they succeed */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tests/check.h"
+#include "treealloc/treealloc.h"
+
+#define MAX_CHUNKS 256
+#define CHUNK (1024 * 1024)
+
+static void *chunks[MAX_CHUNKS];
+static int numChunks = 0;
+static int calls = 0;
+static int releasing = 1;
+static int slow = 0;
+static int go = 0;
+
+static void releaseHalf(size_t needed, void *arg)
+{
+	int i;
+
+	CHECK(needed != 0);
+	CHECK(arg == &calls);
+	if(!releasing) {
+		return;
+	}
+	calls += 1;
+	if(slow) {
+		/* the other thread goes over the budget meanwhile, allocations
+		 * of the callback itself fail */
+		usleep(100 * 1000);
+		CHECK(malloc(128 * CHUNK) == NULL);
+	}
+	for(i = numChunks / 2; i < numChunks; ++i) {
+		free(chunks[i]);
+	}
+	numChunks /= 2;
+}
+
+static void* allocFour(void *arg)
+{
+	(void)arg;
+	while(!__atomic_load_n(&go, __ATOMIC_ACQUIRE)) {
+		usleep(1000);
+	}
+	return malloc(4 * CHUNK);
+}
+
+static void nothing(size_t needed, void *arg)
+{
+	(void)needed;
+	(void)arg;
+}
+
+int main(void)
+{
+	size_t budget;
+	void *mem;
+	int i;
+
+	/* the first allocation reads the tunables and the cgroup limit */
+	free(malloc(16));
+
+	budget = treealloc_get_mapped() + 64 * 1024 * 1024;
+	treealloc_set_budget(budget);
+	CHECK(treealloc_get_budget() == budget);
+
+	while(numChunks < MAX_CHUNKS) {
+		mem = malloc(CHUNK);
+		if(mem == NULL) {
+			break;
+		}
+		memset(mem, 1, CHUNK);
+		chunks[numChunks++] = mem;
+	}
+	CHECK(numChunks > 16 && numChunks < MAX_CHUNKS);
+	CHECK(treealloc_get_mapped() <= budget);
+
+	/* the callback makes room */
+	CHECK(treealloc_register_pressure_callback(NULL, NULL) == EINVAL);
+	CHECK(treealloc_register_pressure_callback(releaseHalf, &calls) == 0);
+	mem = malloc(4 * CHUNK);
+	CHECK(mem != NULL);
+	CHECK(calls >= 1);
+	CHECK(treealloc_get_mapped() <= budget);
+	free(mem);
+
+	/* a thread that goes over the budget while another one runs the
+	 * callbacks waits for them instead of failing. The threads are
+	 * started before the budget is used up. */
+	{
+		pthread_t threads[2];
+		void *results[2];
+		for(i = 0; i < 2; ++i) {
+			CHECK(pthread_create(&threads[i], NULL, allocFour, NULL) == 0);
+		}
+		releasing = 0;
+		while(numChunks < MAX_CHUNKS) {
+			mem = malloc(CHUNK);
+			if(mem == NULL) {
+				break;
+			}
+			memset(mem, 1, CHUNK);
+			chunks[numChunks++] = mem;
+		}
+		releasing = 1;
+		slow = 1;
+		__atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+		for(i = 0; i < 2; ++i) {
+			pthread_join(threads[i], &results[i]);
+			CHECK(results[i] != NULL);
+			free(results[i]);
+		}
+	}
+	slow = 0;
+
+	/* without a budget there is no limit */
+	treealloc_set_budget(0);
+	CHECK(treealloc_get_budget() == 0);
+	mem = malloc(128 * CHUNK);
+	CHECK(mem != NULL);
+	free(mem);
+
+	/* at most 8 callbacks are kept */
+	for(i = 1; i < 8; ++i) {
+		CHECK(treealloc_register_pressure_callback(nothing, NULL) == 0);
+	}
+	CHECK(treealloc_register_pressure_callback(nothing, NULL) == ENOMEM);
+
+	for(i = 0; i < numChunks; ++i) {
+		free(chunks[i]);
+	}
+	return CHECK_DONE();
+}
@@ -0,0 +1,21 @@
+/* minimal checks for the tests, each test is a program that returns 0 if
+ * all of its checks passed. Build and run them with "make test". */
+
+#ifndef   TREEALLOC_CHECK_HEADER
+#define   TREEALLOC_CHECK_HEADER
+
+#include <stdio.h>
+#include <stdint.h>
+
+static int checkFailures = 0;
+
+#define CHECK(cond) do { \
+	if(!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		checkFailures += 1; \
+	} \
+} while(0)
+
+#define CHECK_DONE() (checkFailures == 0 ? 0 : 1)
+
+#endif /* TREEALLOC_CHECK_HEADER */
@@ -0,0 +1,114 @@
+// the block allocator with CompactFreeBlock and 32 byte blocks: allocations
+// of all kinds, freeing everything merges back into one run, and the links
+// stay valid when the region is moved and the base is set again
+
+#include <string.h>
+
+#include "tests/check.h"
+#include "tests/region.h"
+#include "treealloc/TreeBlockAllocator.h"
+#include "treealloc/CompactFreeBlock.h"
+
+typedef os::res::CompactFreeBlock<5> Block;
+typedef os::res::TreeBlockAllocatorGeneric<5, Block, os::res::NoLocker> CompactBlocks;
+
+static const uintptr_t REGION_SIZE = 16 * 1024 * 1024;
+static const uintptr_t REGION_BLOCKS = REGION_SIZE >> 5;
+static const uintptr_t CHUNKS = 2000;
+
+static void *chunks[CHUNKS];
+static uintptr_t chunkBlocks[CHUNKS];
+
+static bool filled(void *mem, uintptr_t blocks, int value)
+{
+	const unsigned char *bytes = (const unsigned char*)mem;
+	for(uintptr_t i = 0; i < (blocks << 5); ++i) {
+		if(bytes[i] != (unsigned char)value) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int main()
+{
+	char *region = mapRegion(REGION_SIZE);
+	char *moved = mapRegion(REGION_SIZE);
+
+	Block::setBase((uintptr_t)region);
+	CHECK(Block::getBase() == (uintptr_t)region);
+
+	CompactBlocks blocks;
+	blocks.init();
+	blocks.free(region, REGION_BLOCKS);
+	CHECK(blocks.getFreeCount() == REGION_BLOCKS);
+	CHECK(blocks.getLargestFree() == REGION_SIZE);
+
+	// sizes of one block up to a few thousand, same sizes share a ring
+	for(uintptr_t i = 0; i < CHUNKS; ++i) {
+		chunkBlocks[i] = (i * 7919) % 97 + 1 + (i % 10 == 0 ? 1000 : 0);
+		chunks[i] = blocks.alloc(chunkBlocks[i]);
+		CHECK(chunks[i] != nullptr);
+		if(chunks[i] != nullptr) {
+			memset(chunks[i], (int)(i & 0xff), chunkBlocks[i] << 5);
+		}
+	}
+	CHECK(blocks.check());
+
+	// every other chunk, so the free runs cannot merge
+	for(uintptr_t i = 0; i < CHUNKS; i += 2) {
+		blocks.free(chunks[i], chunkBlocks[i]);
+		chunks[i] = nullptr;
+	}
+	blocks.flushDeferred();
+	CHECK(blocks.check());
+
+	void *aligned = blocks.allocAligned(4096, 10);
+	CHECK(aligned != nullptr && ((uintptr_t)aligned & 4095) == 0);
+	uintptr_t atLeast = 3;
+	void *more = blocks.allocAtLeast(&atLeast);
+	CHECK(more != nullptr && atLeast >= 3);
+	void *below = blocks.allocBelow(4, (uintptr_t)region + REGION_SIZE / 2);
+	CHECK(below != nullptr && (uintptr_t)below < (uintptr_t)region + REGION_SIZE / 2);
+	void *near = blocks.allocNear((uintptr_t)region + REGION_SIZE / 4, 2);
+	CHECK(near != nullptr);
+	uintptr_t got = 0;
+	void *range = blocks.allocRange(50, 5000, 64, &got);
+	CHECK(range != nullptr && got >= 50 && got <= 5000 && ((uintptr_t)range & 63) == 0);
+	CHECK(blocks.check());
+
+	// move the whole region, the links are relative to the base
+	blocks.flushDeferred();
+	memcpy(moved, region, REGION_SIZE);
+	const intptr_t delta = moved - region;
+	Block::setBase((uintptr_t)moved);
+	blocks.relocate(delta);
+	unmapRegion(region, REGION_SIZE);
+	CHECK(blocks.check());
+
+	for(uintptr_t i = 1; i < CHUNKS; i += 2) {
+		char *mem = (char*)chunks[i] + delta;
+		CHECK(chunks[i] == nullptr || filled(mem, chunkBlocks[i], (int)(i & 0xff)));
+		if(chunks[i] != nullptr) {
+			blocks.free(mem, chunkBlocks[i]);
+		}
+	}
+	blocks.free((char*)aligned + delta, 10);
+	blocks.free((char*)more + delta, atLeast);
+	blocks.free((char*)below + delta, 4);
+	blocks.free((char*)near + delta, 2);
+	blocks.free((char*)range + delta, got);
+	blocks.flushDeferred();
+	CHECK(blocks.check());
+
+	// everything merged back into the region
+	CHECK(blocks.getFreeCount() == REGION_BLOCKS);
+	CHECK(blocks.getLargestFree() == REGION_SIZE);
+	void *all = blocks.alloc(REGION_BLOCKS);
+	CHECK(all == moved);
+	CHECK(blocks.alloc(1) == nullptr);
+	CHECK(blocks.alloc(0) == nullptr);
+
+	unmapRegion(moved, REGION_SIZE);
+	return CHECK_DONE();
+}
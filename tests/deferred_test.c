@@ -0,0 +1,55 @@
+/* deferred coalescing: freed chunks are reused from the quick lists, and
+ * once everything is freed the deferred chunks do not keep the regions
+ * around them mapped */
+
+#include <stdlib.h>
+#include <malloc.h>
+#include <string.h>
+
+#include "tests/check.h"
+#include "treealloc/treealloc.h"
+
+#define COUNT 131072
+#define SIZE 1000
+
+static void *chunks[COUNT];
+
+int main(void)
+{
+	struct treealloc_mallinfo info;
+	size_t mapped, i;
+	void *mem;
+
+	CHECK(mallopt(TREEALLOC_M_DEFERRED, 256 * 1024) == 1);
+
+	/* the chunk freed last is the one reused first */
+	mem = malloc(SIZE);
+	CHECK(mem != NULL);
+	free(mem);
+	CHECK(malloc(SIZE) == mem);
+	free(mem);
+
+	mapped = treealloc_get_mapped();
+	for(i = 0; i < COUNT; ++i) {
+		chunks[i] = malloc(SIZE);
+		CHECK(chunks[i] != NULL);
+		memset(chunks[i], (int)i, SIZE);
+	}
+	CHECK(treealloc_get_mapped() >= mapped + COUNT * SIZE);
+
+	/* free in an order that spreads the chunks freed last over all
+	 * regions */
+	for(i = 0; i < COUNT; ++i) {
+		free(chunks[(i * 7919) % COUNT]);
+	}
+
+	info = treealloc_get_mallinfo();
+	CHECK(info.fsmblks <= 256 * 1024 * 2);
+	CHECK(treealloc_get_mapped() < mapped + 16 * 1024 * 1024);
+
+	CHECK(mallopt(TREEALLOC_M_DEFERRED, 0) == 1);
+	info = treealloc_get_mallinfo();
+	CHECK(info.fsmblks == 0);
+
+	return CHECK_DONE();
+}
@@ -0,0 +1,94 @@
+/* requests are routed to the block engine for their size: small ones to 64
+ * byte blocks, from 32 KB on to 4 KB blocks and from 512 KB on to 64 KB
+ * blocks. An allocation starts with its header at the start of a block, so
+ * its offset within the block and its usable size show the engine. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <malloc.h>
+
+#include "tests/check.h"
+#include "treealloc/treealloc.h"
+
+#define KB 1024
+
+/* the header offset, the same for all blocks of all engines */
+static size_t header;
+
+static int inEngine(void *mem, size_t block)
+{
+	const size_t offset = (size_t)((uintptr_t)mem & (block - 1));
+	return mem != NULL && offset == header && (malloc_usable_size(mem) + header) % block == 0;
+}
+
+static void fill(void *mem, size_t size, int value)
+{
+	if(mem != NULL) {
+		memset(mem, value, size);
+	}
+}
+
+int main(void)
+{
+	static const size_t sizes[] = {1, 100, 4000, 32 * KB - 100, 32 * KB, 100 * KB, 511 * KB, 512 * KB, 3000 * KB};
+	void *mem[sizeof(sizes) / sizeof(sizes[0])];
+	unsigned char *grown;
+	size_t i;
+
+	mem[0] = malloc(1);
+	CHECK(mem[0] != NULL);
+	header = (size_t)((uintptr_t)mem[0] & 63);
+	CHECK(header != 0 && header < 64);
+	free(mem[0]);
+
+	for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		const size_t size = sizes[i];
+		const size_t block = size + header >= 512 * KB ? 64 * KB : (size + header >= 32 * KB ? 4 * KB : 64);
+
+		mem[i] = malloc(size);
+		CHECK(inEngine(mem[i], block));
+		/* a small request never gets a large block, it would waste it */
+		CHECK(mem[i] == NULL || malloc_usable_size(mem[i]) < size + block);
+		fill(mem[i], size, (int)i);
+	}
+	for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		free(mem[i]);
+	}
+
+	/* aligned requests count the alignment into the size, the header is
+	 * in front of the aligned address then */
+	mem[0] = memalign(16 * KB, 20 * KB);
+	CHECK(mem[0] != NULL && ((uintptr_t)mem[0] & (16 * KB - 1)) == 0);
+	CHECK(mem[0] == NULL || malloc_usable_size(mem[0]) >= 20 * KB);
+	fill(mem[0], 20 * KB, 3);
+	free(mem[0]);
+
+	/* an explicit engine overrides the size */
+	mem[0] = mallocx(100, TREEALLOC_X_ENGINE(TREEALLOC_ENGINE_LARGE));
+	CHECK(inEngine(mem[0], 64 * KB));
+	mem[1] = mallocx(600 * KB, TREEALLOC_X_ENGINE(TREEALLOC_ENGINE_SMALL));
+	CHECK(inEngine(mem[1], 64) && malloc_usable_size(mem[1]) < 600 * KB + 64);
+	mem[2] = mallocx(100, TREEALLOC_X_ENGINE(TREEALLOC_ENGINE_MEDIUM));
+	CHECK(inEngine(mem[2], 4 * KB));
+	for(i = 0; i < 3; ++i) {
+		fill(mem[i], 100, 1);
+		free(mem[i]);
+	}
+
+	/* realloc keeps the data, whether it grows in place or moves to the
+	 * engine of the new size */
+	grown = malloc(100);
+	CHECK(grown != NULL);
+	fill(grown, 100, 7);
+	grown = realloc(grown, 100 * KB);
+	CHECK(grown != NULL && grown[0] == 7 && grown[99] == 7);
+	fill(grown, 100 * KB, 8);
+	grown = realloc(grown, 1024 * KB);
+	CHECK(grown != NULL && grown[0] == 8 && grown[100 * KB - 1] == 8);
+	grown = realloc(grown, 10);
+	CHECK(grown != NULL && grown[0] == 8 && grown[9] == 8);
+	free(grown);
+
+	return CHECK_DONE();
+}
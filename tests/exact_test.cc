@@ -0,0 +1,108 @@
+// the exact-fit index of the block allocator: a freed size is reused by the
+// next request of that size, sizes that share a slot do not confuse it, and
+// it stays consistent with the size tree through random allocations, frees
+// and a relocation
+
+#include <string.h>
+
+#include "tests/check.h"
+#include "tests/region.h"
+
+static const uintptr_t REGION_SIZE = 32 * 1024 * 1024;
+static const uintptr_t REGION_BLOCKS = REGION_SIZE >> 6;
+static const uintptr_t CHUNKS = 4096;
+
+static void *chunks[CHUNKS];
+static uintptr_t chunkBlocks[CHUNKS];
+
+static uintptr_t seed = 12345;
+
+static uintptr_t nextRandom()
+{
+	seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+	return seed >> 33;
+}
+
+int main()
+{
+	char *region = mapRegion(REGION_SIZE);
+	char *moved = mapRegion(REGION_SIZE);
+
+	Blocks blocks;
+	blocks.init();
+	blocks.free(region, REGION_BLOCKS);
+
+	// separated holes of 5, 69 and 133 blocks, which share a slot
+	void *a = blocks.alloc(5);
+	void *sepA = blocks.alloc(1);
+	void *b = blocks.alloc(69);
+	void *sepB = blocks.alloc(1);
+	void *c = blocks.alloc(133);
+	void *sepC = blocks.alloc(1);
+	CHECK(a != nullptr && b != nullptr && c != nullptr);
+	CHECK(sepA != nullptr && sepB != nullptr && sepC != nullptr);
+	blocks.free(c, 133);
+	blocks.free(a, 5);
+	blocks.free(b, 69);
+	CHECK(blocks.check());
+
+	// each request takes the hole of its size, whichever was added last
+	CHECK(blocks.alloc(133) == c);
+	CHECK(blocks.alloc(5) == a);
+	CHECK(blocks.alloc(69) == b);
+	CHECK(blocks.check());
+
+	// a size between them takes the next larger hole
+	blocks.free(b, 69);
+	blocks.free(c, 133);
+	CHECK(blocks.alloc(70) == c);
+	CHECK(blocks.alloc(69) == b);
+	blocks.free(a, 5);
+	blocks.free(b, 69);
+	blocks.free(c, 70);
+	blocks.free(sepA, 1);
+	blocks.free(sepB, 1);
+	blocks.free(sepC, 1);
+	CHECK(blocks.check());
+	CHECK(blocks.getFreeCount() == REGION_BLOCKS);
+
+	// random sizes, many of them equal or in the same slot
+	for(uintptr_t round = 0; round < 20; ++round) {
+		for(uintptr_t i = 0; i < CHUNKS; ++i) {
+			if(chunks[i] != nullptr && (nextRandom() & 1) != 0) {
+				blocks.free(chunks[i], chunkBlocks[i]);
+				chunks[i] = nullptr;
+			}
+		}
+		for(uintptr_t i = 0; i < CHUNKS; ++i) {
+			if(chunks[i] == nullptr) {
+				chunkBlocks[i] = (nextRandom() % 4 == 0) ? nextRandom() % 300 + 1 : (nextRandom() % 4) * 64 + 3;
+				chunks[i] = blocks.alloc(chunkBlocks[i]);
+				CHECK(chunks[i] != nullptr);
+				if(chunks[i] != nullptr) {
+					memset(chunks[i], (int)i, chunkBlocks[i] << 6);
+				}
+			}
+		}
+		CHECK(blocks.check());
+	}
+
+	// the index moves with the free blocks
+	memcpy(moved, region, REGION_SIZE);
+	const intptr_t delta = moved - region;
+	blocks.relocate(delta);
+	unmapRegion(region, REGION_SIZE);
+	CHECK(blocks.check());
+
+	for(uintptr_t i = 0; i < CHUNKS; ++i) {
+		unsigned char *mem = (unsigned char*)chunks[i] + delta;
+		CHECK(mem[0] == (unsigned char)i && mem[(chunkBlocks[i] << 6) - 1] == (unsigned char)i);
+		blocks.free(mem, chunkBlocks[i]);
+	}
+	CHECK(blocks.check());
+	CHECK(blocks.getFreeCount() == REGION_BLOCKS);
+	CHECK(blocks.alloc(REGION_BLOCKS) == moved);
+
+	unmapRegion(moved, REGION_SIZE);
+	return CHECK_DONE();
+}
@@ -0,0 +1,56 @@
+/* repeatedly grown allocations get geometric slack, so growing one in small
+ * steps moves it only a logarithmic number of times */
+
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+#include "tests/check.h"
+
+#define STEP 64
+#define FINAL (4 * 1024 * 1024)
+
+static void *blockers[FINAL / STEP];
+
+int main(void)
+{
+	unsigned char *mem = NULL, *out;
+	size_t size, moves = 0, numBlockers = 0, i;
+	int valid = 1;
+
+	for(size = STEP; size <= FINAL; size += STEP) {
+		out = realloc(mem, size);
+		if(out == NULL) {
+			valid = 0;
+			break;
+		}
+		if(out != mem && mem != NULL) {
+			moves += 1;
+			/* after the second move there is slack for half the size */
+			if(moves >= 2) {
+				CHECK(malloc_usable_size(out) >= size + size / 2 - STEP);
+			}
+		}
+		for(i = 0; i < size - STEP; i += 509) {
+			if(out[i] != (unsigned char)(i % 251)) {
+				valid = 0;
+			}
+		}
+		for(i = size - STEP; i < size; ++i) {
+			out[i] = (unsigned char)(i % 251);
+		}
+		mem = out;
+
+		/* something right behind it, so it cannot always grow in place */
+		blockers[numBlockers++] = malloc(16);
+	}
+
+	CHECK(valid);
+	CHECK(moves > 0 && moves < 64);
+
+	free(mem);
+	for(i = 0; i < numBlockers; ++i) {
+		free(blockers[i]);
+	}
+	return CHECK_DONE();
+}
@@ -0,0 +1,54 @@
+/* independent heaps: allocation, reuse after heap_free(), growth beyond the
+ * first region and bulk destroy */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tests/check.h"
+#include "treealloc/treealloc.h"
+
+int main(void)
+{
+	heap_t *heap = heap_create();
+	heap_t *other = heap_create();
+	char *small, *large;
+	void *again;
+	int i;
+
+	CHECK(heap != NULL && other != NULL && heap != other);
+
+	CHECK(heap_alloc(heap, 0) == NULL);
+	CHECK(heap_alloc(heap, (size_t)-1) == NULL);
+	CHECK(heap_alloc(heap, (size_t)-1 - 64) == NULL);
+	CHECK(heap_alloc(NULL, 16) == NULL);
+
+	small = heap_alloc(heap, 100);
+	CHECK(small != NULL && ((uintptr_t)small % 16) == 0);
+	memset(small, 0xab, 100);
+
+	/* the same size is served from the freed blocks again */
+	heap_free(heap, small);
+	again = heap_alloc(heap, 100);
+	CHECK(again == small);
+
+	/* larger than the first region, a new one is mapped */
+	large = heap_alloc(heap, 8 * 1024 * 1024);
+	CHECK(large != NULL);
+	if(large != NULL) {
+		memset(large, 0xcd, 8 * 1024 * 1024);
+		CHECK(large[8 * 1024 * 1024 - 1] == (char)0xcd);
+	}
+
+	/* allocations of the other heap are not affected by this one */
+	for(i = 0; i < 1000; ++i) {
+		CHECK(heap_alloc(other, 48) != NULL);
+	}
+
+	heap_free(heap, NULL);
+	heap_free(NULL, again);
+	heap_destroy(heap);
+	heap_destroy(other);
+	heap_destroy(NULL);
+
+	return CHECK_DONE();
+}
@@ -0,0 +1,84 @@
+/* malloc_hint() keeps small objects of different lifetimes in separate
+ * regions, so freeing all short-lived ones gives their memory back even if
+ * long-lived ones were allocated in between */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <malloc.h>
+
+#include "tests/check.h"
+#include "treealloc/treealloc.h"
+
+#define COUNT 40000
+#define SIZE 200
+#define KEPT 100
+
+static char *shortLived[COUNT];
+static char *longLived[KEPT];
+
+int main(void)
+{
+	static volatile size_t sizeMax = SIZE_MAX;
+	size_t before, peak;
+	char *mem;
+	int i;
+
+	before = treealloc_get_mallinfo().arena;
+	for(i = 0; i < COUNT; ++i) {
+		shortLived[i] = malloc_hint(SIZE, TREEALLOC_LIFETIME_SHORT);
+		CHECK(shortLived[i] != NULL);
+		if(shortLived[i] != NULL) {
+			memset(shortLived[i], 1, SIZE);
+		}
+		if(i % (COUNT / KEPT) == 0) {
+			longLived[i / (COUNT / KEPT)] = malloc_hint(SIZE, TREEALLOC_LIFETIME_LONG);
+		}
+	}
+	peak = treealloc_get_mallinfo().arena;
+	CHECK(peak >= before + (size_t)COUNT * SIZE);
+
+	/* the long-lived objects lie next to each other, not between the
+	 * short-lived ones */
+	for(i = 0; i < KEPT; ++i) {
+		CHECK(longLived[i] != NULL);
+		CHECK(i == 0 || (uintptr_t)(longLived[i] - longLived[i - 1]) < 4 * SIZE);
+		if(longLived[i] != NULL) {
+			memset(longLived[i], 2, SIZE);
+		}
+	}
+
+	for(i = 0; i < COUNT; ++i) {
+		free(shortLived[i]);
+	}
+	malloc_trim(0);
+	CHECK(treealloc_get_mallinfo().arena < peak - (size_t)COUNT * SIZE / 2);
+
+	/* hinted memory is resized and freed as any other */
+	for(i = 0; i < KEPT; ++i) {
+		CHECK(longLived[i][0] == 2 && longLived[i][SIZE - 1] == 2);
+		longLived[i] = realloc(longLived[i], 100 * SIZE);
+		CHECK(longLived[i] != NULL && longLived[i][SIZE - 1] == 2);
+		free(longLived[i]);
+	}
+
+	mem = malloc_hint(SIZE, TREEALLOC_LIFETIME_PERMANENT);
+	CHECK(mem != NULL && malloc_usable_size(mem) >= SIZE);
+	free(mem);
+	mem = malloc_hint(SIZE, 0);
+	CHECK(mem != NULL);
+	free(mem);
+	mem = malloc_hint(SIZE, 12345);
+	CHECK(mem != NULL);
+	free(mem);
+	/* large requests are placed as by malloc() */
+	mem = malloc_hint(4 * 1024 * 1024, TREEALLOC_LIFETIME_SHORT);
+	CHECK(mem != NULL && malloc_usable_size(mem) >= 4 * 1024 * 1024);
+	free(mem);
+
+	CHECK(malloc_hint(0, TREEALLOC_LIFETIME_SHORT) == NULL);
+	CHECK(malloc_hint(sizeMax, TREEALLOC_LIFETIME_LONG) == NULL);
+	CHECK(malloc_hint(sizeMax - 20, 0) == NULL);
+
+	return CHECK_DONE();
+}
@@ -0,0 +1,121 @@
+/* the statistics of malloc_usable_size(), mallinfo2() and malloc_info():
+ * the global totals of malloc_info() are the sums of the heaps, and the
+ * maximum of the system memory stays at the peak after memory is unmapped */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+#include "tests/check.h"
+#include "treealloc/treealloc.h"
+
+#define MB (1024 * 1024)
+#define COUNT 10000
+
+static void *chunks[COUNT];
+
+struct info
+{
+	size_t heapFastCount;
+	size_t heapFastSize;
+	size_t fastCount;
+	size_t fastSize;
+	size_t current;
+	size_t max;
+	int heaps;
+};
+
+/* reads the numbers out of the output of malloc_info() */
+static int readInfo(struct info *out)
+{
+	FILE *fp = tmpfile();
+	char line[256];
+	size_t count, size;
+	int inHeap = 0;
+
+	memset(out, 0, sizeof(*out));
+	if(fp == NULL || malloc_info(0, fp) != 0) {
+		return 0;
+	}
+
+	rewind(fp);
+	while(fgets(line, sizeof(line), fp) != NULL) {
+		if(strncmp(line, "<heap ", 6) == 0) {
+			inHeap = 1;
+			out->heaps += 1;
+		} else if(strncmp(line, "</heap>", 7) == 0) {
+			inHeap = 0;
+		} else if(sscanf(line, "<total type=\"fast\" count=\"%zu\" size=\"%zu\"/>", &count, &size) == 2) {
+			if(inHeap) {
+				out->heapFastCount += count;
+				out->heapFastSize += size;
+			} else {
+				out->fastCount = count;
+				out->fastSize = size;
+			}
+		} else if(sscanf(line, "<system type=\"current\" size=\"%zu\"/>", &size) == 1) {
+			out->current = size;
+		} else if(sscanf(line, "<system type=\"max\" size=\"%zu\"/>", &size) == 1) {
+			out->max = size;
+		}
+	}
+
+	fclose(fp);
+	return 1;
+}
+
+int main(void)
+{
+	struct treealloc_mallinfo mi;
+	struct info info;
+	size_t i;
+	void *mem;
+
+	CHECK(malloc_usable_size(NULL) == 0);
+	mem = malloc(100);
+	CHECK(mem != NULL && malloc_usable_size(mem) >= 100);
+	free(mem);
+
+	CHECK(malloc_info(1, stdout) == -1);
+	CHECK(malloc_info(0, NULL) == -1);
+
+	/* deferred chunks in more than one heap */
+	CHECK(mallopt(TREEALLOC_M_DEFERRED, 256 * 1024) == 1);
+	for(i = 0; i < COUNT; ++i) {
+		chunks[i] = malloc(i % 2 == 0 ? 64 : 40000);
+		CHECK(chunks[i] != NULL);
+	}
+	for(i = 0; i < COUNT; i += 3) {
+		free(chunks[i]);
+		chunks[i] = NULL;
+	}
+
+	CHECK(readInfo(&info));
+	CHECK(info.heaps >= 3);
+	CHECK(info.fastSize == info.heapFastSize);
+	CHECK(info.fastCount == info.heapFastCount);
+	CHECK(info.fastCount != 0);
+	CHECK(info.max >= info.current);
+
+	/* the frees inside malloc_info() may have merged some deferred chunks */
+	mi = treealloc_get_mallinfo();
+	CHECK(mi.fsmblks != 0 && mi.fsmblks <= mi.fordblks);
+	CHECK(mi.arena >= mi.fordblks && mi.uordblks == mi.arena - mi.fordblks);
+
+	for(i = 0; i < COUNT; ++i) {
+		free(chunks[i]);
+	}
+
+	/* the peak stays after a large mapping is given back */
+	mem = malloc(64 * MB);
+	CHECK(mem != NULL);
+	free(mem);
+	malloc_trim(0);
+	CHECK(readInfo(&info));
+	CHECK(info.max >= 64 * MB);
+	CHECK(info.current < info.max);
+	CHECK(treealloc_get_mallinfo().arena <= info.max);
+
+	return CHECK_DONE();
+}
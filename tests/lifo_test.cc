@@ -0,0 +1,57 @@
+// same-size blocks are reused last in, first out: directly from the size
+// tree, after the quick lists were merged and after the stacks were drained
+
+#include "tests/check.h"
+#include "tests/region.h"
+
+static const uintptr_t REGION_SIZE = 1024 * 1024;
+static const uintptr_t CHUNKS = 20;
+
+enum Mode { MERGED, QUICK_LISTS, STACKS, MODES };
+
+int main()
+{
+	char *region = mapRegion(REGION_SIZE);
+
+	for(int mode = MERGED; mode < MODES; ++mode) {
+		Blocks blocks;
+		blocks.init();
+		blocks.free(region, REGION_SIZE >> 6);
+		blocks.setDeferredLimit(mode == MERGED ? 0 : 1000);
+
+		void *chunks[CHUNKS];
+		for(uintptr_t i = 0; i < CHUNKS; ++i) {
+			chunks[i] = blocks.alloc(2);
+			CHECK(chunks[i] != nullptr);
+		}
+
+		// every other chunk, so they cannot merge with each other or with
+		// the rest of the region behind the last one
+		for(uintptr_t i = 1; i < CHUNKS - 1; i += 2) {
+			if(mode == STACKS) {
+				CHECK(blocks.pushFree(chunks[i], 2));
+			}
+			else {
+				blocks.free(chunks[i], 2);
+			}
+		}
+		blocks.flushDeferred();
+		CHECK(blocks.getDeferredCount() == 0);
+		CHECK(blocks.check());
+
+		for(uintptr_t i = CHUNKS - 3; i < CHUNKS; i -= 2) {
+			void *mem = blocks.alloc(2);
+			CHECK(mem == chunks[i]);
+			chunks[i] = mem;
+		}
+
+		for(uintptr_t i = 0; i < CHUNKS; ++i) {
+			blocks.free(chunks[i], 2, false);
+		}
+		CHECK(blocks.check());
+		CHECK(blocks.getFreeCount() == REGION_SIZE >> 6);
+	}
+
+	unmapRegion(region, REGION_SIZE);
+	return CHECK_DONE();
+}
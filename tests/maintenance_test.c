@@ -0,0 +1,81 @@
+/* the maintenance thread: only one of several racing starts succeeds,
+ * free() leaves the unmapping to the thread and the thread does it */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "tests/check.h"
+#include "treealloc/treealloc.h"
+
+#define THREADS 8
+#define COUNT 65536
+#define SIZE 1000
+
+static void *chunks[COUNT];
+static int results[THREADS];
+static int go = 0;
+
+static void* startThread(void *arg)
+{
+	int *result = arg;
+	while(!__atomic_load_n(&go, __ATOMIC_ACQUIRE)) {
+	}
+	*result = treealloc_maintenance_start(1000, 0);
+	return NULL;
+}
+
+int main(void)
+{
+	pthread_t threads[THREADS];
+	size_t mapped, i;
+	int started = 0, busy = 0, waited;
+
+	CHECK(treealloc_maintenance_start(0, 0) == EINVAL);
+
+	for(i = 0; i < THREADS; ++i) {
+		CHECK(pthread_create(&threads[i], NULL, startThread, &results[i]) == 0);
+	}
+	__atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+	for(i = 0; i < THREADS; ++i) {
+		pthread_join(threads[i], NULL);
+		started += results[i] == 0;
+		busy += results[i] == EBUSY;
+	}
+	CHECK(started == 1);
+	CHECK(busy == THREADS - 1);
+	treealloc_maintenance_stop();
+	treealloc_maintenance_stop();
+
+	CHECK(treealloc_maintenance_start(20, 0) == 0);
+
+	mapped = treealloc_get_mapped();
+	for(i = 0; i < COUNT; ++i) {
+		chunks[i] = malloc(SIZE);
+		CHECK(chunks[i] != NULL);
+		memset(chunks[i], 1, SIZE);
+	}
+
+	/* the ends cut off the aligned mappings of the large engine are
+	 * unmapped by the thread too */
+	for(i = 0; i < 16; ++i) {
+		void *mem = malloc(1024 * 1024);
+		CHECK(mem != NULL);
+		free(mem);
+	}
+
+	for(i = 0; i < COUNT; ++i) {
+		free(chunks[i]);
+	}
+
+	/* the thread gives the memory back within a few intervals */
+	for(waited = 0; waited < 200 && treealloc_get_mapped() > mapped + 8 * 1024 * 1024; ++waited) {
+		usleep(10000);
+	}
+	CHECK(treealloc_get_mapped() <= mapped + 8 * 1024 * 1024);
+
+	treealloc_maintenance_stop();
+	return CHECK_DONE();
+}
@@ -0,0 +1,88 @@
+/* the copy and zero kernels give the same result as the C library for all
+ * sizes and misalignments, also through the thresholds of memops_copy() and
+ * memops_zero() and through calloc() */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tests/check.h"
+#include "memops.h"
+
+#define MAX_SIZE (3 * 1024 * 1024)
+
+static unsigned char src[MAX_SIZE + 64];
+static unsigned char dst[MAX_SIZE + 64];
+
+static const size_t sizes[] = {0, 1, 15, 16, 17, 63, 64, 65, 255, 4096, 4097, 65535, 1024 * 1024 + 3, MAX_SIZE};
+
+int main(void)
+{
+	size_t i, s, offset;
+	int kernel, supported = 0;
+	unsigned char *mem;
+
+	for(i = 0; i < sizeof(src); ++i) {
+		src[i] = (unsigned char)(i * 7 + (i >> 9));
+	}
+
+	for(kernel = 0; kernel < MEMOPS_KERNELS; ++kernel) {
+		if(!memops_zero_with((enum memops_kernel)kernel, dst, 1)) {
+			continue;
+		}
+		supported += 1;
+
+		for(s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+			for(offset = 0; offset < 3; ++offset) {
+				const size_t dstOffset = offset * 7;
+				const size_t srcOffset = offset * 5;
+				const size_t size = sizes[s];
+
+				memset(dst, 0xee, sizeof(dst));
+				CHECK(memops_copy_with((enum memops_kernel)kernel, dst + dstOffset, src + srcOffset, size));
+				CHECK(memcmp(dst + dstOffset, src + srcOffset, size) == 0);
+				CHECK(dst[dstOffset + size] == 0xee);
+				CHECK(dstOffset == 0 || dst[dstOffset - 1] == 0xee);
+
+				CHECK(memops_zero_with((enum memops_kernel)kernel, dst + dstOffset, size));
+				for(i = 0; i < size; ++i) {
+					if(dst[dstOffset + i] != 0) {
+						break;
+					}
+				}
+				CHECK(i == size);
+				CHECK(dst[dstOffset + size] == 0xee);
+			}
+		}
+	}
+	CHECK(supported >= 2);
+	CHECK(memops_get_kernel() < MEMOPS_KERNELS);
+
+	/* the default functions, with thresholds low enough for the kernels */
+	memops_set_thresholds(4096, 4096);
+	for(s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+		memset(dst, 0xee, sizeof(dst));
+		memops_copy(dst + 3, src + 1, sizes[s]);
+		CHECK(memcmp(dst + 3, src + 1, sizes[s]) == 0 && dst[3 + sizes[s]] == 0xee);
+		memops_zero(dst + 3, sizes[s]);
+		for(i = 0; i < sizes[s] && dst[3 + i] == 0; ++i) {
+		}
+		CHECK(i == sizes[s] && dst[3 + sizes[s]] == 0xee);
+	}
+
+	/* calloc() clears memory that was used before */
+	mem = malloc(MAX_SIZE);
+	CHECK(mem != NULL);
+	memset(mem, 0xff, MAX_SIZE);
+	free(mem);
+	mem = calloc(1, MAX_SIZE);
+	CHECK(mem != NULL);
+	for(i = 0; mem != NULL && i < MAX_SIZE; ++i) {
+		if(mem[i] != 0) {
+			break;
+		}
+	}
+	CHECK(i == MAX_SIZE);
+	free(mem);
+
+	return CHECK_DONE();
+}
@@ -0,0 +1,154 @@
+/* movable allocations: compaction moves them down and keeps their contents,
+ * pinned ones stay in place, also when they are pinned during compaction,
+ * pinned ones that are freed stay until the last unpin, and freed handles
+ * are reused */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "tests/check.h"
+#include "treealloc/treealloc.h"
+
+#define HANDLES 20000
+#define SIZE 200
+
+static size_t handles[HANDLES];
+static int stop = 0;
+static int errors = 0;
+
+/* pins every fourth handle over and over and writes to them, every write has
+ * to survive compaction */
+static void* writer(void *arg)
+{
+	int i, round = 0;
+
+	(void)arg;
+	while(!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+		round += 1;
+		for(i = 1; i < HANDLES; i += 4) {
+			unsigned char *mem = movable_pin(handles[i]);
+			if(mem == NULL) {
+				errors += 1;
+				continue;
+			}
+			memset(mem, (i + round) & 0xff, SIZE);
+			movable_unpin(handles[i]);
+		}
+	}
+	return (void*)(intptr_t)round;
+}
+
+static int holds(size_t handle, int value)
+{
+	const unsigned char *mem = movable_pin(handle);
+	int i, out = mem != NULL;
+
+	for(i = 0; out && i < SIZE; ++i) {
+		out = mem[i] == (unsigned char)value;
+	}
+	movable_unpin(handle);
+	return out;
+}
+
+int main(void)
+{
+	static volatile size_t sizeMax = SIZE_MAX;
+	void *pinned, *mem;
+	size_t moved, handle, other;
+	int i;
+
+	CHECK(movable_alloc(0) == 0);
+	CHECK(movable_alloc(sizeMax) == 0);
+	CHECK(movable_alloc(sizeMax - 20) == 0);
+	CHECK(movable_pin(0) == NULL);
+	CHECK(movable_pin(12345678) == NULL);
+	movable_free(0);
+	movable_free(12345678);
+	movable_unpin(0);
+
+	for(i = 0; i < HANDLES; ++i) {
+		handles[i] = movable_alloc(SIZE);
+		CHECK(handles[i] != 0);
+		mem = movable_pin(handles[i]);
+		CHECK(mem != NULL);
+		if(mem != NULL) {
+			memset(mem, i & 0xff, SIZE);
+		}
+		movable_unpin(handles[i]);
+	}
+
+	/* holes everywhere, one allocation at the end stays pinned */
+	for(i = 0; i < HANDLES - 1; i += 2) {
+		movable_free(handles[i]);
+		handles[i] = 0;
+	}
+	pinned = movable_pin(handles[HANDLES - 1]);
+	CHECK(pinned != NULL);
+
+	/* a budget stops after the allocation that reaches it */
+	moved = treealloc_compact(SIZE);
+	CHECK(moved >= SIZE && moved < 2 * SIZE);
+
+	moved = treealloc_compact(0);
+	CHECK(moved >= SIZE);
+	CHECK(movable_pin(handles[HANDLES - 1]) == pinned);
+	movable_unpin(handles[HANDLES - 1]);
+	movable_unpin(handles[HANDLES - 1]);
+	for(i = 1; i < HANDLES; i += 2) {
+		CHECK(holds(handles[i], i & 0xff));
+	}
+
+	/* a pinned allocation that is freed stays until the last unpin */
+	handle = handles[3];
+	mem = movable_pin(handle);
+	CHECK(mem != NULL);
+	movable_free(handle);
+	CHECK(movable_pin(handle) == NULL);
+	if(mem != NULL) {
+		memset(mem, 3, SIZE);
+	}
+	other = movable_alloc(SIZE);
+	CHECK(other != 0 && other != handle);
+	movable_free(other);
+	movable_unpin(handle);
+	handles[3] = movable_alloc(SIZE);
+	CHECK(handles[3] == handle);
+
+	/* compaction while another thread pins and writes, nothing is lost */
+	for(i = 3; i < HANDLES; i += 4) {
+		movable_free(handles[i]);
+		handles[i] = 0;
+	}
+	{
+		pthread_t thread;
+		void *rounds;
+		CHECK(pthread_create(&thread, NULL, writer, NULL) == 0);
+		moved = 0;
+		for(i = 0; i < 20; ++i) {
+			moved += treealloc_compact(0);
+		}
+		CHECK(moved >= SIZE);
+		__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+		pthread_join(thread, &rounds);
+		CHECK(errors == 0);
+		for(i = 1; i < HANDLES; i += 4) {
+			CHECK(holds(handles[i], (i + (int)(intptr_t)rounds) & 0xff));
+		}
+	}
+
+	/* freed handles are given out again */
+	handle = handles[1];
+	movable_free(handle);
+	CHECK(movable_pin(handle) == NULL);
+	handles[1] = movable_alloc(SIZE);
+	CHECK(handles[1] == handle);
+
+	for(i = 1; i < HANDLES; i += 2) {
+		movable_free(handles[i]);
+	}
+	CHECK(treealloc_compact(0) == 0);
+
+	return CHECK_DONE();
+}
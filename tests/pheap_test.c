@@ -0,0 +1,149 @@
+/* persistent heaps: the contents survive closing and reopening, also at
+ * another address, a file cannot be open twice at the same time, and a new
+ * file that cannot be set up is not left behind */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "tests/check.h"
+#include "treealloc/treealloc.h"
+
+struct node
+{
+	size_t next;
+	int value;
+};
+
+static char path[] = "/tmp/pheap_test_XXXXXX";
+static char other[] = "/tmp/pheap_test_XXXXXX";
+
+static void fill(pheap_t *heap, int count)
+{
+	size_t head = 0;
+	int i;
+
+	for(i = 0; i < count; ++i) {
+		struct node *node = pheap_alloc(heap, sizeof(struct node) + (i % 50) * 16);
+		CHECK(node != NULL);
+		if(node == NULL) {
+			return;
+		}
+		node->value = i;
+		node->next = head;
+		head = pheap_offset(heap, node);
+	}
+	pheap_set_root(heap, pheap_pointer(heap, head));
+}
+
+static int walk(pheap_t *heap)
+{
+	struct node *node = pheap_get_root(heap);
+	int expected = 0, count = 0;
+
+	if(node != NULL) {
+		expected = node->value;
+	}
+	while(node != NULL) {
+		CHECK(node->value == expected);
+		expected -= 1;
+		count += 1;
+		node = pheap_pointer(heap, node->next);
+	}
+	return count;
+}
+
+/* the base address of the mapping, found through the root */
+static void* mapping(pheap_t *heap)
+{
+	char *root = pheap_get_root(heap);
+	return root - pheap_offset(heap, root);
+}
+
+int main(void)
+{
+	pheap_t *heap, *second;
+	void *oldBase, *blocker;
+	pid_t child;
+	struct stat st;
+	int status, fd;
+
+	fd = mkstemp(path);
+	CHECK(fd >= 0);
+	close(fd);
+	unlink(path);
+
+	CHECK(pheap_open(path, 0, NULL, 0) == NULL);
+	CHECK(access(path, F_OK) != 0);
+
+	heap = pheap_open(path, 16 * 1024 * 1024, NULL, 0);
+	CHECK(heap != NULL);
+	if(heap == NULL) {
+		return CHECK_DONE();
+	}
+
+	CHECK(pheap_alloc(heap, 0) == NULL);
+	CHECK(pheap_alloc(heap, (size_t)-1) == NULL);
+	CHECK(pheap_alloc(heap, 32 * 1024 * 1024) == NULL);
+	CHECK(pheap_offset(heap, NULL) == 0);
+	CHECK(pheap_pointer(heap, 0) == NULL);
+
+	fill(heap, 10000);
+	CHECK(walk(heap) == 10000);
+
+	/* a second open fails, in this process and in another one */
+	second = pheap_open(path, 0, NULL, 0);
+	CHECK(second == NULL);
+	child = fork();
+	if(child == 0) {
+		_exit(pheap_open(path, 0, NULL, 0) == NULL ? 0 : 1);
+	}
+	CHECK(child > 0 && waitpid(child, &status, 0) == child);
+	CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	oldBase = mapping(heap);
+	pheap_close(heap);
+
+	/* at the same address again */
+	heap = pheap_open(path, 0, NULL, 0);
+	CHECK(heap != NULL);
+	if(heap == NULL) {
+		return CHECK_DONE();
+	}
+	CHECK(mapping(heap) == oldBase);
+	CHECK(walk(heap) == 10000);
+	pheap_close(heap);
+
+	/* the old address is taken, only PHEAP_RELOCATE maps it elsewhere */
+	blocker = mmap(oldBase, 4096, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+	CHECK(blocker == oldBase);
+	CHECK(pheap_open(path, 0, NULL, 0) == NULL);
+	heap = pheap_open(path, 0, NULL, PHEAP_RELOCATE);
+	CHECK(heap != NULL);
+	if(heap != NULL) {
+		CHECK(mapping(heap) != oldBase);
+		CHECK(walk(heap) == 10000);
+		pheap_set_root(heap, NULL);
+		CHECK(pheap_get_root(heap) == NULL);
+		pheap_close(heap);
+	}
+
+	/* a new file that cannot be mapped at its base is removed, an empty
+	 * one that was there before stays empty */
+	fd = mkstemp(other);
+	CHECK(fd >= 0);
+	close(fd);
+	CHECK(pheap_open(other, 16 * 1024 * 1024, oldBase, 0) == NULL);
+	CHECK(stat(other, &st) == 0 && st.st_size == 0);
+	unlink(other);
+	CHECK(pheap_open(other, 16 * 1024 * 1024, oldBase, 0) == NULL);
+	CHECK(access(other, F_OK) != 0);
+	munmap(blocker, 4096);
+
+	pheap_close(NULL);
+	unlink(path);
+	return CHECK_DONE();
+}
@@ -0,0 +1,92 @@
+/* the range allocators: best fitting aligned ranges inside the given free
+ * ranges, merging of freed neighbours, and rejected arguments */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "tests/check.h"
+#include "treealloc/treealloc.h"
+
+#define RANGES 500
+
+static size_t offsets[RANGES];
+static size_t lengths[RANGES];
+
+int main(void)
+{
+	range_allocator_t *ranges = range_allocator_create();
+	range_allocator_t *other = range_allocator_create();
+	const size_t high = ((size_t)1 << (sizeof(size_t) * 8 - 2)) - 4096;
+	static volatile size_t sizeMax = SIZE_MAX;
+	size_t offset, total = 0;
+	int i, j;
+
+	CHECK(ranges != NULL && other != NULL);
+	CHECK(range_get_free(ranges) == 0);
+	CHECK(range_alloc(ranges, 1, 1) == RANGE_NONE);
+
+	/* two separate spaces, offset 0 is a valid range */
+	CHECK(range_free(ranges, 0, 100000) == 0);
+	CHECK(range_free(ranges, 200000, 100000) == 0);
+	CHECK(range_free(other, high, 4096) == 0);
+	CHECK(range_get_free(ranges) == 200000);
+	CHECK(range_get_free(other) == 4096);
+
+	for(i = 0; i < RANGES; ++i) {
+		const size_t alignment = (size_t)1 << (i % 9);
+		lengths[i] = (size_t)(i * 37) % 300 + 1;
+		offsets[i] = range_alloc(ranges, lengths[i], alignment);
+		CHECK(offsets[i] != RANGE_NONE);
+		CHECK(offsets[i] % alignment == 0);
+		CHECK(offsets[i] + lengths[i] <= 100000 || (offsets[i] >= 200000 && offsets[i] + lengths[i] <= 300000));
+		total += lengths[i];
+	}
+	CHECK(range_get_free(ranges) == 200000 - total);
+
+	/* no two ranges overlap */
+	for(i = 0; i < RANGES; ++i) {
+		for(j = i + 1; j < RANGES; ++j) {
+			CHECK(offsets[i] + lengths[i] <= offsets[j] || offsets[j] + lengths[j] <= offsets[i]);
+		}
+	}
+
+	/* the other space is untouched and ends at the highest offset */
+	offset = range_alloc(other, 4096, 4096);
+	CHECK(offset == high);
+	CHECK(range_alloc(other, 1, 1) == RANGE_NONE);
+	CHECK(range_free(other, offset, 4096) == 0);
+
+	/* freed ranges merge with their neighbours, with the gap in between
+	 * freed the whole space is one range again */
+	for(i = 0; i < RANGES; ++i) {
+		CHECK(range_free(ranges, offsets[i], lengths[i]) == 0);
+	}
+	CHECK(range_get_free(ranges) == 200000);
+	CHECK(range_alloc(ranges, 100001, 1) == RANGE_NONE);
+	CHECK(range_free(ranges, 100000, 100000) == 0);
+	CHECK(range_alloc(ranges, 300000, 1) == 0);
+	CHECK(range_get_free(ranges) == 0);
+	CHECK(range_free(ranges, 0, 300000) == 0);
+
+	/* rejected arguments */
+	CHECK(range_alloc(ranges, 0, 1) == RANGE_NONE);
+	CHECK(range_alloc(ranges, sizeMax, 1) == RANGE_NONE);
+	CHECK(range_alloc(ranges, 10, 0) == RANGE_NONE);
+	CHECK(range_alloc(ranges, 10, 3) == RANGE_NONE);
+	CHECK(range_alloc(ranges, 10, (sizeMax >> 1) + 1) == RANGE_NONE);
+	CHECK(range_alloc(NULL, 10, 1) == RANGE_NONE);
+	CHECK(range_free(ranges, 0, 0) == EINVAL);
+	CHECK(range_free(ranges, sizeMax, 1) == EINVAL);
+	CHECK(range_free(ranges, high, sizeMax) == EINVAL);
+	CHECK(range_free(ranges, high, 8192) == EINVAL);
+	CHECK(range_free(NULL, 0, 1) == EINVAL);
+	CHECK(range_get_free(NULL) == 0);
+	CHECK(range_get_free(ranges) == 300000);
+
+	range_allocator_destroy(ranges);
+	range_allocator_destroy(other);
+	range_allocator_destroy(NULL);
+
+	return CHECK_DONE();
+}
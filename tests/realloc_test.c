@@ -0,0 +1,85 @@
+/* realloc() from several threads at once, the copies are made without the
+ * lock, and sizes that cannot be allocated */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "tests/check.h"
+
+#define THREADS 4
+
+/* kept from the compiler, which warns about constant sizes this large */
+static volatile size_t sizeMax = (size_t)-1;
+
+static int intact(const unsigned char *mem, size_t size, unsigned char value)
+{
+	size_t i;
+	for(i = 0; i < size; ++i) {
+		if(mem[i] != value) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void* grow(void *arg)
+{
+	const unsigned char value = (unsigned char)(uintptr_t)arg;
+	unsigned char *mem = NULL;
+	size_t size = 0, next;
+	int *valid = malloc(sizeof(int));
+
+	*valid = 1;
+	for(next = 1; next < 8 * 1024 * 1024; next += next / 3 + 1) {
+		unsigned char *out = realloc(mem, next);
+		if(out == NULL || !intact(out, size, value)) {
+			*valid = 0;
+			break;
+		}
+		memset(out + size, value, next - size);
+		mem = out;
+		size = next;
+	}
+
+	/* shrinking keeps the contents too */
+	while(*valid && size > 1) {
+		size /= 2;
+		mem = realloc(mem, size);
+		*valid = mem != NULL && intact(mem, size, value);
+	}
+	free(mem);
+	return valid;
+}
+
+int main(void)
+{
+	pthread_t threads[THREADS];
+	unsigned char *mem;
+	void *valid;
+	int i;
+
+	for(i = 0; i < THREADS; ++i) {
+		CHECK(pthread_create(&threads[i], NULL, grow, (void*)(uintptr_t)(i + 1)) == 0);
+	}
+	for(i = 0; i < THREADS; ++i) {
+		pthread_join(threads[i], &valid);
+		CHECK(*(int*)valid);
+		free(valid);
+	}
+
+	mem = realloc(NULL, 100);
+	CHECK(mem != NULL);
+	memset(mem, 7, 100);
+
+	/* sizes that cannot be allocated fail and keep the old memory */
+	CHECK(realloc(mem, sizeMax) == NULL);
+	CHECK(realloc(mem, sizeMax - 4096) == NULL);
+	CHECK(realloc(mem, sizeMax / 2 + 1) == NULL);
+	CHECK(intact(mem, 100, 7));
+	CHECK(calloc(sizeMax / 2, 4) == NULL);
+
+	CHECK(realloc(mem, 0) == NULL);
+
+	return CHECK_DONE();
+}
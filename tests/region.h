@@ -0,0 +1,31 @@
+// the setup shared by the tests of the block allocators: anonymous regions
+// that are handed to an allocator of 64 byte blocks
+
+#ifndef   TREEALLOC_REGION_HEADER
+#define   TREEALLOC_REGION_HEADER
+
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "tests/check.h"
+#include "treealloc/TreeBlockAllocator.h"
+
+typedef os::res::TreeBlockAllocatorNoLock<6> Blocks;
+
+// a test can not go on without its memory, it fails at once then
+static char* mapRegion(uintptr_t size)
+{
+	void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	CHECK(mem != MAP_FAILED);
+	if(mem == MAP_FAILED) {
+		exit(CHECK_DONE());
+	}
+	return (char*)mem;
+}
+
+static void unmapRegion(char *region, uintptr_t size)
+{
+	munmap(region, size);
+}
+
+#endif /* TREEALLOC_REGION_HEADER */
@@ -0,0 +1,102 @@
+/* shared heaps: a forked child attaches by descriptor and allocates, the
+ * parent reads and frees the allocations through their handles. Attaching
+ * fails if the address of the heap is taken. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "tests/check.h"
+#include "treealloc/treealloc.h"
+
+#define COUNT 5000
+
+int main(void)
+{
+	shm_heap_t *heap, *again;
+	size_t msg[2], handle;
+	int fd, pipeFds[2], status, received = 0, valid = 1;
+	void *blocker;
+	pid_t child;
+	size_t k;
+
+	CHECK(shm_heap_create(NULL, 1024 * 1024, &fd) == NULL);
+	CHECK(shm_heap_create("shm_test", 0, &fd) == NULL);
+
+	heap = shm_heap_create("shm_test", 16 * 1024 * 1024, &fd);
+	CHECK(heap != NULL);
+	if(heap == NULL) {
+		return CHECK_DONE();
+	}
+
+	CHECK(shm_heap_alloc(heap, 0) == 0);
+	CHECK(shm_heap_alloc(heap, (size_t)-1) == 0);
+	CHECK(shm_heap_alloc(heap, 32 * 1024 * 1024) == 0);
+	CHECK(shm_heap_pointer(heap, 0) == NULL);
+	CHECK(shm_heap_handle(heap, NULL) == 0);
+
+	handle = shm_heap_alloc(heap, 100);
+	CHECK(handle != 0);
+	CHECK(shm_heap_handle(heap, shm_heap_pointer(heap, handle)) == handle);
+	shm_heap_free(heap, handle);
+
+	CHECK(pipe(pipeFds) == 0);
+	child = fork();
+	if(child == 0) {
+		int i;
+
+		/* attach again by descriptor, at the same address */
+		shm_heap_detach(heap);
+		heap = shm_heap_attach(fd);
+		if(heap == NULL) {
+			_exit(1);
+		}
+		for(i = 0; i < COUNT; ++i) {
+			msg[1] = (size_t)(i % 500) + 8;
+			msg[0] = shm_heap_alloc(heap, msg[1]);
+			if(msg[0] == 0) {
+				_exit(2);
+			}
+			memset(shm_heap_pointer(heap, msg[0]), i & 255, msg[1]);
+			if(write(pipeFds[1], msg, sizeof(msg)) != (ssize_t)sizeof(msg)) {
+				_exit(3);
+			}
+		}
+		_exit(0);
+	}
+	close(pipeFds[1]);
+
+	while(read(pipeFds[0], msg, sizeof(msg)) == (ssize_t)sizeof(msg)) {
+		unsigned char *mem = shm_heap_pointer(heap, msg[0]);
+		for(k = 0; k < msg[1]; ++k) {
+			if(mem[k] != (unsigned char)(received & 255)) {
+				valid = 0;
+			}
+		}
+		shm_heap_free(heap, msg[0]);
+		received += 1;
+	}
+	close(pipeFds[0]);
+
+	CHECK(child > 0 && waitpid(child, &status, 0) == child);
+	CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	CHECK(received == COUNT);
+	CHECK(valid);
+
+	/* the address of the heap is taken, attaching fails */
+	shm_heap_detach(heap);
+	blocker = mmap(heap, 4096, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+	CHECK(blocker == (void*)heap);
+	CHECK(shm_heap_attach(fd) == NULL);
+	munmap(blocker, 4096);
+
+	again = shm_heap_attach(fd);
+	CHECK(again == heap);
+	shm_heap_detach(again);
+	shm_heap_detach(NULL);
+
+	close(fd);
+	return CHECK_DONE();
+}
@@ -0,0 +1,154 @@
+// the lock-free stacks of the block allocator: chunks come back last in,
+// first out, the deferred limit bounds them, allocations of other sizes
+// find the memory they hold, also by merging it, and threads pushing and
+// popping concurrently never get the same chunk twice
+
+#include <string.h>
+#include <pthread.h>
+
+#include "tests/check.h"
+#include "tests/region.h"
+
+static const uintptr_t REGION_SIZE = 4 * 1024 * 1024;
+static const uintptr_t REGION_BLOCKS = REGION_SIZE >> 6;
+static const uintptr_t THREADS = 4;
+static const uintptr_t THREAD_CHUNKS = 256;
+static const uintptr_t ROUNDS = 20000;
+
+static Blocks blocks;
+static void *chunks[THREADS][THREAD_CHUNKS];
+static volatile int errors = 0;
+
+// every thread owns its chunks while it holds them, a chunk handed out
+// twice gets the mark of the other thread
+static void* churn(void *arg)
+{
+	const uintptr_t id = (uintptr_t)arg;
+	for(uintptr_t round = 0; round < ROUNDS; ++round) {
+		const uintptr_t i = (round * 7) % THREAD_CHUNKS;
+		const uintptr_t blocks1 = i % 4 + 1;
+		uintptr_t *mem = (uintptr_t*)chunks[id][i];
+		if(mem[1] != id || mem[(blocks1 << 3) - 1] != id) {
+			__atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+		}
+		if(!blocks.pushFree(mem, blocks1)) {
+			__atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		mem = (uintptr_t*)blocks.popFree(blocks1);
+		if(mem == nullptr) {
+			__atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+			break;
+		}
+		mem[1] = id;
+		mem[(blocks1 << 3) - 1] = id;
+		chunks[id][i] = mem;
+	}
+	return nullptr;
+}
+
+int main()
+{
+	char *region = mapRegion(REGION_SIZE);
+
+	blocks.init();
+	blocks.free(region, REGION_BLOCKS);
+
+	// without a deferred limit nothing goes onto the stacks
+	void *a = blocks.alloc(2);
+	CHECK(a != nullptr && !blocks.pushFree(a, 2));
+	CHECK(blocks.popFree(2) == nullptr);
+
+	// last in, first out, and only chunks of the requested size
+	blocks.setDeferredLimit(64);
+	void *b = blocks.alloc(2);
+	void *c = blocks.alloc(3);
+	CHECK(blocks.pushFree(a, 2) && blocks.pushFree(b, 2) && blocks.pushFree(c, 3));
+	CHECK(blocks.getDeferredCount() == 7);
+	CHECK(blocks.popFree(2) == b);
+	CHECK(blocks.popFree(2) == a);
+	CHECK(blocks.popFree(2) == nullptr);
+	CHECK(blocks.popFree(3) == c);
+	CHECK(blocks.popFree(0) == nullptr);
+	CHECK(blocks.getDeferredCount() == 0);
+
+	// sizes above the quick lists and beyond the limit are refused
+	void *large = blocks.alloc(17);
+	CHECK(!blocks.pushFree(large, 17));
+	blocks.free(large, 17);
+	void *filler[5];
+	for(uintptr_t i = 0; i < 5; ++i) {
+		filler[i] = blocks.alloc(16);
+	}
+	for(uintptr_t i = 0; i < 4; ++i) {
+		CHECK(blocks.pushFree(filler[i], 16));
+	}
+	CHECK(!blocks.pushFree(filler[4], 16));
+	blocks.free(filler[4], 16);
+	blocks.flushDeferred();
+	CHECK(blocks.getDeferredCount() == 0);
+	blocks.free(a, 2);
+	blocks.free(b, 2);
+	blocks.free(c, 3);
+	CHECK(blocks.getFreeCount() == REGION_BLOCKS);
+	CHECK(blocks.check());
+
+	// the whole region on the stacks, another size still finds it
+	blocks.setDeferredLimit(REGION_BLOCKS);
+	const uintptr_t pieces = REGION_BLOCKS / 4;
+	char *all = (char*)blocks.alloc(REGION_BLOCKS);
+	CHECK(all == region);
+	for(uintptr_t i = 0; i < pieces; ++i) {
+		CHECK(blocks.pushFree(all + i * 256, 4));
+	}
+	CHECK(blocks.getFreeCount() == REGION_BLOCKS);
+	void *other = blocks.alloc(7);
+	CHECK(other != nullptr);
+	blocks.free(other, 7);
+	blocks.flushDeferred();
+	CHECK(blocks.check());
+
+	// a chunk on the stacks smaller than the request merges with the free
+	// run next to it into a fit
+	char *whole = (char*)blocks.alloc(REGION_BLOCKS);
+	CHECK(whole == region);
+	blocks.free(whole + 2 * 64, 4, false);
+	CHECK(blocks.pushFree(whole, 2));
+	CHECK(blocks.alloc(6) == whole);
+	blocks.free(whole, 6, false);
+	blocks.free(whole + 6 * 64, REGION_BLOCKS - 6, false);
+	CHECK(blocks.getFreeCount() == REGION_BLOCKS);
+	CHECK(blocks.check());
+
+	// concurrent pushes and pops of chunks of one to four blocks
+	for(uintptr_t t = 0; t < THREADS; ++t) {
+		for(uintptr_t i = 0; i < THREAD_CHUNKS; ++i) {
+			uintptr_t *mem = (uintptr_t*)blocks.alloc(i % 4 + 1);
+			CHECK(mem != nullptr);
+			mem[1] = t;
+			mem[((i % 4 + 1) << 3) - 1] = t;
+			chunks[t][i] = mem;
+		}
+	}
+	pthread_t threads[THREADS];
+	for(uintptr_t t = 0; t < THREADS; ++t) {
+		pthread_create(&threads[t], nullptr, churn, (void*)t);
+	}
+	for(uintptr_t t = 0; t < THREADS; ++t) {
+		pthread_join(threads[t], nullptr);
+	}
+	CHECK(errors == 0);
+	blocks.waitForPops();
+	for(uintptr_t t = 0; t < THREADS; ++t) {
+		for(uintptr_t i = 0; i < THREAD_CHUNKS; ++i) {
+			blocks.free(chunks[t][i], i % 4 + 1);
+		}
+	}
+	blocks.flushDeferred();
+	CHECK(blocks.check());
+	CHECK(blocks.getFreeCount() == REGION_BLOCKS);
+	CHECK(blocks.alloc(REGION_BLOCKS) == region);
+
+	unmapRegion(region, REGION_SIZE);
+	return CHECK_DONE();
+}
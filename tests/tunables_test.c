@@ -0,0 +1,112 @@
+/* the tunables: mallopt() accepts the parameters of treealloc.h and rejects
+ * others, and the environment variables are read before the first
+ * allocation. The environment cases run in a re-executed copy of the test. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <sys/wait.h>
+
+#include "tests/check.h"
+#include "treealloc/treealloc.h"
+
+#define MB (1024 * 1024)
+
+/* runs this test with 'mode' as argument and 'env' as the only variable,
+ * returns the exit status of the copy */
+static int runWith(const char *mode, const char *env)
+{
+	char *argv[3];
+	char *envp[2];
+	int status;
+	pid_t pid;
+
+	argv[0] = (char*)"tunables_test";
+	argv[1] = (char*)mode;
+	argv[2] = NULL;
+	envp[0] = (char*)env;
+	envp[1] = NULL;
+
+	pid = fork();
+	if(pid == 0) {
+		execve("/proc/self/exe", argv, envp);
+		_exit(127);
+	}
+	if(pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) {
+		return -1;
+	}
+	return WEXITSTATUS(status);
+}
+
+/* the copies check what the variable did and exit with CHECK_DONE() */
+static int child(const char *mode)
+{
+	struct treealloc_mallinfo info;
+	void *mem = malloc(16);
+
+	CHECK(mem != NULL);
+	info = treealloc_get_mallinfo();
+	if(strcmp(mode, "reserve") == 0) {
+		CHECK(info.arena >= 64 * MB);
+	} else if(strcmp(mode, "refill") == 0) {
+		CHECK(info.arena >= 32 * MB);
+	} else if(strcmp(mode, "default") == 0) {
+		CHECK(info.arena < 32 * MB);
+	}
+	free(mem);
+
+	mem = malloc(4 * MB);
+	CHECK(mem != NULL);
+	if(mem != NULL) {
+		memset(mem, 1, 4 * MB);
+	}
+	free(mem);
+
+	return CHECK_DONE();
+}
+
+int main(int argc, char **argv)
+{
+	void *mem[64];
+	int i;
+
+	if(argc > 1) {
+		return child(argv[1]);
+	}
+
+	CHECK(runWith("default", "TREEALLOC_NONE=1") == 0);
+	CHECK(runWith("reserve", "TREEALLOC_RESERVE=64m") == 0);
+	CHECK(runWith("refill", "TREEALLOC_REFILL=32M") == 0);
+	/* values that do not fit are ignored */
+	CHECK(runWith("default", "TREEALLOC_REFILL=99999999999999999999999") == 0);
+	CHECK(runWith("default", "TREEALLOC_REFILL=18014398509481984g") == 0);
+	CHECK(runWith("default", "TREEALLOC_TRIM_THRESHOLD=18446744073709551615") == 0);
+	CHECK(runWith("default", "TREEALLOC_MMAP_THRESHOLD=x") == 0);
+
+	CHECK(mallopt(TREEALLOC_M_TRIM_THRESHOLD, 8 * MB) == 1);
+	CHECK(mallopt(TREEALLOC_M_MMAP_THRESHOLD, 4 * MB) == 1);
+	CHECK(mallopt(TREEALLOC_M_REFILL, 0) == 1);
+	CHECK(mallopt(TREEALLOC_M_REFILL_MAX, 0x7fffffff) == 1);
+	CHECK(mallopt(TREEALLOC_M_DEFERRED, 0) == 1);
+	CHECK(mallopt(TREEALLOC_M_RESERVE, 0) == 1);
+	CHECK(mallopt(TREEALLOC_M_RESERVE, 4 * MB) == 1);
+	CHECK(mallopt(TREEALLOC_M_REFILL, -1) == 0);
+	CHECK(mallopt(12345, 1) == 0);
+
+	/* the heap still works with the changed tunables */
+	for(i = 0; i < 64; ++i) {
+		mem[i] = malloc((size_t)i * 100000 + 1);
+		CHECK(mem[i] != NULL);
+		if(mem[i] != NULL) {
+			memset(mem[i], i, (size_t)i * 100000 + 1);
+		}
+	}
+	for(i = 0; i < 64; ++i) {
+		free(mem[i]);
+	}
+	CHECK(mallopt(TREEALLOC_M_REFILL, 2 * MB) == 1);
+	CHECK(mallopt(TREEALLOC_M_DEFERRED, 256 * 1024) == 1);
+
+	return CHECK_DONE();
+}
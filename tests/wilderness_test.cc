@@ -0,0 +1,121 @@
+// free blocks in the wilderness are only used if no other block fits: not
+// when an older block of the same size lies outside of it, also not by the
+// aligned allocation that falls back to the plain size
+
+#include "tests/check.h"
+#include "tests/region.h"
+
+static const uintptr_t REGION_SIZE = 2 * 1024 * 1024;
+static const uintptr_t WILD_BLOCKS = (REGION_SIZE / 2) >> 6;
+
+int main()
+{
+	char *region = mapRegion(REGION_SIZE);
+	char *old = region;
+	char *wild = region + REGION_SIZE / 2;
+
+	// same size, the one in the wilderness is the newer one and therefore
+	// the node of the size tree
+	{
+		Blocks blocks;
+		blocks.init();
+		blocks.setWilderness(wild, WILD_BLOCKS);
+		blocks.free(old, 4);
+		blocks.free(wild, 4);
+
+		CHECK(blocks.alloc(0) == nullptr);
+		CHECK(blocks.alloc(4) == old);
+		CHECK(blocks.alloc(4) == wild);
+		CHECK(blocks.alloc(1) == nullptr);
+		CHECK(blocks.check());
+	}
+
+	// several older blocks of that size, all but the oldest in the
+	// wilderness
+	{
+		Blocks blocks;
+		blocks.init();
+		blocks.setWilderness(wild, WILD_BLOCKS);
+		blocks.free(old, 4);
+		for(uintptr_t i = 0; i < 4; ++i) {
+			blocks.free(wild + i * 8 * 64, 4);
+		}
+
+		CHECK(blocks.alloc(4) == old);
+		for(uintptr_t i = 4; i-- != 0;) {
+			CHECK(blocks.alloc(4) == wild + i * 8 * 64);
+		}
+		CHECK(blocks.check());
+	}
+
+	// a larger block outside of the wilderness is split instead
+	{
+		Blocks blocks;
+		blocks.init();
+		blocks.setWilderness(wild, WILD_BLOCKS);
+		blocks.free(old, 8);
+		blocks.free(wild, 4);
+
+		CHECK(blocks.alloc(4) == old);
+		CHECK(blocks.alloc(4) == old + 4 * 64);
+		CHECK(blocks.alloc(4) == wild);
+		CHECK(blocks.check());
+	}
+
+	// no block is large enough for the aligned allocation to be split from
+	// it, the fallback takes an aligned block of the size itself
+	{
+		Blocks blocks;
+		blocks.init();
+		blocks.setWilderness(wild, WILD_BLOCKS);
+		blocks.free(old, 4);
+		blocks.free(wild, 4);
+
+		CHECK(blocks.allocAligned(4 * 64, 4) == old);
+		CHECK(blocks.allocAligned(4 * 64, 4) == wild);
+		CHECK(blocks.check());
+	}
+
+	// moving the wilderness moves the free blocks between the size trees
+	{
+		Blocks blocks;
+		blocks.init();
+		blocks.setWilderness(old, 8);
+		blocks.free(old, 4);
+		blocks.free(wild, 4);
+		CHECK(blocks.check());
+		CHECK(blocks.getLargestFree() == 4 * 64);
+
+		blocks.setWilderness(wild, WILD_BLOCKS);
+		CHECK(blocks.check());
+		CHECK(blocks.alloc(4) == old);
+		blocks.free(old, 4);
+
+		blocks.setWilderness(old, 8);
+		CHECK(blocks.check());
+		CHECK(blocks.alloc(4) == wild);
+		CHECK(blocks.alloc(4) == old);
+		CHECK(blocks.check());
+	}
+
+	// only the wilderness fits, it is carved from the front, and without a
+	// wilderness the newest block is taken
+	{
+		Blocks blocks;
+		blocks.init();
+		blocks.setWilderness(wild, WILD_BLOCKS);
+		blocks.free(wild, WILD_BLOCKS);
+
+		CHECK(blocks.alloc(1) == wild);
+		CHECK(blocks.alloc(2) == wild + 64);
+
+		blocks.free(old, 4);
+		blocks.free(wild + 3 * 64 + 64 * 64, 4);
+		blocks.setWilderness(nullptr, 0);
+		CHECK(blocks.alloc(4) == wild + 3 * 64 + 64 * 64);
+		CHECK(blocks.check());
+	}
+
+	unmapRegion(region, REGION_SIZE);
+	return CHECK_DONE();
+}
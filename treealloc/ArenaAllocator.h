@@ -0,0 +1,170 @@
+#ifndef   OS_RES_ARENA_ALLOCATOR_HEADER
+#define   OS_RES_ARENA_ALLOCATOR_HEADER
+
+// monotonic region allocator on top of a block allocator. Memory is handed
+// out by bumping a pointer inside large chunks, there is no per-object
+// header and no per-object free. All objects die together with reset() or
+// release(), which give back whole chunks with one free() each.
+// This class does no locking of its own.
+
+#include <inttypes.h>
+#include "kassert.h"
+
+namespace os {
+namespace res {
+
+template<typename BlockAllocator>
+class ArenaAllocator
+{
+	private:
+	// every chunk starts with this header, chunks form a singly linked list,
+	// the newest chunk first
+	struct Chunk
+	{
+		Chunk *next;
+		uintptr_t blocks;
+	};
+
+	BlockAllocator *backend;
+
+	// default number of blocks taken from the block allocator at once
+	uintptr_t chunkBlocks;
+
+	Chunk *chunks;
+
+	// bump pointer and end of the newest chunk
+	uintptr_t cur;
+	uintptr_t end;
+
+	static uintptr_t alignUp(uintptr_t numToRound, uintptr_t multiple)
+	{
+		uintptr_t mask = multiple - 1;
+	    return (numToRound + mask) & ~mask;
+	}
+
+	uintptr_t chunkStart(Chunk *chunk) const
+	{
+		return ((uintptr_t)chunk) + sizeof(Chunk);
+	}
+
+	uintptr_t chunkEnd(Chunk *chunk) const
+	{
+		return ((uintptr_t)chunk) + (chunk->blocks << backend->getBlockBits());
+	}
+
+	bool addChunk(uintptr_t minSize)
+	{
+		const uintptr_t blockBits = backend->getBlockBits();
+		const uintptr_t blockSize = ((uintptr_t)1) << blockBits;
+
+		// the rounding below would overflow
+		if(minSize > ~((uintptr_t)0) - sizeof(Chunk) - (blockSize - 1)) {
+			return false;
+		}
+
+		uintptr_t blocks = alignUp(minSize + sizeof(Chunk), blockSize) >> blockBits;
+		uintptr_t wanted = blocks;
+		if(wanted < chunkBlocks) {
+			wanted = chunkBlocks;
+		}
+
+		Chunk *chunk = (Chunk*)backend->alloc(wanted);
+		if(chunk != nullptr) {
+			blocks = wanted;
+		}
+		else {
+			// no chunk of the default size, take the largest free block if
+			// it is large enough for this request
+			chunk = (Chunk*)backend->allocLargest(blockSize, &blocks);
+			if(chunk == nullptr) {
+				return false;
+			}
+		}
+
+		chunk->blocks = blocks;
+		chunk->next = chunks;
+		chunks = chunk;
+
+		cur = chunkStart(chunk);
+		end = chunkEnd(chunk);
+
+		return true;
+	}
+
+	void freeChunks(Chunk *chunk)
+	{
+		while(chunk != nullptr) {
+			Chunk *next = chunk->next;
+			backend->free(chunk, chunk->blocks);
+			chunk = next;
+		}
+	}
+
+	public:
+	void init(BlockAllocator *blockAllocator, uintptr_t defaultChunkBlocks)
+	{
+		backend = blockAllocator;
+		chunkBlocks = defaultChunkBlocks;
+		chunks = nullptr;
+		cur = 0;
+		end = 0;
+	}
+
+	void* alloc(uintptr_t size, uintptr_t alignment = 2 * sizeof(uintptr_t))
+	{
+		kassert(size != 0);
+		// power of two
+		kassert((alignment != 0) && !(alignment & (alignment - 1)));
+
+		uintptr_t out = alignUp(cur, alignment);
+		if(chunks == nullptr || out < cur || out > end || size > end - out) {
+			// a new chunk holds the request at any alignment
+			const uintptr_t needed = size + (alignment - 1);
+			if(needed < size || !addChunk(needed)) {
+				return nullptr;
+			}
+			out = alignUp(cur, alignment);
+		}
+
+		cur = out + size;
+		return (void*)out;
+	}
+
+	// forget all objects, keep the newest chunk and give all others back
+	void reset()
+	{
+		if(chunks == nullptr) {
+			return;
+		}
+
+		freeChunks(chunks->next);
+		chunks->next = nullptr;
+
+		cur = chunkStart(chunks);
+		end = chunkEnd(chunks);
+	}
+
+	// forget all objects and give all chunks back
+	void release()
+	{
+		freeChunks(chunks);
+		chunks = nullptr;
+		cur = 0;
+		end = 0;
+	}
+
+	// number of bytes taken from the block allocator
+	uintptr_t getChunkBytes() const
+	{
+		uintptr_t out = 0;
+		for(Chunk *chunk = chunks; chunk != nullptr; chunk = chunk->next) {
+			out += chunk->blocks << backend->getBlockBits();
+		}
+		return out;
+	}
+};
+
+} // namespace res
+} // namespace os
+
+#endif /* OS_RES_ARENA_ALLOCATOR_HEADER */
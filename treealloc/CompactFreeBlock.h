@@ -0,0 +1,295 @@
+#ifndef   OS_RES_COMPACT_FREE_BLOCK
+#define   OS_RES_COMPACT_FREE_BLOCK
+
+// a free block for TreeBlockAllocatorGeneric that stores its links as 32 bit
+// block numbers instead of pointers. A block needs 32 bytes, so the block size
+// can be 32 bytes (BLOCK_BITS 5) on 64 bit machines instead of 64 bytes with
+// EmbeddedFreeBlock.
+//
+// The block numbers count from a base address that is shared by all
+// allocators with the same BLOCK_BITS. It has to be set with setBase() before
+// the first block is created and all memory given to these allocators must
+// lie within 2^31 - 1 blocks above it, e.g. in one reserved mapping. If that
+// memory is moved, the owner sets the new base before relocating the
+// allocator.
+//
+//    typedef os::res::CompactFreeBlock<5> Block;
+//    Block::setBase((uintptr_t)region);
+//    os::res::TreeBlockAllocatorGeneric<5, Block, os::res::NoLocker> allocator;
+//    allocator.free(region, regionSize >> 5);
+
+#include <inttypes.h> // uintptr_t, uint32_t
+#include "TreeBlockAllocator.h"
+#include "kassert.h"
+
+namespace os {
+namespace res {
+
+template<uintptr_t BLOCK_BITS>
+class CompactLinks
+{
+	public:
+	static uintptr_t base;
+
+	// a link is the block number plus one, shifted left by one, 0 is nullptr.
+	// The lowest bit is the tag or the color of the link.
+	static uint32_t encode(uintptr_t value)
+	{
+		const uintptr_t tag = value & 1;
+		const uintptr_t addr = value & ~((uintptr_t)1);
+		if(addr == 0) {
+			return (uint32_t)tag;
+		}
+
+		kassert(addr >= base);
+		const uintptr_t number = ((addr - base) >> BLOCK_BITS) + 1;
+		kassert(number < (((uintptr_t)1) << 31));
+		return (uint32_t)((number << 1) | tag);
+	}
+
+	static uintptr_t decode(uint32_t link)
+	{
+		const uintptr_t tag = link & 1;
+		const uintptr_t number = link >> 1;
+		if(number == 0) {
+			return tag;
+		}
+		return (base + ((number - 1) << BLOCK_BITS)) | tag;
+	}
+};
+
+template<uintptr_t BLOCK_BITS>
+uintptr_t CompactLinks<BLOCK_BITS>::base = 0;
+
+// pointer to a block that may carry a tag in its lowest bit
+template<typename T, uintptr_t BLOCK_BITS>
+class CompactPointer
+{
+	private:
+	typedef CompactLinks<BLOCK_BITS> Links;
+	uint32_t link;
+
+	public:
+	operator T*() const
+	{
+		return (T*)Links::decode(link);
+	}
+
+	explicit operator uintptr_t() const
+	{
+		return Links::decode(link);
+	}
+
+	T* operator->() const
+	{
+		return (T*)Links::decode(link);
+	}
+
+	CompactPointer& operator=(T *ptr)
+	{
+		link = Links::encode((uintptr_t)ptr);
+		return *this;
+	}
+};
+
+// parent pointer and color of a tree node
+template<uintptr_t BLOCK_BITS>
+class CompactParentColor
+{
+	private:
+	typedef CompactLinks<BLOCK_BITS> Links;
+	uint32_t link;
+
+	public:
+	operator uintptr_t() const
+	{
+		return Links::decode(link);
+	}
+
+	CompactParentColor& operator=(uintptr_t parentColor)
+	{
+		link = Links::encode(parentColor);
+		return *this;
+	}
+
+	CompactParentColor& operator|=(uintptr_t color)
+	{
+		link |= (uint32_t)(color & 1);
+		return *this;
+	}
+};
+
+// size in bytes, stored as number of blocks
+template<uintptr_t BLOCK_BITS>
+class CompactSize
+{
+	private:
+	uint32_t blocks;
+
+	public:
+	operator uintptr_t() const
+	{
+		return ((uintptr_t)blocks) << BLOCK_BITS;
+	}
+
+	CompactSize& operator=(uintptr_t size)
+	{
+		kassert((size & ((((uintptr_t)1) << BLOCK_BITS) - 1)) == 0);
+		kassert((size >> BLOCK_BITS) <= UINT32_MAX);
+		blocks = (uint32_t)(size >> BLOCK_BITS);
+		return *this;
+	}
+
+	CompactSize& operator+=(uintptr_t size)
+	{
+		return *this = ((uintptr_t)*this) + size;
+	}
+};
+
+template<typename T, uintptr_t BLOCK_BITS>
+class CompactRBNode
+{
+	public:
+	CompactPointer<T, BLOCK_BITS> right;
+	CompactPointer<T, BLOCK_BITS> left;
+	CompactParentColor<BLOCK_BITS> parentColor;
+
+	void propagate(CompactRBNode *stop, CompactRBNode T::*nodeMember)
+	{
+		(void)stop;
+		(void)nodeMember;
+		// nothing to do
+	}
+
+	void copy(CompactRBNode *newNode, CompactRBNode T::*nodeMember)
+	{
+		(void)newNode;
+		(void)nodeMember;
+		// nothing to do
+	}
+
+	void rotate(CompactRBNode *newNode, CompactRBNode T::*nodeMember)
+	{
+		(void)newNode;
+		(void)nodeMember;
+		// nothing to do
+	}
+};
+
+template<uintptr_t BLOCK_BITS>
+struct CompactFreeBlock
+{
+	typedef CompactRBNode<CompactFreeBlock, BLOCK_BITS> TreeNode;
+	typedef CompactPointer<CompactFreeBlock, BLOCK_BITS> Pointer;
+
+	static const bool EMBEDDED = true;
+
+	#ifdef cf_debug_kernel
+		// this should be the first member of this class
+		uintptr_t canary;
+	#endif
+
+	struct LinkNode
+	{
+		Pointer prev;
+		Pointer next;
+		uint32_t parent;
+	};
+
+	TreeNode addrNode;
+
+	union {
+		TreeNode sizeNode;
+		LinkNode linkNode;
+	};
+
+	Pointer headNext;
+	CompactSize<BLOCK_BITS> size;
+
+	static void setBase(uintptr_t base)
+	{
+		CompactLinks<BLOCK_BITS>::base = base;
+	}
+
+	static uintptr_t getBase()
+	{
+		return CompactLinks<BLOCK_BITS>::base;
+	}
+
+	uintptr_t getStartAddress()
+	{
+		return (uintptr_t)this;
+	}
+
+	static CompactFreeBlock* create(uintptr_t start, uintptr_t blockSize)
+	{
+		CompactFreeBlock *newBlock = (CompactFreeBlock*)start;
+		newBlock->size = blockSize;
+		newBlock->headNext = nullptr;
+		return newBlock;
+	}
+
+	static void destroy(CompactFreeBlock *block)
+	{
+		// block should not be nullptr
+		(void)block;
+	}
+
+	static CompactFreeBlock* recycle(CompactFreeBlock *block, uintptr_t start, uintptr_t blockSize)
+	{
+		(void)block;
+		return create(start, blockSize);
+	}
+
+	// the links are relative to the base, which the owner has already moved
+	void relocate(intptr_t delta)
+	{
+		(void)delta;
+		kassert(applyCanary());
+	}
+
+	void relocateNext(intptr_t delta)
+	{
+		(void)delta;
+	}
+
+	#ifdef cf_debug_kernel
+		private:
+		uintptr_t calcCanary()
+		{
+			uintptr_t sum = 0;
+			sum ^= (uintptr_t)this;
+			sum <<= sizeof(sum) * 4;
+			sum ^= size;
+			sum ^= ~((uintptr_t)(0xBADC0DED));
+			return sum;
+		}
+
+		public:
+		bool applyCanary()
+		{
+			canary = calcCanary();
+			return true;
+		}
+
+		bool checkCanary()
+		{
+			uintptr_t expectedCanary = calcCanary();
+			return expectedCanary == canary;
+		}
+	#endif
+};
+
+// the canary of debug builds does not fit into 32 bytes, use BLOCK_BITS 6 there
+#ifdef cf_debug_kernel
+	static_assert(sizeof(CompactFreeBlock<6>) == (sizeof(uintptr_t) + 32),
+		"Size of CompactFreeBlock is not sizeof(uintptr_t) + 32");
+#else
+	static_assert(sizeof(CompactFreeBlock<5>) == 32,
+		"Size of CompactFreeBlock is not 32");
+#endif
+
+} // namespace res
+} // namespace os
+
+#endif /* OS_RES_COMPACT_FREE_BLOCK */
@@ -0,0 +1,159 @@
+#ifndef   OS_RES_EXTERNAL_FREE_BLOCK
+#define   OS_RES_EXTERNAL_FREE_BLOCK
+
+// a free block for TreeBlockAllocatorGeneric that keeps its node outside of
+// the range it describes. The allocator never touches the managed range, so
+// it can manage ranges that are not memory of this process, e.g. extents of
+// a file, offsets in a memfd or slots of a pinned I/O buffer pool. Any
+// BLOCK_BITS can be used, 0 makes a block one unit of the caller.
+//
+// The nodes come from a pool of spare nodes that all allocators with the
+// same 'Tag' share. The owner fills it with addNodes(). A call to alloc(),
+// allocAligned(), free() or grow() takes at most one node from the pool, so
+// there must be a spare node before every call, see getSpareNodes(). clear()
+// gives all nodes of an allocator back. Start addresses must not be 0, as
+// alloc() returns nullptr if it fails. Allocators using these blocks cannot
+// be relocated.
+
+#include <inttypes.h> // uintptr_t
+#include "RBTree.h"
+#include "kassert.h"
+
+namespace os {
+namespace res {
+
+template<typename Tag>
+struct ExternalFreeBlock
+{
+	typedef lib::adt::RBNode<ExternalFreeBlock> TreeNode;
+
+	static const bool EMBEDDED = false;
+
+	#ifdef cf_debug_kernel
+		// this should be the first member of this class
+		uintptr_t canary;
+	#endif
+
+	struct LinkNode
+	{
+		ExternalFreeBlock *prev;
+		ExternalFreeBlock *next;
+		uintptr_t parent;
+	};
+
+	TreeNode addrNode;
+
+	union {
+		TreeNode sizeNode;
+		LinkNode linkNode;
+	};
+
+	ExternalFreeBlock *headNext;
+	uintptr_t size;
+	uintptr_t start;
+
+	private:
+	// spare nodes, linked by 'headNext'
+	static ExternalFreeBlock *spareNodes;
+	static uintptr_t spareCount;
+
+	public:
+	// add the nodes that fit into 'bytes' bytes at 'mem' to the pool, the
+	// memory must stay valid as long as nodes of this pool are in use
+	static void addNodes(void *mem, uintptr_t bytes)
+	{
+		kassert((((uintptr_t)mem) % sizeof(uintptr_t)) == 0);
+
+		ExternalFreeBlock *nodes = (ExternalFreeBlock*)mem;
+		const uintptr_t count = bytes / sizeof(ExternalFreeBlock);
+		for(uintptr_t i = 0; i < count; ++i) {
+			destroy(&nodes[i]);
+		}
+	}
+
+	static uintptr_t getSpareNodes()
+	{
+		return spareCount;
+	}
+
+	uintptr_t getStartAddress()
+	{
+		return start;
+	}
+
+	static ExternalFreeBlock* create(uintptr_t start, uintptr_t blockSize)
+	{
+		ExternalFreeBlock *newBlock = spareNodes;
+		kassert(newBlock != nullptr);
+		spareNodes = newBlock->headNext;
+		spareCount -= 1;
+
+		return recycle(newBlock, start, blockSize);
+	}
+
+	static void destroy(ExternalFreeBlock *block)
+	{
+		// block should not be nullptr
+		block->headNext = spareNodes;
+		spareNodes = block;
+		spareCount += 1;
+	}
+
+	static ExternalFreeBlock* recycle(ExternalFreeBlock *block, uintptr_t start, uintptr_t blockSize)
+	{
+		block->start = start;
+		block->size = blockSize;
+		block->headNext = nullptr;
+		return block;
+	}
+
+	// the nodes do not move with the managed range
+	void relocate(intptr_t delta)
+	{
+		(void)delta;
+		kassert(false);
+	}
+
+	void relocateNext(intptr_t delta)
+	{
+		(void)delta;
+		kassert(false);
+	}
+
+	#ifdef cf_debug_kernel
+		private:
+		uintptr_t calcCanary()
+		{
+			uintptr_t sum = 0;
+			sum ^= start;
+			sum <<= sizeof(sum) * 4;
+			sum ^= size;
+			sum ^= ~((uintptr_t)(0xBADC0DED));
+			return sum;
+		}
+
+		public:
+		bool applyCanary()
+		{
+			canary = calcCanary();
+			return true;
+		}
+
+		bool checkCanary()
+		{
+			uintptr_t expectedCanary = calcCanary();
+			return expectedCanary == canary;
+		}
+	#endif
+};
+
+template<typename Tag>
+ExternalFreeBlock<Tag>* ExternalFreeBlock<Tag>::spareNodes = nullptr;
+
+template<typename Tag>
+uintptr_t ExternalFreeBlock<Tag>::spareCount = 0;
+
+} // namespace res
+} // namespace os
+
+#endif /* OS_RES_EXTERNAL_FREE_BLOCK */
@@ -0,0 +1,90 @@
+#ifndef   OS_RES_FUTEX_LOCK_HEADER
+#define   OS_RES_FUTEX_LOCK_HEADER
+
+#include <unistd.h>
+#include <inttypes.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+namespace os {
+namespace res {
+
+// a futex based lock, it can also be used as the Locker of a
+// TreeBlockAllocatorGeneric. A SHARED lock can be placed in memory that is
+// mapped into several processes.
+template<bool SHARED>
+class FutexLockGeneric
+{
+	private:
+	int32_t lockvar __attribute__((aligned(sizeof(int32_t))));
+
+	//// atomic wrapper functions
+	template<typename T>
+	static void store(T *mem, T val)
+	{
+		__atomic_store_n(mem, val, __ATOMIC_SEQ_CST);
+	}
+
+	template<typename T>
+	static bool cas(T *mem, T expected, T newval)
+	{
+		return __atomic_compare_exchange_n(mem, &expected, newval, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	}
+
+	template<typename T>
+	static T swap(T *mem, T val)
+	{
+		return __atomic_exchange_n(mem, val, __ATOMIC_SEQ_CST);
+	}
+	////
+
+	void futex(int op, int val)
+	{
+		syscall(SYS_futex, &lockvar, op, val, NULL, NULL, 0);
+	}
+
+	public:
+	typedef bool Item;
+
+	void init()
+	{
+		store(&lockvar, 0);
+	}
+
+	void lock()
+	{
+		if(!cas(&lockvar, 0, 1)) {
+			while(swap(&lockvar, 2) != 0) {
+				futex(SHARED ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE, 2);
+			}
+		}
+	}
+
+	void unlock()
+	{
+		const uint32_t oldval = swap(&lockvar, 0);
+		if(oldval == 2) {
+			futex(SHARED ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE, 1);
+		}
+	}
+
+	void lock(Item *state)
+	{
+		(void)state;
+		lock();
+	}
+
+	void unlock(Item *state)
+	{
+		(void)state;
+		unlock();
+	}
+};
+
+typedef FutexLockGeneric<false> FutexLock;
+typedef FutexLockGeneric<true> SharedFutexLock;
+
+} // namespace res
+} // namespace os
+
+#endif /* OS_RES_FUTEX_LOCK_HEADER */
@@ -0,0 +1,187 @@
+#ifndef   OS_RES_MAPPED_HEAP_HEADER
+#define   OS_RES_MAPPED_HEAP_HEADER
+
+// a heap that lives at the start of a single mapping together with all of
+// its free blocks, e.g. a mapped file. The mapping can be closed and attached
+// again later, also at another address. Attaching uses the NO_INIT
+// constructors, so the allocator state in the mapping is left untouched and
+// only relocated if the mapping moved. Users should store offsets instead of
+// pointers inside the heap if the mapping may move.
+
+#include <inttypes.h>
+#include "TreeBlockAllocator.h"
+#include "kassert.h"
+
+namespace os {
+namespace res {
+
+template<uintptr_t BLOCK_BITS, typename Locker>
+class MappedHeap
+{
+	private:
+	static const uint64_t MAGIC = 0x5452454548454150ull; // "TREEHEAP"
+	static const uint64_t VERSION = 1;
+
+	// header in front of every allocated object
+	struct alignas(2 * sizeof(uintptr_t)) ObjHeader
+	{
+		uintptr_t blocks;
+	};
+
+	uint64_t magic;
+	uint64_t version;
+
+	// address of this heap when it was formatted or attached the last time
+	uintptr_t base;
+
+	// size of the whole mapping in bytes
+	uintptr_t size;
+
+	// offset of the user root object, 0 if there is none
+	uintptr_t rootOffset;
+
+	TreeBlockAllocatorGeneric<BLOCK_BITS, EmbeddedFreeBlock, Locker> allocator;
+
+	static uintptr_t alignUp(uintptr_t numToRound, uintptr_t multiple)
+	{
+		uintptr_t mask = multiple - 1;
+	    return (numToRound + mask) & ~mask;
+	}
+
+	uintptr_t getDataStart() const
+	{
+		return alignUp(((uintptr_t)this) + sizeof(*this), ((uintptr_t)1) << BLOCK_BITS);
+	}
+
+	public:
+	MappedHeap()
+	{
+	}
+
+	MappedHeap(const char *NO_INIT) : allocator(NO_INIT)
+	{
+	}
+
+	// format a new heap in 'mapSize' bytes starting at 'this'
+	bool format(uintptr_t mapSize)
+	{
+		const uintptr_t end = ((uintptr_t)this) + mapSize;
+		const uintptr_t dataStart = getDataStart();
+		if(end <= dataStart) {
+			return false;
+		}
+
+		magic = MAGIC;
+		version = VERSION;
+		base = (uintptr_t)this;
+		size = mapSize;
+		rootOffset = 0;
+
+		allocator.init();
+		allocator.free((void*)dataStart, (end - dataStart) >> BLOCK_BITS);
+
+		return true;
+	}
+
+	// check if 'mapSize' bytes at 'this' hold a heap that was formatted
+	// before, relocate it if it was attached at another address the last time
+	bool attach(uintptr_t mapSize)
+	{
+		if(magic != MAGIC || version != VERSION || size != mapSize) {
+			return false;
+		}
+
+		if(base != (uintptr_t)this) {
+			allocator.relocate((intptr_t)(((uintptr_t)this) - base));
+			base = (uintptr_t)this;
+		}
+
+		return true;
+	}
+
+	// peek into a heap header without attaching it, for choosing the address
+	// to map it at
+	static uintptr_t getPreviousBase(const void *header)
+	{
+		const MappedHeap *heap = (const MappedHeap*)header;
+		if(heap->magic != MAGIC || heap->version != VERSION) {
+			return 0;
+		}
+		return heap->base;
+	}
+
+	static uintptr_t getHeaderSize()
+	{
+		return sizeof(MappedHeap);
+	}
+
+	uintptr_t getSize() const
+	{
+		return size;
+	}
+
+	// only reset the lock, e.g. after the last user of the mapping died
+	void resetLock()
+	{
+		allocator.initLocker();
+	}
+
+	void* alloc(uintptr_t bytes)
+	{
+		kassert(bytes != 0);
+
+		const uintptr_t blockSize = ((uintptr_t)1) << BLOCK_BITS;
+		const uintptr_t blocks = alignUp(bytes + sizeof(ObjHeader), blockSize) >> BLOCK_BITS;
+		ObjHeader *header = (ObjHeader*)allocator.alloc(blocks);
+		if(header == nullptr) {
+			return nullptr;
+		}
+
+		header->blocks = blocks;
+		return (void*)(header + 1);
+	}
+
+	void free(void *ptr)
+	{
+		kassert(ptr != nullptr);
+
+		ObjHeader *header = ((ObjHeader*)ptr) - 1;
+		allocator.free((void*)header, header->blocks);
+	}
+
+	uintptr_t toOffset(const void *ptr) const
+	{
+		if(ptr == nullptr) {
+			return 0;
+		}
+		return ((uintptr_t)ptr) - ((uintptr_t)this);
+	}
+
+	void* fromOffset(uintptr_t offset) const
+	{
+		if(offset == 0) {
+			return nullptr;
+		}
+		return (void*)(((uintptr_t)this) + offset);
+	}
+
+	void* getRoot() const
+	{
+		return fromOffset(rootOffset);
+	}
+
+	void setRoot(void *ptr)
+	{
+		rootOffset = toOffset(ptr);
+	}
+
+	uintptr_t getFreeCount()
+	{
+		return allocator.getFreeCount();
+	}
+};
+
+} // namespace res
+} // namespace os
+
+#endif /* OS_RES_MAPPED_HEAP_HEADER */
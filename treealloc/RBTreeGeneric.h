@@ -74,7 +74,7 @@ class RBTreeGeneric
 
 	static T *redParent(T *red)
 	{
-		return (T *)(red->*nodeMember).parentColor;
+		return (T *)(uintptr_t)(red->*nodeMember).parentColor;
 	}
 
 	void rotateSetParents(T *old, T *new_node, int color)
@@ -153,11 +153,22 @@ class RBTreeGeneric
 		return rebalance;
 	}
 
-	static void linkNode(T *node, T *parent, T **link)
+	// 'result' is the comparison of 'node' with 'parent'. Node types may
+	// store their links in other forms than plain pointers, so the link is
+	// not passed by address.
+	void linkNode(T *node, T *parent, int result)
 	{
 		(node->*nodeMember).parentColor = (uintptr_t)parent;
 		(node->*nodeMember).left = (node->*nodeMember).right = 0;
-		*link = node;
+		if(parent == 0) {
+			root = node;
+		}
+		else if(result < 0) {
+			(parent->*nodeMember).left = node;
+		}
+		else {
+			(parent->*nodeMember).right = node;
+		}
 	}
 
 	void insertInternal(T *node)
@@ -346,6 +357,15 @@ class RBTreeGeneric
 		return root;
 	}
 
+	// the memory holding all nodes was moved by 'delta' bytes, the nodes
+	// themselves have to be relocated by the owner
+	void relocate(intptr_t delta)
+	{
+		if(root) {
+			root = (T*)(((uintptr_t)root) + delta);
+		}
+	}
+
 	T* search(K key) const
 	{
 		T *node = root;
@@ -440,29 +460,30 @@ class RBTreeGeneric
 
 	T* insert(T *item)
 	{
-		T **newNode = &root;
+		T *node = root;
 		T *parent = 0;
+		int result = 0;
 
 		// figure out where to put item
 		// update size afterwards
-		while(*newNode) {
-			int result = cmp(item, *newNode);
+		while(node) {
+			result = cmp(item, node);
 
-			parent = *newNode;
+			parent = node;
 			if(result < 0) {
-				newNode = &(((*newNode)->*nodeMember).left);
+				node = (node->*nodeMember).left;
 			}
 			else if(result > 0) {
-				newNode = &(((*newNode)->*nodeMember).right);
+				node = (node->*nodeMember).right;
 			}
 			else {
 				// this item was already in the tree, do not update the size
-				return *newNode;
+				return node;
 			}
 		}
 
 		// first link the node, so it has a parent
-		linkNode(item, parent, newNode);
+		linkNode(item, parent, result);
 
 		// now propagate the size going up the tree
 		(item->*nodeMember).propagate(0, nodeMember);
@@ -2,14 +2,30 @@
 #define   OS_RES_TREE_BLOCK_ALLOCATOR
 
 #include <inttypes.h> // uintptr_t
+#include <sched.h> // sched_yield()
 #include "RBTree.h"
 #include "kassert.h"
 
 namespace os {
 namespace res {
 
+// tell the CPU that this is a spin-wait loop
+static inline void cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
 struct EmbeddedFreeBlock
 {
+	typedef lib::adt::RBNode<EmbeddedFreeBlock> TreeNode;
+
+	// the block lives in the free memory it describes
+	static const bool EMBEDDED = true;
+
 	#ifdef cf_debug_kernel
 		// this should be the first member of this class
 		uintptr_t canary;
@@ -22,10 +38,10 @@ struct EmbeddedFreeBlock
 		uintptr_t parent;
 	};
 
-	lib::adt::RBNode<EmbeddedFreeBlock> addrNode;
+	TreeNode addrNode;
 
 	union {
-		lib::adt::RBNode<EmbeddedFreeBlock> sizeNode;
+		TreeNode sizeNode;
 		LinkNode linkNode;
 	};
 
@@ -57,6 +73,53 @@ struct EmbeddedFreeBlock
 		return create(start, blockSize);
 	}
 
+	private:
+	// move a pointer that may carry a tag in its lowest bit
+	static uintptr_t relocatePointer(uintptr_t ptr, intptr_t delta)
+	{
+		const uintptr_t tag = ptr & 1;
+		const uintptr_t addr = ptr & ~((uintptr_t)1);
+		if(addr == 0) {
+			return tag;
+		}
+		return (addr + delta) | tag;
+	}
+
+	template<typename P>
+	static void relocatePointer(P **ptr, intptr_t delta)
+	{
+		*ptr = (P*)relocatePointer((uintptr_t)*ptr, delta);
+	}
+
+	public:
+	// the memory holding this block was moved by 'delta' bytes, fix all links
+	void relocate(intptr_t delta)
+	{
+		relocatePointer(&addrNode.left, delta);
+		relocatePointer(&addrNode.right, delta);
+		addrNode.parentColor = relocatePointer(addrNode.parentColor, delta);
+
+		// ring members carry a tag in 'headNext', see linkBlock()
+		if((((uintptr_t)headNext) & 1) == 1) {
+			relocatePointer(&linkNode.prev, delta);
+			relocatePointer(&linkNode.next, delta);
+		}
+		else {
+			relocatePointer(&sizeNode.left, delta);
+			relocatePointer(&sizeNode.right, delta);
+			sizeNode.parentColor = relocatePointer(sizeNode.parentColor, delta);
+		}
+		relocateNext(delta);
+
+		kassert(applyCanary());
+	}
+
+	// only fix 'headNext', for blocks that are not in the trees
+	void relocateNext(intptr_t delta)
+	{
+		relocatePointer(&headNext, delta);
+	}
+
 	#ifdef cf_debug_kernel
 		private:
 		uintptr_t calcCanary()
@@ -98,7 +161,7 @@ class TreeBlockAllocatorGeneric
 {
 	private:
 	static_assert(BLOCK_BITS < (sizeof(uintptr_t) * 8), "");
-	static_assert((((uintptr_t)1) << BLOCK_BITS) >= sizeof(FreeBlock), "");
+	static_assert(!FreeBlock::EMBEDDED || (((uintptr_t)1) << BLOCK_BITS) >= sizeof(FreeBlock), "");
 	static_assert((void*)nullptr == (void*)0, "");
 
 	template<bool COMPARE_SIZE>
@@ -131,8 +194,13 @@ class TreeBlockAllocatorGeneric
 	};
 
 	Locker locker;
-	lib::adt::RBTree<FreeBlock, &FreeBlock::addrNode, uintptr_t, Comparator<false> > addrTree;
-	lib::adt::RBTree<FreeBlock, &FreeBlock::sizeNode, uintptr_t, Comparator<true> > sizeTree;
+	typedef typename FreeBlock::TreeNode TreeNode;
+	lib::adt::RBTreeGeneric<FreeBlock, TreeNode, &FreeBlock::addrNode, uintptr_t, Comparator<false> > addrTree;
+	typedef lib::adt::RBTreeGeneric<FreeBlock, TreeNode, &FreeBlock::sizeNode, uintptr_t, Comparator<true> > SizeTree;
+	SizeTree sizeTree;
+
+	// the free blocks that start in the wilderness, by size like 'sizeTree'
+	SizeTree wildTree;
 
 	// number of free blocks
 	uintptr_t freeBlocks;
@@ -140,6 +208,112 @@ class TreeBlockAllocatorGeneric
 	// number of free continuous chunks
 	uintptr_t contChunks;
 
+	// deferred coalescing: freed chunks of up to QUICK_LISTS blocks are kept
+	// in one list per size and reused directly, they are merged into the
+	// trees in batches. 'headNext' links the blocks of a list.
+	static const uintptr_t QUICK_LISTS = 16;
+	FreeBlock *quickLists[QUICK_LISTS];
+
+	// number of free blocks in the quick lists, included in 'freeBlocks'
+	uintptr_t quickBlocks;
+
+	// the quick lists are flushed when they hold more blocks than this, 0
+	// disables deferred coalescing
+	uintptr_t quickLimit;
+
+	// lock-free stacks in front of the quick lists, one per size of up to
+	// QUICK_LISTS blocks. pushFree() and popFree() use them without the
+	// locker, so threads that free and allocate small chunks do not wait for
+	// each other. The first word of a chunk links it to the next one. The
+	// top of a stack is the first chunk and a tag of a whole word that is
+	// counted up with every update, both are exchanged together, so a stale
+	// top is never written back (ABA). A chunk that was popped may still be
+	// read by a pop that loaded it as top before, so memory that left the
+	// allocator must not be unmapped before waitForPops() returns. The
+	// stacks are drained into the trees with the quick lists and share their
+	// limit. They need a compare-and-swap of two words, -mcx16 on x86-64.
+	struct alignas(2 * sizeof(uintptr_t)) StackTop
+	{
+		uintptr_t chunk;
+		uintptr_t tag;
+	};
+
+#if defined(__SIZEOF_INT128__) && defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_16)
+	static const bool LOCK_FREE = FreeBlock::EMBEDDED;
+
+	// replace '*top' with 'desired' if it is '*expected', else store the
+	// current top in '*expected'
+	static bool exchangeTop(StackTop *top, StackTop *expected, StackTop desired)
+	{
+		union Word
+		{
+			StackTop top;
+			unsigned __int128 word;
+		};
+		Word oldWord;
+		Word newWord;
+		oldWord.top = *expected;
+		newWord.top = desired;
+
+		Word current;
+		current.word = __sync_val_compare_and_swap((unsigned __int128*)top, oldWord.word, newWord.word);
+		if(current.word == oldWord.word) {
+			return true;
+		}
+		*expected = current.top;
+		return false;
+	}
+#else
+	static const bool LOCK_FREE = false;
+
+	static bool exchangeTop(StackTop *top, StackTop *expected, StackTop desired)
+	{
+		(void)top;
+		(void)expected;
+		(void)desired;
+		return false;
+	}
+#endif
+
+	// the two words are read one by one, a torn top fails the exchange
+	static StackTop loadTop(StackTop *top)
+	{
+		StackTop out;
+		out.tag = __atomic_load_n(&top->tag, __ATOMIC_ACQUIRE);
+		out.chunk = __atomic_load_n(&top->chunk, __ATOMIC_ACQUIRE);
+		return out;
+	}
+
+	static StackTop nextTop(StackTop old, uintptr_t chunk)
+	{
+		StackTop out;
+		out.chunk = chunk;
+		out.tag = old.tag + 1;
+		return out;
+	}
+
+	StackTop stackTops[QUICK_LISTS];
+
+	// number of free blocks in the stacks, not included in 'freeBlocks'
+	uintptr_t stackBlocks;
+
+	// number of pops that may hold a stale top
+	uintptr_t activePops;
+
+	// the wilderness, the free space of the region the owner added last,
+	// see setWilderness(). Free blocks starting in it are kept in 'wildTree'
+	// and only used if no block in 'sizeTree' fits, so it stays whole and can
+	// be unmapped or grown into.
+	uintptr_t wildStart;
+	uintptr_t wildEnd;
+
+	// exact-fit index: the size tree node of a size, direct mapped by the
+	// number of blocks. A slot holds the node of the size that was added
+	// last among those mapping to it, or nullptr. Allocations of a size found
+	// here skip the descent of the size tree.
+	static const uintptr_t EXACT_SLOTS = 64;
+	FreeBlock *exactHeads[EXACT_SLOTS];
+
 	public:
 	uintptr_t getBlockBits() const
 	{
@@ -153,11 +327,72 @@ class TreeBlockAllocatorGeneric
 	    return (numToRound + mask) & ~mask;
 	}
 
-	void linkBlock(FreeBlock *oldBlock, FreeBlock *newBlock)
+	static uintptr_t exactSlot(uintptr_t size)
+	{
+		return (size >> BLOCK_BITS) & (EXACT_SLOTS - 1);
+	}
+
+	void initExactHeads()
+	{
+		for(uintptr_t i = 0; i < EXACT_SLOTS; ++i) {
+			exactHeads[i] = nullptr;
+		}
+	}
+
+	// the size tree node of 'oldBlock' is now 'newBlock', nullptr if the
+	// size left the tree
+	void replaceExact(FreeBlock *oldBlock, FreeBlock *newBlock)
+	{
+		FreeBlock **slot = &exactHeads[exactSlot(oldBlock->size)];
+		if(*slot == oldBlock) {
+			*slot = newBlock;
+		}
+	}
+
+	// the size tree node of exactly 'size' bytes, nullptr if it is not in
+	// the index
+	FreeBlock* findExact(uintptr_t size)
+	{
+		FreeBlock *block = exactHeads[exactSlot(size)];
+		if(block != nullptr && block->size == size) {
+			return block;
+		}
+		return nullptr;
+	}
+
+	bool isWilderness(FreeBlock *block)
+	{
+		const uintptr_t start = block->getStartAddress();
+		return start >= wildStart && start < wildEnd;
+	}
+
+	SizeTree& sizeTreeOf(FreeBlock *block)
+	{
+		return isWilderness(block) ? wildTree : sizeTree;
+	}
+
+	// the larger one of the largest blocks of both size trees
+	FreeBlock* largestBlock()
+	{
+		FreeBlock *block = sizeTree.max();
+		FreeBlock *wild = wildTree.max();
+		if(block == nullptr || (wild != nullptr && wild->size > block->size)) {
+			return wild;
+		}
+		return block;
+	}
+
+	// same-size blocks: the newest is the node in the size tree, its
+	// 'headNext' points to the one before it, which heads a ring of the
+	// others. Following 'linkNode.prev' from the head visits them from newer
+	// to older, so taking the tree node and promoting the head reuses the
+	// blocks last in, first out.
+	void linkBlock(SizeTree &tree, FreeBlock *oldBlock, FreeBlock *newBlock)
 	{
 		FreeBlock *ring = oldBlock->headNext;
 		newBlock->headNext = oldBlock;
-		sizeTree.replace(oldBlock, newBlock);
+		tree.replace(oldBlock, newBlock);
+		replaceExact(oldBlock, newBlock);
 
 		if(ring == nullptr) {
 			oldBlock->headNext = (FreeBlock*)(((uintptr_t)newBlock) | 1);
@@ -210,7 +445,8 @@ class TreeBlockAllocatorGeneric
 				ring->linkNode.next->linkNode.prev = ring->linkNode.prev;
 				ring->linkNode.prev->linkNode.next = ring->linkNode.next;
 			}
-			sizeTree.replace(oldBlock, ring);
+			sizeTreeOf(oldBlock).replace(oldBlock, ring);
+			replaceExact(oldBlock, ring);
 		}
 	}
 
@@ -221,7 +457,8 @@ class TreeBlockAllocatorGeneric
 			block->headNext = nullptr;
 		}
 		else {
-			sizeTree.remove(block);
+			sizeTreeOf(block).remove(block);
+			replaceExact(block, nullptr);
 		}
 	}
 
@@ -233,9 +470,13 @@ class TreeBlockAllocatorGeneric
 
 	void addToSizeTree(FreeBlock *block)
 	{
-		FreeBlock *oldBlock = sizeTree.insert(block);
+		SizeTree &tree = sizeTreeOf(block);
+		FreeBlock *oldBlock = tree.insert(block);
 		if(oldBlock != block) {
-			linkBlock(oldBlock, block);
+			linkBlock(tree, oldBlock, block);
+		}
+		if(&tree == &sizeTree) {
+			exactHeads[exactSlot(block->size)] = block;
 		}
 	}
 
@@ -246,6 +487,13 @@ class TreeBlockAllocatorGeneric
 	}
 
 	void* doAlignmentSplit(FreeBlock *outBlock, uintptr_t alignment, uintptr_t allocSize)
+	{
+		return splitAt(outBlock, alignUp(outBlock->getStartAddress(), alignment), allocSize);
+	}
+
+	// take 'allocSize' bytes at 'alignedChunk' out of the free block
+	// 'outBlock', the chunk must lie inside of it at a block boundary
+	void* splitAt(FreeBlock *outBlock, uintptr_t alignedChunk, uintptr_t allocSize)
 	{
 		// start of this free block
 		uintptr_t startAddr = outBlock->getStartAddress();
@@ -256,8 +504,8 @@ class TreeBlockAllocatorGeneric
 		// end of this free block, not inclusive
 		uintptr_t blockEnd = startAddr + blockSize;
 
-		// alignedChunk contains the aligned address
-		uintptr_t alignedChunk = alignUp(startAddr, alignment);
+		kassert(alignedChunk >= startAddr);
+		kassert(alignedChunk + allocSize <= blockEnd);
 
 		// now we may have 3 continuous blocks:
 		// 1. before the aligned chunk
@@ -319,113 +567,117 @@ class TreeBlockAllocatorGeneric
 		return (void*)alignedChunk;
 	}
 
-	public:
-	void init()
-	{
-		addrTree.init();
-		sizeTree.init();
-		locker.init();
-		freeBlocks = 0;
-		contChunks = 0;
-	}
-
-	TreeBlockAllocatorGeneric() : freeBlocks(0), contChunks(0)
-	{
-	}
-
-	TreeBlockAllocatorGeneric(const char *NO_INIT) : addrTree(NO_INIT),
-													sizeTree(NO_INIT)
-	{
-	}
-
-	void* alloc(uintptr_t blocks)
+	// take 'blocks' blocks from the start of the free block 'outBlock'
+	void* takeFront(FreeBlock *outBlock, uintptr_t blocks)
 	{
-		if(blocks == 0) {
-			return nullptr;
-		}
-
-		void *out = nullptr;
 		// the size to allocate
 		const uintptr_t size = blocks << BLOCK_BITS;
 
-		// get the lock
-		typename Locker::Item item;
-		locker.lock(&item);
+		// decrease the number of free blocks, this is just for statistics
+		kassert(freeBlocks >= blocks);
+		freeBlocks -= blocks;
 
-		// check the red-black trees
-		kassert(check());
+		// start of this free block
+		const uintptr_t startAddr = outBlock->getStartAddress();
 
-		// look for a FreeBlock >= 'size' in the size tree
-		FreeBlock *outBlock = sizeTree.ceil(size);
-		if(outBlock != nullptr) {
-			// we found a free block large enough, decrease the number of free
-			// blocks, this is just for statistics
-			kassert(freeBlocks >= blocks);
-			freeBlocks -= blocks;
+		// size of this block in bytes
+		const uintptr_t blockSize = outBlock->size;
 
-			// start of this free block
-			const uintptr_t startAddr = outBlock->getStartAddress();
+		// end of this free block, not inclusive
+		const uintptr_t blockEnd = startAddr + blockSize;
 
-			// size of this block in bytes
-			const uintptr_t blockSize = outBlock->size;
+		const uintptr_t trailingBlocksStart = startAddr + size;
+		const uintptr_t trailingSize = blockEnd - trailingBlocksStart;
+		const uintptr_t trailingBlocks = trailingSize >> BLOCK_BITS;
 
-			// end of this free block, not inclusive
-			const uintptr_t blockEnd = startAddr + blockSize;
+		if(trailingBlocks == 0) {
+			// a continuous block is completely removed
+			// remove the old block from both trees
+			remove(outBlock);
+			contChunks -= 1;
+		}
+		else {
+			// there are trailing blocks, we can add the trailing block to
+			// the size tree and replace the node in the address tree
+			// without removing and readding it into the same position in
+			// the addrTree
 
-			const uintptr_t trailingBlocksStart = startAddr + size;
-			const uintptr_t trailingSize = blockEnd - trailingBlocksStart;
-			const uintptr_t trailingBlocks = trailingSize >> BLOCK_BITS;
+			removeFromSizeTree(outBlock);
 
-			if(trailingBlocks == 0) {
-				// a continuous block is completely removed
-				// remove the old block from both trees
-				remove(outBlock);
-				contChunks -= 1;
-			}
-			else {
-				// there are trailing blocks, we can add the trailing block to
-				// the size tree and replace the node in the address tree
-				// without removing and readding it into the same position in
-				// the addrTree
+			FreeBlock *newBlock = FreeBlock::create(trailingBlocksStart, trailingSize);
+			addrTree.replace(outBlock, newBlock);
 
-				removeFromSizeTree(outBlock);
+			addToSizeTree(newBlock);
+			kassert(newBlock->applyCanary());
+		}
 
-				FreeBlock *newBlock = FreeBlock::create(trailingBlocksStart, trailingSize);
-				addrTree.replace(outBlock, newBlock);
+		FreeBlock::destroy(outBlock);
 
-				addToSizeTree(newBlock);
-				kassert(newBlock->applyCanary());
-			}
+		// check if the return value is roughly in the right range
+		kassert(!FreeBlock::EMBEDDED || startAddr >= (1024 * 1024));
+		kassert(startAddr < (~((uintptr_t)0xffff))); // max address - 64k
 
-			FreeBlock::destroy(outBlock);
+		return (void*)startAddr;
+	}
 
-			// check if the return value is roughly in the right range
-			kassert(startAddr >= (1024 * 1024));
-			kassert(startAddr < (~((uintptr_t)0xffff))); // max address - 64k
+	// chunks are waiting in the quick lists or on the stacks, they may merge
+	// with their neighbours into a fit
+	bool hasDeferred()
+	{
+		return quickBlocks != 0 || __atomic_load_n(&stackBlocks, __ATOMIC_RELAXED) != 0;
+	}
 
-			out = (void*)startAddr;
+	// remove the free blocks that start in ['start', 'end') but not in
+	// ['skipStart', 'skipEnd') from their size tree, or add them
+	void sortRange(uintptr_t start, uintptr_t end, uintptr_t skipStart, uintptr_t skipEnd, bool add)
+	{
+		for(FreeBlock *block = addrTree.ceil(start); block != nullptr; block = addrTree.next(block)) {
+			const uintptr_t blockStart = block->getStartAddress();
+			if(blockStart >= end) {
+				break;
+			}
+			if(blockStart >= skipStart && blockStart < skipEnd) {
+				continue;
+			}
+			if(add) {
+				addToSizeTree(block);
+			}
+			else {
+				removeFromSizeTree(block);
+			}
 		}
-
-		locker.unlock(&item);
-		return out;
 	}
 
-	void* allocAligned(uintptr_t alignment, uintptr_t blocks)
+	// the best fitting free block of at least 'size' bytes, a block in the
+	// wilderness only if no other one fits
+	FreeBlock* findFit(uintptr_t size)
 	{
-		// if not power of two
-		if((alignment == 0) || ((alignment & (alignment - 1)) != 0)) {
-			return nullptr;
+		// of exactly that size in the index first, the size tree would
+		// return the same node
+		FreeBlock *block = findExact(size);
+		if(block == nullptr) {
+			block = sizeTree.ceil(size);
 		}
-		if(blocks == 0) {
-			return nullptr;
+		if(block == nullptr) {
+			block = wildTree.ceil(size);
 		}
+		return block;
+	}
 
-		if(alignment <= (((uintptr_t)1) << BLOCK_BITS)) {
-			return alloc(blocks);
+	void* allocTree(uintptr_t blocks)
+	{
+		// look for a FreeBlock >= 'size'
+		FreeBlock *outBlock = findFit(blocks << BLOCK_BITS);
+		if(outBlock == nullptr) {
+			return nullptr;
 		}
 
-		// at this point alignment is a larger power of two than the block size
+		// we found a free block large enough
+		return takeFront(outBlock, blocks);
+	}
 
+	void* allocAlignedTree(uintptr_t alignment, uintptr_t blocks)
+	{
 		// the size to allocate
 		uintptr_t allocSize = blocks << BLOCK_BITS;
 
@@ -435,24 +687,16 @@ class TreeBlockAllocatorGeneric
 		// look for this size to allocate
 		uintptr_t size = (blocks + extraBlocks) << BLOCK_BITS;
 
-		// get the lock
-		typename Locker::Item item;
-		locker.lock(&item);
-
-		// check the red-black trees
-		kassert(check());
-
 		// look for a FreeBlock >= 'size' in the size tree
-		FreeBlock *outBlock = sizeTree.ceil(size);
+		FreeBlock *outBlock = findFit(size);
 		if(outBlock == nullptr) {
 			// there is no such free block
 			// try allocating exactly the desired size - maybe the resulting
 			// chunk happens to have proper alignment
-			outBlock = sizeTree.ceil(allocSize);
+			outBlock = findFit(allocSize);
 
 			if(outBlock == nullptr || ((outBlock->getStartAddress() % alignment) != 0)) {
 				// also not successful
-				locker.unlock(&item);
 				return nullptr;
 			}
 		}
@@ -466,30 +710,17 @@ class TreeBlockAllocatorGeneric
 		void *out = doAlignmentSplit(outBlock, alignment, allocSize);
 
 		// check if the return value is roughly in the right range
-		kassert((uintptr_t)out >= (1024 * 1024));
+		kassert(!FreeBlock::EMBEDDED || (uintptr_t)out >= (1024 * 1024));
 		kassert((uintptr_t)out < (~((uintptr_t)0xffff))); // max address - 64k
 
-		locker.unlock(&item);
-
 		return out;
 	}
 
-	bool free(void *s, uintptr_t blocks)
+	void freeTree(uintptr_t start, uintptr_t blocks)
 	{
-		uintptr_t start = (uintptr_t)s;
-
-		kassert(start != 0);
-		kassert(blocks != 0);
-
 		uintptr_t size = blocks << BLOCK_BITS;
 		const uintptr_t end = start + size;
 
-		typename Locker::Item item;
-		locker.lock(&item);
-
-		// check the red-black trees
-		kassert(check());
-
 		#ifdef cf_debug_kernel
 			// test if any of the blocks to be freed are already in the
 			// allocator -> double free
@@ -503,7 +734,7 @@ class TreeBlockAllocatorGeneric
 
 		// check if the arguments are roughly in the right range
 		kassert((freeBlocks + blocks) > freeBlocks);
-		kassert(start >= (1024 * 1024));
+		kassert(!FreeBlock::EMBEDDED || start >= (1024 * 1024));
 		kassert(start < (~((uintptr_t)0xffff))); // max address - 64k
 
 		freeBlocks += blocks;
@@ -573,88 +804,660 @@ class TreeBlockAllocatorGeneric
 			add(newBlock);
 			kassert(newBlock->applyCanary());
 		}
-
-		locker.unlock(&item);
-		return true;
 	}
 
-	bool grow(void *s, uintptr_t oldBlocks, uintptr_t newBlocks)
+	void initQuickLists()
 	{
-		uintptr_t start = (uintptr_t)s;
-		kassert(start != 0);
-		kassert(oldBlocks != 0);
-		kassert(newBlocks != 0);
-
-		kassert(newBlocks > oldBlocks);
-
-		bool resizeDone = false;
-		const uintptr_t oldSize = oldBlocks << BLOCK_BITS;
-		const uintptr_t addBlocks = newBlocks - oldBlocks;
-		const uintptr_t additionalSpace = addBlocks << BLOCK_BITS;
-		const uintptr_t end = start + oldSize;
-
-		typename Locker::Item item;
-		locker.lock(&item);
+		for(uintptr_t i = 0; i < QUICK_LISTS; ++i) {
+			quickLists[i] = nullptr;
+		}
+		quickBlocks = 0;
+	}
 
-		// check the red-black trees
-		kassert(check());
+	void initStacks()
+	{
+		for(uintptr_t i = 0; i < QUICK_LISTS; ++i) {
+			stackTops[i].chunk = 0;
+			stackTops[i].tag = 0;
+		}
+		stackBlocks = 0;
+		activePops = 0;
+	}
 
-		// check if the arguments are roughly in the right range
-		kassert(start >= (1024 * 1024));
-		kassert(start < (~((uintptr_t)0xffff))); // max address - 64k
+	// take all chunks off the stacks and merge them into the trees
+	void drainStacks()
+	{
+		if(!LOCK_FREE) {
+			return;
+		}
 
-		FreeBlock *extBlock = addrTree.search(end);
-		if(extBlock != nullptr) {
-			if(extBlock->size >= additionalSpace) {
-				const uintptr_t diff = extBlock->size - additionalSpace;
-				if(diff > 0) {
-					removeFromSizeTree(extBlock);
+		for(uintptr_t i = 0; i < QUICK_LISTS; ++i) {
+			const uintptr_t blocks = i + 1;
+			StackTop top = loadTop(&stackTops[i]);
+			while(top.chunk != 0 && !exchangeTop(&stackTops[i], &top, nextTop(top, 0))) {
+				// retry with the new top
+			}
 
-					FreeBlock *newBlock = FreeBlock::create(end + additionalSpace, diff);
-					addrTree.replace(extBlock, newBlock);
+			// oldest first, see flushQuickLists()
+			uintptr_t chunk = 0;
+			uintptr_t rest = top.chunk;
+			while(rest != 0) {
+				const uintptr_t next = __atomic_load_n((uintptr_t*)rest, __ATOMIC_RELAXED);
+				*((uintptr_t*)rest) = chunk;
+				chunk = rest;
+				rest = next;
+			}
 
-					addToSizeTree(newBlock);
-					kassert(newBlock->applyCanary());
-				}
-				else {
-					// a continuous block is completely removed
-					remove(extBlock);
-					FreeBlock::destroy(extBlock);
-					contChunks -= 1;
-				}
-				resizeDone = true;
-				freeBlocks -= (newBlocks - oldBlocks);
+			while(chunk != 0) {
+				const uintptr_t next = *((uintptr_t*)chunk);
+				__atomic_fetch_sub(&stackBlocks, blocks, __ATOMIC_RELAXED);
+				freeTree(chunk, blocks);
+				chunk = next;
 			}
 		}
-
-		locker.unlock(&item);
-		return resizeDone;
 	}
 
-	uintptr_t getFreeCount()
+	void quickPush(uintptr_t start, uintptr_t blocks)
 	{
-		uintptr_t out;
+		kassert((freeBlocks + blocks) > freeBlocks);
 
-		typename Locker::Item item;
-		locker.lock(&item);
-		out = freeBlocks;
-		locker.unlock(&item);
+		FreeBlock *block = FreeBlock::create(start, blocks << BLOCK_BITS);
+		block->headNext = quickLists[blocks - 1];
+		quickLists[blocks - 1] = block;
 
-		return out;
+		quickBlocks += blocks;
+		freeBlocks += blocks;
 	}
 
-	uintptr_t getContBlockCount()
+	void* quickPop(uintptr_t blocks)
 	{
-		uintptr_t out;
+		if(blocks > QUICK_LISTS) {
+			return nullptr;
+		}
 
-		typename Locker::Item item;
-		locker.lock(&item);
-		out = contChunks;
-		locker.unlock(&item);
+		FreeBlock *block = quickLists[blocks - 1];
+		if(block == nullptr) {
+			return nullptr;
+		}
+
+		quickLists[blocks - 1] = block->headNext;
+		quickBlocks -= blocks;
+		freeBlocks -= blocks;
+
+		const uintptr_t start = block->getStartAddress();
+		FreeBlock::destroy(block);
+
+		return (void*)start;
+	}
+
+	// reverse a quick list, its oldest chunk comes first then
+	static FreeBlock* reverseQuickList(FreeBlock *block)
+	{
+		FreeBlock *out = nullptr;
+		while(block != nullptr) {
+			FreeBlock *next = block->headNext;
+			block->headNext = out;
+			out = block;
+			block = next;
+		}
+		return out;
+	}
+
+	// merge all chunks of the stacks and the quick lists into the trees.
+	// The chunks are merged oldest first: a chunk added to the size tree
+	// becomes the tree node of its size and the one before it heads the ring,
+	// so the chunk freed last is reused first, as it would have been from the
+	// lists.
+	void flushQuickLists()
+	{
+		drainStacks();
+
+		for(uintptr_t i = 0; i < QUICK_LISTS; ++i) {
+			const uintptr_t blocks = i + 1;
+			FreeBlock *block = reverseQuickList(quickLists[i]);
+			while(block != nullptr) {
+				FreeBlock *next = block->headNext;
+				const uintptr_t start = block->getStartAddress();
+				FreeBlock::destroy(block);
+
+				// freeTree() counts these blocks again
+				freeBlocks -= blocks;
+				freeTree(start, blocks);
+
+				block = next;
+			}
+			quickLists[i] = nullptr;
+		}
+		quickBlocks = 0;
+	}
+
+	public:
+	void init()
+	{
+		addrTree.init();
+		sizeTree.init();
+		wildTree.init();
+		locker.init();
+		freeBlocks = 0;
+		contChunks = 0;
+		initQuickLists();
+		initStacks();
+		initExactHeads();
+		quickLimit = 0;
+		wildStart = 0;
+		wildEnd = 0;
+	}
+
+	TreeBlockAllocatorGeneric() : freeBlocks(0), contChunks(0), quickLimit(0), wildStart(0), wildEnd(0)
+	{
+		initQuickLists();
+		initStacks();
+		initExactHeads();
+	}
+
+	TreeBlockAllocatorGeneric(const char *NO_INIT) : addrTree(NO_INIT),
+													sizeTree(NO_INIT),
+													wildTree(NO_INIT)
+	{
+	}
+
+	void* alloc(uintptr_t blocks)
+	{
+		if(blocks == 0) {
+			return nullptr;
+		}
+
+		// get the lock
+		typename Locker::Item item;
+		locker.lock(&item);
+
+		// check the red-black trees
+		kassert(check());
+
+		void *out = quickPop(blocks);
+		if(out == nullptr) {
+			out = allocTree(blocks);
+			if(out == nullptr && hasDeferred()) {
+				// the memory may be waiting in the quick lists or on the stacks
+				flushQuickLists();
+				out = allocTree(blocks);
+			}
+		}
+
+		locker.unlock(&item);
+		return out;
+	}
+
+	// like alloc(), but if the free run found is less than an eighth larger
+	// than '*blocks' the whole run is taken instead of leaving a small
+	// remainder in the trees. '*blocks' is set to the number of blocks taken.
+	void* allocAtLeast(uintptr_t *blocks)
+	{
+		const uintptr_t minBlocks = *blocks;
+		if(minBlocks == 0) {
+			return nullptr;
+		}
+
+		typename Locker::Item item;
+		locker.lock(&item);
+
+		// check the red-black trees
+		kassert(check());
+
+		void *out = quickPop(minBlocks);
+		if(out == nullptr) {
+			FreeBlock *block = findFit(minBlocks << BLOCK_BITS);
+			if(block == nullptr && hasDeferred()) {
+				flushQuickLists();
+				block = findFit(minBlocks << BLOCK_BITS);
+			}
+			if(block != nullptr) {
+				uintptr_t takeBlocks = block->size >> BLOCK_BITS;
+				if(takeBlocks - minBlocks > (minBlocks >> 3)) {
+					takeBlocks = minBlocks;
+				}
+				out = takeFront(block, takeBlocks);
+				*blocks = takeBlocks;
+			}
+		}
+
+		locker.unlock(&item);
+		return out;
+	}
+
+	void* allocAligned(uintptr_t alignment, uintptr_t blocks)
+	{
+		// if not power of two
+		if((alignment == 0) || ((alignment & (alignment - 1)) != 0)) {
+			return nullptr;
+		}
+		if(blocks == 0) {
+			return nullptr;
+		}
+
+		if(alignment <= (((uintptr_t)1) << BLOCK_BITS)) {
+			return alloc(blocks);
+		}
+
+		// at this point alignment is a larger power of two than the block size
+
+		// get the lock
+		typename Locker::Item item;
+		locker.lock(&item);
+
+		// check the red-black trees
+		kassert(check());
+
+		void *out = allocAlignedTree(alignment, blocks);
+		if(out == nullptr && hasDeferred()) {
+			flushQuickLists();
+			out = allocAlignedTree(alignment, blocks);
+		}
+
+		locker.unlock(&item);
+
+		return out;
+	}
+
+	// take the free run with the lowest address that can hold 'blocks' blocks
+	// and starts below 'limit', this is a linear search in the address tree.
+	// Used to move allocations down, deferred chunks are not considered.
+	void* allocBelow(uintptr_t blocks, uintptr_t limit)
+	{
+		if(blocks == 0) {
+			return nullptr;
+		}
+
+		const uintptr_t size = blocks << BLOCK_BITS;
+
+		typename Locker::Item item;
+		locker.lock(&item);
+
+		// check the red-black trees
+		kassert(check());
+
+		void *out = nullptr;
+		FreeBlock *block = addrTree.min();
+		while(block != nullptr && block->getStartAddress() < limit) {
+			if(block->size >= size) {
+				out = takeFront(block, blocks);
+				break;
+			}
+			block = addrTree.next(block);
+		}
+
+		locker.unlock(&item);
+		return out;
+	}
+
+	// 'defer' false merges the blocks with their neighbours right away, even
+	// if deferred coalescing is enabled
+	bool free(void *s, uintptr_t blocks, bool defer = true)
+	{
+		uintptr_t start = (uintptr_t)s;
+
+		kassert(start != 0);
+		kassert(blocks != 0);
+
+		typename Locker::Item item;
+		locker.lock(&item);
+
+		// check the red-black trees
+		kassert(check());
+
+		if(defer && quickLimit != 0 && blocks <= QUICK_LISTS) {
+			quickPush(start, blocks);
+			if(quickBlocks > quickLimit) {
+				flushQuickLists();
+			}
+		}
+		else {
+			freeTree(start, blocks);
+		}
+
+		locker.unlock(&item);
+		return true;
+	}
+
+	bool grow(void *s, uintptr_t oldBlocks, uintptr_t newBlocks)
+	{
+		uintptr_t start = (uintptr_t)s;
+		kassert(start != 0);
+		kassert(oldBlocks != 0);
+		kassert(newBlocks != 0);
+
+		kassert(newBlocks > oldBlocks);
+
+		bool resizeDone = false;
+		const uintptr_t oldSize = oldBlocks << BLOCK_BITS;
+		const uintptr_t addBlocks = newBlocks - oldBlocks;
+		const uintptr_t additionalSpace = addBlocks << BLOCK_BITS;
+		const uintptr_t end = start + oldSize;
+
+		typename Locker::Item item;
+		locker.lock(&item);
+
+		// check the red-black trees
+		kassert(check());
+
+		// check if the arguments are roughly in the right range
+		kassert(!FreeBlock::EMBEDDED || start >= (1024 * 1024));
+		kassert(start < (~((uintptr_t)0xffff))); // max address - 64k
+
+		FreeBlock *extBlock = addrTree.search(end);
+		if(extBlock != nullptr) {
+			if(extBlock->size >= additionalSpace) {
+				const uintptr_t diff = extBlock->size - additionalSpace;
+				if(diff > 0) {
+					removeFromSizeTree(extBlock);
+
+					FreeBlock *newBlock = FreeBlock::create(end + additionalSpace, diff);
+					addrTree.replace(extBlock, newBlock);
+
+					addToSizeTree(newBlock);
+					kassert(newBlock->applyCanary());
+				}
+				else {
+					// a continuous block is completely removed
+					remove(extBlock);
+					FreeBlock::destroy(extBlock);
+					contChunks -= 1;
+				}
+				resizeDone = true;
+				freeBlocks -= (newBlocks - oldBlocks);
+			}
+		}
+
+		locker.unlock(&item);
+		return resizeDone;
+	}
+
+	uintptr_t getFreeCount()
+	{
+		uintptr_t out;
+
+		typename Locker::Item item;
+		locker.lock(&item);
+		out = freeBlocks + __atomic_load_n(&stackBlocks, __ATOMIC_RELAXED);
+		locker.unlock(&item);
+
+		return out;
+	}
+
+	uintptr_t getContBlockCount()
+	{
+		uintptr_t out;
+
+		typename Locker::Item item;
+		locker.lock(&item);
+		out = contChunks;
+		locker.unlock(&item);
+
+		return out;
+	}
+
+	// keep freed chunks of up to QUICK_LISTS blocks in the quick lists until
+	// they hold more than 'limit' blocks, 0 merges every chunk immediately
+	void setDeferredLimit(uintptr_t limit)
+	{
+		typename Locker::Item item;
+		locker.lock(&item);
+
+		__atomic_store_n(&quickLimit, limit, __ATOMIC_RELAXED);
+		if(quickBlocks + __atomic_load_n(&stackBlocks, __ATOMIC_RELAXED) > quickLimit) {
+			flushQuickLists();
+		}
+
+		locker.unlock(&item);
+	}
+
+	// free a chunk of up to QUICK_LISTS blocks without the locker, returns
+	// false if it has to be freed with free(), e.g. because the stacks are
+	// full or deferred coalescing is disabled
+	bool pushFree(void *s, uintptr_t blocks)
+	{
+		if(!LOCK_FREE || blocks == 0 || blocks > QUICK_LISTS) {
+			return false;
+		}
+
+		// count the blocks first, so the pop that takes them never sees less
+		const uintptr_t limit = __atomic_load_n(&quickLimit, __ATOMIC_RELAXED);
+		if(__atomic_add_fetch(&stackBlocks, blocks, __ATOMIC_RELAXED) > limit) {
+			__atomic_fetch_sub(&stackBlocks, blocks, __ATOMIC_RELAXED);
+			return false;
+		}
+
+		const uintptr_t chunk = (uintptr_t)s;
+		StackTop *top = &stackTops[blocks - 1];
+		StackTop old = loadTop(top);
+		do {
+			__atomic_store_n((uintptr_t*)chunk, old.chunk, __ATOMIC_RELAXED);
+		} while(!exchangeTop(top, &old, nextTop(old, chunk)));
+
+		return true;
+	}
+
+	// allocate a chunk of up to QUICK_LISTS blocks from the stacks without
+	// the locker, returns nullptr if the stack of that size is empty
+	void* popFree(uintptr_t blocks)
+	{
+		if(!LOCK_FREE || blocks == 0 || blocks > QUICK_LISTS) {
+			return nullptr;
+		}
+
+		StackTop *top = &stackTops[blocks - 1];
+		uintptr_t chunk = 0;
+
+		__atomic_fetch_add(&activePops, 1, __ATOMIC_SEQ_CST);
+		StackTop old = loadTop(top);
+		while(old.chunk != 0) {
+			// the chunk may have been popped and reused meanwhile, then the
+			// tag has changed and the exchange fails
+			const uintptr_t next = __atomic_load_n((uintptr_t*)old.chunk, __ATOMIC_RELAXED);
+			if(exchangeTop(top, &old, nextTop(old, next))) {
+				chunk = old.chunk;
+				break;
+			}
+		}
+		__atomic_fetch_sub(&activePops, 1, __ATOMIC_SEQ_CST);
+
+		if(chunk != 0) {
+			__atomic_fetch_sub(&stackBlocks, blocks, __ATOMIC_RELAXED);
+		}
+		return (void*)chunk;
+	}
+
+	// make the 'blocks' blocks at 's' the wilderness, usually the region that
+	// was just added with free(). Allocations only take them if no other free
+	// block fits. nullptr turns the policy off. The free blocks in the old
+	// and the new wilderness change their size tree, so this takes time in
+	// the number of them.
+	void setWilderness(void *s, uintptr_t blocks)
+	{
+		typename Locker::Item item;
+		locker.lock(&item);
+
+		const uintptr_t oldStart = wildStart;
+		const uintptr_t oldEnd = wildEnd;
+		const uintptr_t newStart = (uintptr_t)s;
+		const uintptr_t newEnd = s != nullptr ? newStart + (blocks << BLOCK_BITS) : 0;
+
+		// remove every block that starts in one of both while the old
+		// wilderness decides their tree, add them back with the new one
+		sortRange(oldStart, oldEnd, 0, 0, false);
+		sortRange(newStart, newEnd, oldStart, oldEnd, false);
+		wildStart = newStart;
+		wildEnd = newEnd;
+		sortRange(newStart, newEnd, 0, 0, true);
+		sortRange(oldStart, oldEnd, newStart, newEnd, true);
+
+		locker.unlock(&item);
+	}
+
+	// wait until no pop can read a chunk that left the stacks before, call
+	// this before unmapping memory that was free in this allocator
+	void waitForPops()
+	{
+		// pops are a few instructions long, unless their thread was
+		// preempted
+		for(uintptr_t spins = 0; __atomic_load_n(&activePops, __ATOMIC_SEQ_CST) != 0; ++spins) {
+			if(spins < 64) {
+				cpuRelax();
+			}
+			else {
+				sched_yield();
+			}
+		}
+	}
+
+	// merge all deferred chunks into the trees
+	void flushDeferred()
+	{
+		typename Locker::Item item;
+		locker.lock(&item);
+
+		flushQuickLists();
+
+		locker.unlock(&item);
+	}
+
+	uintptr_t getDeferredCount()
+	{
+		uintptr_t out;
+
+		typename Locker::Item item;
+		locker.lock(&item);
+		out = quickBlocks + __atomic_load_n(&stackBlocks, __ATOMIC_RELAXED);
+		locker.unlock(&item);
+
+		return out;
+	}
+
+	// size of the largest free run in bytes, deferred chunks are not counted
+	uintptr_t getLargestFree()
+	{
+		uintptr_t out = 0;
+
+		typename Locker::Item item;
+		locker.lock(&item);
+		FreeBlock *block = largestBlock();
+		if(block != nullptr) {
+			out = block->size;
+		}
+		locker.unlock(&item);
 
 		return out;
 	}
 
+	private:
+	void destroyAll(FreeBlock *root)
+	{
+		if(root == nullptr) {
+			return;
+		}
+
+		FreeBlock *left = root->addrNode.left;
+		FreeBlock *right = root->addrNode.right;
+		FreeBlock::destroy(root);
+		destroyAll(left);
+		destroyAll(right);
+	}
+
+	public:
+	// forget all free blocks, e.g. before the allocator is thrown away. This
+	// gives back the nodes of free blocks that are not embedded.
+	void clear()
+	{
+		typename Locker::Item item;
+		locker.lock(&item);
+
+		destroyAll(addrTree.getRoot());
+		for(uintptr_t i = 0; i < QUICK_LISTS; ++i) {
+			FreeBlock *block = quickLists[i];
+			while(block != nullptr) {
+				FreeBlock *next = block->headNext;
+				FreeBlock::destroy(block);
+				block = next;
+			}
+		}
+
+		addrTree.init();
+		sizeTree.init();
+		wildTree.init();
+		freeBlocks = 0;
+		contChunks = 0;
+		initQuickLists();
+		initStacks();
+		initExactHeads();
+		wildStart = 0;
+		wildEnd = 0;
+
+		locker.unlock(&item);
+	}
+
+	private:
+	void relocateAll(FreeBlock *root, intptr_t delta)
+	{
+		if(root == nullptr) {
+			return;
+		}
+
+		root->relocate(delta);
+		relocateAll(root->addrNode.left, delta);
+		relocateAll(root->addrNode.right, delta);
+	}
+
+	public:
+	// the memory holding all free blocks and this allocator was moved by
+	// 'delta' bytes, e.g. a file mapping was mapped at another address
+	void relocate(intptr_t delta)
+	{
+		typename Locker::Item item;
+		locker.lock(&item);
+
+		addrTree.relocate(delta);
+		sizeTree.relocate(delta);
+		wildTree.relocate(delta);
+		relocateAll(addrTree.getRoot(), delta);
+
+		for(uintptr_t i = 0; i < QUICK_LISTS; ++i) {
+			if(quickLists[i] == nullptr) {
+				continue;
+			}
+			quickLists[i] = (FreeBlock*)(((uintptr_t)quickLists[i]) + delta);
+			for(FreeBlock *block = quickLists[i]; block != nullptr; block = block->headNext) {
+				block->relocateNext(delta);
+			}
+		}
+
+		// chunks on the stacks would have to be relocated by their owner
+		for(uintptr_t i = 0; i < QUICK_LISTS; ++i) {
+			kassert(stackTops[i].chunk == 0);
+		}
+
+		for(uintptr_t i = 0; i < EXACT_SLOTS; ++i) {
+			if(exactHeads[i] != nullptr) {
+				exactHeads[i] = (FreeBlock*)(((uintptr_t)exactHeads[i]) + delta);
+			}
+		}
+
+		if(wildEnd != 0) {
+			wildStart += delta;
+			wildEnd += delta;
+		}
+
+		kassert(check());
+
+		locker.unlock(&item);
+	}
+
+	// reinitialise only the lock, e.g. after attaching to memory whose last
+	// user died while holding it
+	void initLocker()
+	{
+		locker.init();
+	}
+
 	void checkAllCanaries(FreeBlock *root)
 	{
 		if(root == nullptr) {
@@ -666,6 +1469,40 @@ class TreeBlockAllocatorGeneric
 		checkAllCanaries(root->addrNode.left);
 	}
 
+	// every block of 'tree', also in the rings, has the size of its node and
+	// belongs into that tree, their blocks are added to '*count'
+	bool checkSizeTree(SizeTree &tree, uintptr_t *count)
+	{
+		for(FreeBlock *block = tree.min(); block != nullptr; block = tree.next(block)) {
+			if(&sizeTreeOf(block) != &tree) {
+				printk("block at %" PRIuPTR " is in the wrong size tree\n", block->getStartAddress());
+				return false;
+			}
+			*count += block->size >> BLOCK_BITS;
+			if(block->headNext != nullptr) {
+				// linked list case
+				// all freeblock here must have this size
+				uintptr_t size = block->size;
+				FreeBlock *ringElem = block->headNext;
+				do {
+					if(ringElem->size != size) {
+						printk("element in ring has wrong size, expected %" PRIuPTR " got %" PRIuPTR "\n", size, (uintptr_t)ringElem->size);
+						return false;
+					}
+					if(&sizeTreeOf(ringElem) != &tree) {
+						printk("block at %" PRIuPTR " is in the wrong size tree\n", ringElem->getStartAddress());
+						return false;
+					}
+					*count += ringElem->size >> BLOCK_BITS;
+
+					ringElem = ringElem->linkNode.next;
+				}
+				while(ringElem != block->headNext);
+			}
+		}
+		return true;
+	}
+
 	// this function is for debugging and testcases
 	bool check()
 	{
@@ -690,29 +1527,42 @@ class TreeBlockAllocatorGeneric
 			return false;
 		}
 
+		bool retC = wildTree.check();
+		if(!retC) {
+			printk("wildTree check failed\n");
+			return false;
+		}
+
+		// every slot of the exact-fit index holds a node of the size tree
+		for(uintptr_t i = 0; i < EXACT_SLOTS; ++i) {
+			FreeBlock *block = exactHeads[i];
+			if(block != nullptr && (exactSlot(block->size) != i || sizeTree.search(block->size) != block)) {
+				printk("exact-fit slot %" PRIuPTR " does not hold a size tree node\n", i);
+				return false;
+			}
+		}
+
 		// iterate over all elements this includes the linked lists
 		// check if the size of all elements in a linked list is the same
 		// check if 'freeBlocks' is the same as the number of free blocks
 		uintptr_t count = 0;
-		for(FreeBlock *block = sizeTree.min(); block != nullptr; block = sizeTree.next(block)) {
-			count += block->size >> BLOCK_BITS;
-			if(block->headNext != nullptr) {
-				// linked list case
-				// all freeblock here must have this size
-				uintptr_t size = block->size;
-				FreeBlock *ringElem = block->headNext;
-				do {
-					if(ringElem->size != size) {
-						printk("element in ring has wrong size, expected %" PRIuPTR " got %" PRIuPTR "\n", size, ringElem->size);
-						return false;
-					}
-					count += ringElem->size >> BLOCK_BITS;
-
-					ringElem = ringElem->linkNode.next;
+		for(uintptr_t i = 0; i < QUICK_LISTS; ++i) {
+			for(FreeBlock *block = quickLists[i]; block != nullptr; block = block->headNext) {
+				if(block->size != ((i + 1) << BLOCK_BITS)) {
+					printk("element in quick list %" PRIuPTR " has wrong size %" PRIuPTR "\n", i, (uintptr_t)block->size);
+					return false;
 				}
-				while(ringElem != block->headNext);
+				count += i + 1;
 			}
 		}
+		if(count != quickBlocks) {
+			printk("counted number of deferred blocks %" PRIuPTR " is not equal to 'quickBlocks' %" PRIuPTR "\n", count, quickBlocks);
+			return false;
+		}
+
+		if(!checkSizeTree(sizeTree, &count) || !checkSizeTree(wildTree, &count)) {
+			return false;
+		}
 
 		if(count != freeBlocks) {
 			printk("counted number of free blocks %" PRIuPTR " is not equal to 'freeBlocks' %" PRIuPTR "\n", count, freeBlocks);
@@ -739,16 +1589,20 @@ class TreeBlockAllocatorGeneric
 	void getTreeElems(uintptr_t *sizeAddrTree, uintptr_t *sizeSizeTree)
 	{
 		uintptr_t sizeElems = 0;
-		for(FreeBlock *block = sizeTree.min(); block != nullptr; block = sizeTree.next(block)) {
-			sizeElems += 1;
-			if(block->headNext != nullptr) {
-				// linked list case
-				FreeBlock *ringElem = block->headNext;
-				do {
-					sizeElems += 1;
-					ringElem = ringElem->linkNode.next;
+		SizeTree *trees[2] = { &sizeTree, &wildTree };
+		for(uintptr_t i = 0; i < 2; ++i) {
+			SizeTree *tree = trees[i];
+			for(FreeBlock *block = tree->min(); block != nullptr; block = tree->next(block)) {
+				sizeElems += 1;
+				if(block->headNext != nullptr) {
+					// linked list case
+					FreeBlock *ringElem = block->headNext;
+					do {
+						sizeElems += 1;
+						ringElem = ringElem->linkNode.next;
+					}
+					while(ringElem != block->headNext);
 				}
-				while(ringElem != block->headNext);
 			}
 		}
 		*sizeSizeTree = sizeElems;
@@ -783,8 +1637,20 @@ class TreeBlockAllocatorGeneric
 		typename Locker::Item item;
 		locker.lock(&item);
 
-		for(FreeBlock *block = sizeTree.max(); block != nullptr; block = sizeTree.prev(block)) {
-			if(!iter((void*)(block->getStartAddress()), block->size >> BLOCK_BITS)) {
+		// both size trees merged, the wilderness last among equal sizes
+		FreeBlock *block = sizeTree.max();
+		FreeBlock *wild = wildTree.max();
+		while(block != nullptr || wild != nullptr) {
+			FreeBlock *next;
+			if(wild == nullptr || (block != nullptr && block->size >= wild->size)) {
+				next = block;
+				block = sizeTree.prev(block);
+			}
+			else {
+				next = wild;
+				wild = wildTree.prev(wild);
+			}
+			if(!iter((void*)(next->getStartAddress()), next->size >> BLOCK_BITS)) {
 				break;
 			}
 		}
@@ -792,11 +1658,227 @@ class TreeBlockAllocatorGeneric
 		locker.unlock(&item);
 	}
 
-	void* allocLargest(uintptr_t minAlign, uintptr_t *minBlocks)
+	private:
+	// the block aligned address in the free block 'block' closest to 'hint'
+	// where 'size' bytes fit, the block must hold them
+	uintptr_t nearestIn(FreeBlock *block, uintptr_t hint, uintptr_t size)
+	{
+		const uintptr_t start = block->getStartAddress();
+		const uintptr_t last = start + block->size - size;
+		if(hint <= start) {
+			return start;
+		}
+		if(hint >= last) {
+			return last;
+		}
+		return start + (((hint - start) >> BLOCK_BITS) << BLOCK_BITS);
+	}
+
+	// distance of 'hint' to the free block, 0 if it lies inside
+	static uintptr_t distanceTo(FreeBlock *block, uintptr_t hint)
+	{
+		const uintptr_t start = block->getStartAddress();
+		if(hint < start) {
+			return start - hint;
+		}
+		const uintptr_t end = start + block->size;
+		return hint < end ? 0 : hint - end + 1;
+	}
+
+	// the free block holding 'size' bytes that is closest to 'hint', the
+	// address tree is walked outwards from the hint on both sides at once
+	FreeBlock* findNear(uintptr_t hint, uintptr_t size)
+	{
+		FreeBlock *down = addrTree.floor(hint);
+		FreeBlock *up = down != nullptr ? addrTree.next(down) : addrTree.ceil(hint);
+
+		while(down != nullptr || up != nullptr) {
+			// step on the side that is closer to the hint
+			FreeBlock **side = &down;
+			if(down == nullptr || (up != nullptr && distanceTo(up, hint) < distanceTo(down, hint))) {
+				side = &up;
+			}
+
+			FreeBlock *block = *side;
+			if(block->size >= size) {
+				return block;
+			}
+			*side = side == &down ? addrTree.prev(block) : addrTree.next(block);
+		}
+		return nullptr;
+	}
+
+	// the free block with the lowest address where 'size' bytes fit between
+	// 'low' and 'high', '*chunk' is set to the address
+	FreeBlock* findWithin(uintptr_t low, uintptr_t high, uintptr_t size, uintptr_t *chunk)
+	{
+		FreeBlock *block = addrTree.floor(low);
+		if(block == nullptr || block->getStartAddress() + block->size <= low) {
+			block = addrTree.ceil(low);
+		}
+
+		for(; block != nullptr; block = addrTree.next(block)) {
+			const uintptr_t start = block->getStartAddress();
+			if(start >= high || high - start < size) {
+				return nullptr;
+			}
+
+			// stay on the block grid of this free block
+			uintptr_t first = start;
+			if(low > start) {
+				first = start + alignUp(low - start, ((uintptr_t)1) << BLOCK_BITS);
+			}
+			uintptr_t end = start + block->size;
+			if(end > high) {
+				end = high;
+			}
+			if(first < end && end - first >= size) {
+				*chunk = first;
+				return block;
+			}
+		}
+		return nullptr;
+	}
+
+	// take the aligned start of the free run that fits 'alignedSize' bytes
+	// best, or of the largest one if none does. Returns the bytes that can be
+	// taken there at the alignment, rounded down to a multiple of it.
+	uintptr_t findRange(uintptr_t alignment, uintptr_t alignedSize, FreeBlock **outBlock)
+	{
+		FreeBlock *block = largestBlock();
+		if(block == nullptr) {
+			return 0;
+		}
+
+		// a run this large holds the size at any alignment
+		const uintptr_t fitSize = alignedSize + (alignment - (((uintptr_t)1) << BLOCK_BITS));
+		if(fitSize > alignedSize && block->size >= fitSize) {
+			block = findFit(fitSize);
+		}
+
+		const uintptr_t start = block->getStartAddress();
+		const uintptr_t alignWaste = alignUp(start, alignment) - start;
+		*outBlock = block;
+		if(block->size <= alignWaste) {
+			return 0;
+		}
+		return (block->size - alignWaste) & ~(alignment - 1);
+	}
+
+	public:
+	// take between 'minBlocks' and 'maxBlocks' blocks, as many as one free
+	// run holds, aligned to 'alignment'. A run that holds 'maxBlocks' is
+	// chosen by best fit, else the largest one is used. The number of blocks
+	// is a multiple of the alignment in blocks, it is stored in '*gotBlocks'.
+	// The deferred chunks are merged only if no run holds 'minBlocks' and
+	// 'flush' is true.
+	void* allocRange(uintptr_t minBlocks, uintptr_t maxBlocks, uintptr_t alignment, uintptr_t *gotBlocks, bool flush = true)
+	{
+		if((alignment == 0) || ((alignment & (alignment - 1)) != 0)) {
+			return nullptr;
+		}
+		if(minBlocks == 0 || minBlocks > maxBlocks) {
+			return nullptr;
+		}
+		if(alignment < (((uintptr_t)1) << BLOCK_BITS)) {
+			alignment = ((uintptr_t)1) << BLOCK_BITS;
+		}
+
+		// larger sizes than this never fit, it keeps the sums from overflowing
+		const uintptr_t sizeLimit = ~((uintptr_t)0) >> 2;
+		if(minBlocks > (sizeLimit >> BLOCK_BITS)) {
+			return nullptr;
+		}
+		if(maxBlocks > (sizeLimit >> BLOCK_BITS)) {
+			maxBlocks = sizeLimit >> BLOCK_BITS;
+		}
+		const uintptr_t minSize = minBlocks << BLOCK_BITS;
+		const uintptr_t maxSize = alignUp(maxBlocks << BLOCK_BITS, alignment);
+
+		typename Locker::Item item;
+		locker.lock(&item);
+
+		// check the red-black trees
+		kassert(check());
+
+		FreeBlock *block = nullptr;
+		uintptr_t size = findRange(alignment, maxSize, &block);
+		if(flush && size < minSize && hasDeferred()) {
+			// the deferred chunks may hide a large enough run
+			flushQuickLists();
+			size = findRange(alignment, maxSize, &block);
+		}
+
+		void *out = nullptr;
+		if(size >= minSize) {
+			if(size > maxSize) {
+				size = maxSize;
+			}
+			if((size >> BLOCK_BITS) > maxBlocks) {
+				// the alignment rounded 'maxBlocks' up, stay below it
+				size -= alignment;
+			}
+			if(size >= minSize) {
+				out = doAlignmentSplit(block, alignment, size);
+				*gotBlocks = size >> BLOCK_BITS;
+				freeBlocks -= size >> BLOCK_BITS;
+			}
+		}
+
+		locker.unlock(&item);
+		return out;
+	}
+
+	// take 'blocks' blocks from the free run closest to 'hint', at the place
+	// in that run that is closest to the hint. The address tree is walked
+	// outwards from the hint, so this is linear in the number of free runs
+	// passed on the way.
+	void* allocNear(uintptr_t hint, uintptr_t blocks)
 	{
+		if(blocks == 0) {
+			return nullptr;
+		}
+
+		const uintptr_t size = blocks << BLOCK_BITS;
+
+		typename Locker::Item item;
+		locker.lock(&item);
+
+		// check the red-black trees
+		kassert(check());
+
 		void *out = nullptr;
+		FreeBlock *largest = largestBlock();
+		if((largest == nullptr || largest->size < size) && hasDeferred()) {
+			flushQuickLists();
+			largest = largestBlock();
+		}
+
+		// the walk would pass every free run if none is large enough
+		if(largest != nullptr && largest->size >= size) {
+			FreeBlock *block = findNear(hint, size);
+			kassert(block != nullptr);
+			out = splitAt(block, nearestIn(block, hint, size), size);
+			freeBlocks -= blocks;
+		}
+
+		locker.unlock(&item);
+		return out;
+	}
+
+	// take 'blocks' blocks that lie completely in ['low', 'high'), at the
+	// lowest address possible. Only the free runs that overlap the range
+	// are visited.
+	void* allocWithinRange(uintptr_t low, uintptr_t high, uintptr_t blocks)
+	{
+		if(blocks == 0 || low >= high) {
+			return nullptr;
+		}
 
-		const uintptr_t minSize = *minBlocks << BLOCK_BITS;
+		const uintptr_t size = blocks << BLOCK_BITS;
+		if(high - low < size) {
+			return nullptr;
+		}
 
 		typename Locker::Item item;
 		locker.lock(&item);
@@ -804,30 +1886,31 @@ class TreeBlockAllocatorGeneric
 		// check the red-black trees
 		kassert(check());
 
-		FreeBlock *block = sizeTree.max();
+		uintptr_t chunk = 0;
+		FreeBlock *block = findWithin(low, high, size, &chunk);
+		if(block == nullptr && hasDeferred()) {
+			flushQuickLists();
+			block = findWithin(low, high, size, &chunk);
+		}
+
+		void *out = nullptr;
 		if(block != nullptr) {
-			const uintptr_t start = block->getStartAddress();
-			const uintptr_t blockSize = block->size;
-
-			if(blockSize >= minSize) {
-				const uintptr_t alignStart = alignUp(start, minAlign);
-				const uintptr_t alignWaste = alignStart - start;
-				if(blockSize > alignWaste) {
-					const uintptr_t remainSize = (blockSize - alignWaste) & ~(minAlign - 1);
-					if(remainSize >= minSize) {
-						const uintptr_t remainBlocks = remainSize >> BLOCK_BITS;
-						out = doAlignmentSplit(block, minAlign, remainSize);
-						*minBlocks = remainBlocks;
-						freeBlocks -= remainBlocks;
-					}
-				}
-			}
+			out = splitAt(block, chunk, size);
+			freeBlocks -= blocks;
 		}
 
 		locker.unlock(&item);
 		return out;
 	}
 
+	// take the largest free run, aligned, if it holds at least '*minBlocks'
+	// blocks, '*minBlocks' is set to the number of blocks taken. The deferred
+	// chunks are left alone, reclaim calls this on every free.
+	void* allocLargest(uintptr_t minAlign, uintptr_t *minBlocks)
+	{
+		return allocRange(*minBlocks, ~((uintptr_t)0), minAlign, minBlocks, false);
+	}
+
 	void benchCleanup()
 	{
 		uintptr_t largestStart = 0;
@@ -843,7 +1926,11 @@ class TreeBlockAllocatorGeneric
 		if(largestStart != 0) {
 			this->addrTree.init();
 			this->sizeTree.init();
+			this->wildTree.init();
 			this->freeBlocks = 0;
+			this->initQuickLists();
+			this->initStacks();
+			this->initExactHeads();
 
 			this->free((void*)largestStart, largestSize >> BLOCK_BITS);
 		}
@@ -2,17 +2,21 @@
 #define   OS_RES_WRAPPER_ALLOCATOR_HEADER
 
 // this allocator is just a thin wrapper around a block allocator, using it
-// directly
+// directly. It derives from the block allocator, so both stateless wrappers
+// with static functions and stateful block allocator instances can be used.
+// Several wrappers with different block allocators can share one address
+// space, each of them writes its TAG into the headers, so the owner of an
+// allocation can be found with getTag().
 
 #include <inttypes.h>
-#include <string.h> // memcpy
+#include "memops.h" // memops_copy
 #include "kassert.h"
 
 namespace os {
 namespace res {
 
-template<typename BlockAllocator, uintptr_t ALIGNMENT = 2 * sizeof(uintptr_t)>
-class WrapperAllocator
+template<typename BlockAllocator, uintptr_t ALIGNMENT = 2 * sizeof(uintptr_t), uintptr_t TAG = 0>
+class WrapperAllocator : public BlockAllocator
 {
 	private:
 	struct alignas(ALIGNMENT) MemHeader
@@ -52,18 +56,67 @@ class WrapperAllocator
 		#endif
 	};
 
+	// flags in the low bits of MemHeader::start, the start is always block
+	// aligned to at least 16 bytes. GROWN is set once an allocation was grown
+	// by resize or realloc, growing it again adds geometric slack. The three
+	// bits above it hold the TAG.
+	static const uintptr_t GROWN = 1;
+	static const uintptr_t TAG_SHIFT = 1;
+	static const uintptr_t TAG_MASK = 7 << TAG_SHIFT;
+	static const uintptr_t FLAGS = GROWN | TAG_MASK;
+
+	static_assert(TAG <= (TAG_MASK >> TAG_SHIFT), "TAG does not fit into the header");
+
 	static uintptr_t alignUp(uintptr_t numToRound, uintptr_t multiple)
 	{
 		uintptr_t mask = multiple - 1;
 	    return (numToRound + mask) & ~mask;
 	}
 
+	static uintptr_t getStart(const MemHeader *header)
+	{
+		return header->start & ~FLAGS;
+	}
+
+	// the size to allocate for growing an allocation that grew before
+	static uintptr_t withSlack(uintptr_t size)
+	{
+		const uintptr_t out = size + (size >> 1);
+		return out > size ? out : size;
+	}
+
+	// write the header of an unaligned allocation at the start of its blocks
+	static void* writeHeader(uintptr_t rawMem, uintptr_t nBlocks)
+	{
+		kassert((rawMem & FLAGS) == 0);
+
+		MemHeader *header = (MemHeader*)rawMem;
+		header->start = rawMem | (TAG << TAG_SHIFT);
+		header->blocks = nBlocks;
+
+		kassert(header->applyCanary());
+
+		return (void*)(header + 1);
+	}
+
 	public:
 	uintptr_t overhead() const
 	{
 		return sizeof(MemHeader);
 	}
 
+	// the usable size that alloc() or allocAligned() give for 'size', for
+	// alignments above the header size the least they give
+	uintptr_t getAllocSize(uintptr_t alignment, uintptr_t size) const
+	{
+		const uintptr_t blockSize = ((uintptr_t)1) << BlockAllocator::getBlockBits();
+		if(alignment <= sizeof(MemHeader)) {
+			return alignUp(size + sizeof(MemHeader), blockSize) - sizeof(MemHeader);
+		}
+		return alignUp(size + sizeof(MemHeader) + (alignment - 1), blockSize)
+			- sizeof(MemHeader) - (alignment - 1);
+	}
+
 	void* alloc(uintptr_t size)
 	{
 		kassert(size != 0);
@@ -76,14 +129,92 @@ class WrapperAllocator
 		if(rawMem == 0) {
 			return 0;
 		}
+		return writeHeader(rawMem, nBlocks);
+	}
 
-		MemHeader *header = (MemHeader*)rawMem;
-		header->start = rawMem;
-		header->blocks = nBlocks;
+	// like alloc(), '*actualSize' is set to the usable size, which includes
+	// the rest of the last block and may be more than the block allocator
+	// was asked for
+	void* allocAtLeast(uintptr_t size, uintptr_t *actualSize)
+	{
+		kassert(size != 0);
 
-		kassert(header->applyCanary());
+		const uintptr_t blockBits = BlockAllocator::getBlockBits();
+		const uintptr_t blockSize = ((uintptr_t)1) << blockBits;
+		uintptr_t nBlocks = alignUp(size + sizeof(MemHeader), blockSize) >> blockBits;
+		const uintptr_t rawMem = (uintptr_t)BlockAllocator::allocAtLeast(&nBlocks);
 
-		return (void*)(header + 1);
+		if(rawMem == 0) {
+			return 0;
+		}
+
+		*actualSize = nBlocks * blockSize - sizeof(MemHeader);
+		return writeHeader(rawMem, nBlocks);
+	}
+
+	// allocate between 'minSize' and 'maxSize' bytes, as much as one free run
+	// of the block allocator holds, '*actualSize' is set to the usable size
+	void* allocRange(uintptr_t minSize, uintptr_t maxSize, uintptr_t *actualSize)
+	{
+		kassert(minSize != 0);
+		kassert(minSize <= maxSize);
+
+		// the block allocator takes no more than this, it keeps the sums
+		// with the header from wrapping around
+		const uintptr_t sizeLimit = ~((uintptr_t)0) >> 2;
+		if(minSize > sizeLimit) {
+			return 0;
+		}
+		if(maxSize > sizeLimit) {
+			maxSize = sizeLimit;
+		}
+
+		const uintptr_t blockBits = BlockAllocator::getBlockBits();
+		const uintptr_t blockSize = ((uintptr_t)1) << blockBits;
+		const uintptr_t minBlocks = alignUp(minSize + sizeof(MemHeader), blockSize) >> blockBits;
+		const uintptr_t maxBlocks = alignUp(maxSize + sizeof(MemHeader), blockSize) >> blockBits;
+		uintptr_t nBlocks = 0;
+		const uintptr_t rawMem = (uintptr_t)BlockAllocator::allocRange(minBlocks, maxBlocks, blockSize, &nBlocks);
+
+		if(rawMem == 0) {
+			return 0;
+		}
+
+		*actualSize = nBlocks * blockSize - sizeof(MemHeader);
+		return writeHeader(rawMem, nBlocks);
+	}
+
+	// allocate 'size' bytes as close to 'hint' as the free runs allow
+	void* allocNear(const void *hint, uintptr_t size)
+	{
+		kassert(size != 0);
+
+		const uintptr_t blockBits = BlockAllocator::getBlockBits();
+		const uintptr_t blockSize = ((uintptr_t)1) << blockBits;
+		const uintptr_t nBlocks = alignUp(size + sizeof(MemHeader), blockSize) >> blockBits;
+		const uintptr_t rawMem = (uintptr_t)BlockAllocator::allocNear((uintptr_t)hint, nBlocks);
+
+		if(rawMem == 0) {
+			return 0;
+		}
+		return writeHeader(rawMem, nBlocks);
+	}
+
+	// allocate 'size' bytes whose blocks, including the header, lie in
+	// ['low', 'high')
+	void* allocWithinRange(uintptr_t low, uintptr_t high, uintptr_t size)
+	{
+		kassert(size != 0);
+
+		const uintptr_t blockBits = BlockAllocator::getBlockBits();
+		const uintptr_t blockSize = ((uintptr_t)1) << blockBits;
+		const uintptr_t nBlocks = alignUp(size + sizeof(MemHeader), blockSize) >> blockBits;
+		const uintptr_t rawMem = (uintptr_t)BlockAllocator::allocWithinRange(low, high, nBlocks);
+
+		if(rawMem == 0) {
+			return 0;
+		}
+		return writeHeader(rawMem, nBlocks);
 	}
 
 	void* writeAlignedHeader(uintptr_t alignment, void *rawMem, uintptr_t size)
@@ -96,8 +227,9 @@ class WrapperAllocator
 
 		// write the header
 		MemHeader *header = (MemHeader*)(alignedChunk - sizeof(MemHeader));
+		kassert((chunk & FLAGS) == 0);
 
-		header->start = chunk;
+		header->start = chunk | (TAG << TAG_SHIFT);
 		header->blocks = nBlocks;
 
 		kassert(header->applyCanary());
@@ -130,16 +262,11 @@ class WrapperAllocator
 		return writeAlignedHeader(alignment, (void*)chunk, nBlocks * blockSize);
 	}
 
-	void* realloc(void *ptr, uintptr_t size)
+	// resize the allocation in place, returns false if it has to be moved
+	bool resize(void *ptr, uintptr_t size)
 	{
-		if(ptr == 0) {
-			return this->alloc(size);
-		}
-
-		if(size == 0) {
-			this->free(ptr);
-			return 0;
-		}
+		kassert(ptr != nullptr);
+		kassert(size != 0);
 
 		MemHeader *header = ((MemHeader*)ptr) - 1;
 		kassert(header->checkCanary());
@@ -147,8 +274,10 @@ class WrapperAllocator
 		const uintptr_t blockBits = BlockAllocator::getBlockBits();
 		const uintptr_t blockSize = ((uintptr_t)1) << blockBits;
 
+		const uintptr_t start = getStart(header);
+
 		// end of this memory chunk
-		const uintptr_t end = header->start + header->blocks * blockSize;
+		const uintptr_t end = start + header->blocks * blockSize;
 
 		// the old available size
 		const uintptr_t oldSize = end - ((uintptr_t)ptr);
@@ -157,24 +286,28 @@ class WrapperAllocator
 			// new size is larger than the available space
 			// grow the region in place, if possible
 			const uintptr_t additionalBytes = size - oldSize;
-			const uintptr_t additionalBlocks = alignUp(additionalBytes, blockSize) >> blockBits;
-			if(BlockAllocator::grow((void*)(header->start), header->blocks, header->blocks + additionalBlocks)) {
-				// success, we could grow the region in-place
-				header->blocks += additionalBlocks;
-				kassert(header->applyCanary());
-				return ptr;
+			uintptr_t additionalBlocks = alignUp(additionalBytes, blockSize) >> blockBits;
+
+			// an allocation that grew before will probably grow again, try
+			// to take half of its size more than needed first
+			if((header->start & GROWN) != 0 && additionalBlocks < (header->blocks >> 1)) {
+				const uintptr_t slackBlocks = header->blocks >> 1;
+				if(BlockAllocator::grow((void*)start, header->blocks, header->blocks + slackBlocks)) {
+					additionalBlocks = slackBlocks;
+				}
+				else if(!BlockAllocator::grow((void*)start, header->blocks, header->blocks + additionalBlocks)) {
+					return false;
+				}
 			}
-
-			// else alloc, copy, free
-			// this is the worst case
-			void *mem = this->alloc(size);
-			if(mem == 0) {
-				return 0;
+			else if(!BlockAllocator::grow((void*)start, header->blocks, header->blocks + additionalBlocks)) {
+				return false;
 			}
-			memcpy(mem, ptr, oldSize);
-			this->free(ptr);
 
-			return mem;
+			// success, we could grow the region in-place
+			header->start |= GROWN;
+			header->blocks += additionalBlocks;
+			kassert(header->applyCanary());
+			return true;
 		}
 		// if(size <= oldSize)
 		// new size is smaller, check if we can give some memory back to
@@ -189,7 +322,79 @@ class WrapperAllocator
 			header->blocks -= unneededBlocks;
 			kassert(header->applyCanary());
 		}
-		return ptr;
+		return true;
+	}
+
+	void* realloc(void *ptr, uintptr_t size)
+	{
+		if(ptr == 0) {
+			return this->alloc(size);
+		}
+
+		if(size == 0) {
+			this->free(ptr);
+			return 0;
+		}
+
+		if(resize(ptr, size)) {
+			return ptr;
+		}
+
+		// else alloc, copy, free
+		// this is the worst case
+		const uintptr_t oldSize = getUserSize(ptr);
+		void *mem = 0;
+		if(isGrown(ptr)) {
+			mem = this->alloc(withSlack(size));
+		}
+		if(mem == 0) {
+			mem = this->alloc(size);
+		}
+		if(mem == 0) {
+			return 0;
+		}
+		memops_copy(mem, ptr, oldSize < size ? oldSize : size);
+		if(size > oldSize) {
+			markGrown(mem);
+		}
+		this->free(ptr);
+
+		return mem;
+	}
+
+	// reserve the lowest free blocks below the allocation for moveTo(),
+	// returns 0 if there are none
+	uintptr_t reserveBelow(void *ptr)
+	{
+		kassert(ptr != nullptr);
+
+		MemHeader *header = ((MemHeader*)ptr) - 1;
+		kassert(header->checkCanary());
+		return (uintptr_t)BlockAllocator::allocBelow(header->blocks, getStart(header));
+	}
+
+	// copy the allocation to the blocks from reserveBelow() and return the
+	// new address, the old blocks are not freed. The offset of the user
+	// memory in its blocks is kept, so alignments above the block size may
+	// be lost. Needs no lock as long as nobody writes to the allocation.
+	void* moveTo(void *ptr, uintptr_t newStart)
+	{
+		kassert(ptr != nullptr && newStart != 0);
+
+		MemHeader *header = ((MemHeader*)ptr) - 1;
+		kassert(header->checkCanary());
+
+		const uintptr_t blockBits = BlockAllocator::getBlockBits();
+		const uintptr_t start = getStart(header);
+
+		// copy the header and everything behind it
+		const uintptr_t offset = ((uintptr_t)header) - start;
+		MemHeader *newHeader = (MemHeader*)(newStart + offset);
+		memops_copy(newHeader, header, (header->blocks << blockBits) - offset);
+
+		newHeader->start = newStart | (header->start & FLAGS);
+		kassert(newHeader->applyCanary());
+		return (void*)(newHeader + 1);
 	}
 
 	void free(void *ptr)
@@ -198,7 +403,86 @@ class WrapperAllocator
 
 		MemHeader *header = ((MemHeader*)ptr) - 1;
 		kassert(header->checkCanary());
-		BlockAllocator::free((void*)(header->start), header->blocks);
+		BlockAllocator::free((void*)getStart(header), header->blocks);
+	}
+
+	// free without taking a lock, returns false if the block allocator does
+	// not take the chunk that way, it has to be freed with free() then
+	bool freeLockFree(void *ptr)
+	{
+		kassert(ptr != nullptr);
+
+		MemHeader *header = ((MemHeader*)ptr) - 1;
+		kassert(header->checkCanary());
+		return BlockAllocator::pushFree((void*)getStart(header), header->blocks);
+	}
+
+	// allocate without taking a lock from the chunks freed by freeLockFree(),
+	// returns 0 if there is no such chunk of the right size
+	void* allocLockFree(uintptr_t alignment, uintptr_t size)
+	{
+		kassert(size != 0);
+
+		if(alignment > sizeof(MemHeader)) {
+			return 0;
+		}
+
+		const uintptr_t blockBits = BlockAllocator::getBlockBits();
+		const uintptr_t blockSize = ((uintptr_t)1) << blockBits;
+		const uintptr_t nBlocks = alignUp(size + sizeof(MemHeader), blockSize) >> blockBits;
+		const uintptr_t rawMem = (uintptr_t)BlockAllocator::popFree(nBlocks);
+
+		if(rawMem == 0) {
+			return 0;
+		}
+		return writeHeader(rawMem, nBlocks);
+	}
+
+	// free without deferred coalescing
+	void freeMerged(void *ptr)
+	{
+		kassert(ptr != nullptr);
+
+		MemHeader *header = ((MemHeader*)ptr) - 1;
+		kassert(header->checkCanary());
+		BlockAllocator::freeMerged((void*)getStart(header), header->blocks);
+	}
+
+	// allocations that grew before get slack when they are moved to grow
+	// again, callers that do their own alloc-copy-free use these
+	bool isGrown(void *ptr)
+	{
+		kassert(ptr != nullptr);
+
+		MemHeader *header = ((MemHeader*)ptr) - 1;
+		kassert(header->checkCanary());
+		return (header->start & GROWN) != 0;
+	}
+
+	void markGrown(void *ptr)
+	{
+		kassert(ptr != nullptr);
+
+		MemHeader *header = ((MemHeader*)ptr) - 1;
+		kassert(header->checkCanary());
+		header->start |= GROWN;
+		kassert(header->applyCanary());
+	}
+
+	uintptr_t getGrowSize(void *ptr, uintptr_t size)
+	{
+		return isGrown(ptr) ? withSlack(size) : size;
+	}
+
+	// the TAG of the wrapper that made this allocation, the header layout
+	// is the same for all wrappers with the same ALIGNMENT
+	static uintptr_t getTag(void *ptr)
+	{
+		kassert(ptr != nullptr);
+
+		MemHeader *header = ((MemHeader*)ptr) - 1;
+		kassert(header->checkCanary());
+		return (header->start & TAG_MASK) >> TAG_SHIFT;
 	}
 
 	uintptr_t getUserSize(void *ptr)
@@ -209,7 +493,7 @@ class WrapperAllocator
 		kassert(header->checkCanary());
 
 		uintptr_t userStart = (uintptr_t)ptr;
-		uintptr_t blockStart = header->start;
+		uintptr_t blockStart = getStart(header);
 		uintptr_t overheadBytes = userStart - blockStart;
 
 		uintptr_t totalSize = header->blocks << BlockAllocator::getBlockBits();
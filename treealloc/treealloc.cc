@@ -6,27 +6,51 @@
 //#define MORE_DEBUG
 
 #include <unistd.h>
-#include <linux/futex.h>
-#include <sys/syscall.h>
 #include <stddef.h>
 #include <inttypes.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <stdio.h>
 #include <stdarg.h>
-
-#ifdef MEASURE_TIME
-#	include <time.h>
-#endif
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <new>
 
 #include "TreeBlockAllocator.h"
 #include "WrapperAllocator.h"
+#include "FutexLock.h"
+#include "MappedHeap.h"
+#include "ExternalFreeBlock.h"
+#include "treealloc.h"
+#include "memops.h"
 
 extern "C" {
 	void* malloc(size_t size);
 	void* memalign(size_t alignment, size_t size);
 	void* realloc(void *ptr, size_t size);
 	void  free(void *ptr);
+	int   mallopt(int param, int value);
+	size_t malloc_usable_size(void *ptr);
+	int   malloc_trim(size_t pad);
+	struct treealloc_mallinfo mallinfo2(void);
+	int   malloc_info(int options, FILE *fp);
+	void* mallocx(size_t size, int flags);
+	void* rallocx(void *ptr, size_t size, int flags);
+	size_t xallocx(void *ptr, size_t size, size_t extra, int flags);
+	size_t sallocx(const void *ptr, int flags);
+	void  dallocx(void *ptr, int flags);
+	size_t nallocx(size_t size, int flags);
+	struct treealloc_sized_ptr treealloc_alloc_at_least(size_t size);
+	void* malloc_hint(size_t size, int lifetime);
+	struct treealloc_sized_ptr treealloc_alloc_range(size_t minSize, size_t maxSize);
+	void* treealloc_alloc_near(const void *hint, size_t size);
+	void* treealloc_alloc_within(const void *low, const void *high, size_t size);
 }
 
 #define PAGE_SIZE (4096)
@@ -39,59 +63,39 @@ extern "C" {
 static const uintptr_t USER_BLOCK_SIZE = ((uintptr_t)1) << ARCH_BLOCK_BITS;
 static const uintptr_t MIN_BLOCK_ALLOC = 1024*1024*2;
 
-class FutexLock
-{
-	private:
-	int32_t lockvar __attribute__((aligned(sizeof(int32_t))));
+// larger requests never fit into the address space, rejecting them keeps
+// the sums of sizes, headers and alignments from overflowing
+static const uintptr_t MAX_REQUEST = ~((uintptr_t)0) >> 1;
 
-	//// atomic wrapper functions
-	template<typename T>
-	static void store(T *mem, T val)
-	{
-		__atomic_store_n(mem, val, __ATOMIC_SEQ_CST);
-	}
+// freed chunks are kept unmerged for direct reuse until the deferred lists
+// hold this many bytes
+static const uintptr_t DEFERRED_BYTES = 1024*256;
 
-	template<typename T>
-	static bool cas(T *mem, T expected, T newval)
-	{
-		return __atomic_compare_exchange_n(mem, &expected, newval, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
-	}
+// tunables, the defaults can be changed with environment variables that are
+// read before the first allocation, and later with mallopt()
 
-	template<typename T>
-	static T swap(T *mem, T val)
-	{
-		return __atomic_exchange_n(mem, val, __ATOMIC_SEQ_CST);
-	}
-	////
+// the block allocator is refilled with 'refillBytes' first, every refill
+// doubles the size of the next one up to 'refillMax'
+static uintptr_t refillBytes = MIN_BLOCK_ALLOC;
+static uintptr_t refillMax = MIN_BLOCK_ALLOC;
+static uintptr_t refillNext = MIN_BLOCK_ALLOC;
 
-	void futex(int op, int val)
-	{
-		syscall(SYS_futex, &lockvar, op, val, NULL, NULL, 0);
-	}
+// requests of at least this many bytes get their own mapping
+static uintptr_t mmapThreshold = MIN_BLOCK_ALLOC;
 
-	public:
-	void init()
-	{
-		store(&lockvar, 0);
-	}
+// free runs of at least this many bytes are unmapped, smaller ones are
+// purged under memory pressure
+static uintptr_t trimThreshold = MIN_BLOCK_ALLOC;
 
-	void lock()
-	{
-		if(!cas(&lockvar, 0, 1)) {
-			while(swap(&lockvar, 2) != 0) {
-				futex(FUTEX_WAIT_PRIVATE, 2);
-			}
-		}
-	}
+static uintptr_t deferredBytes = DEFERRED_BYTES;
 
-	void unlock()
-	{
-		const uint32_t oldval = swap(&lockvar, 0);
-		if(oldval == 2) {
-			futex(FUTEX_WAKE_PRIVATE, 1);
-		}
-	}
-};
+// bytes mapped with MAP_POPULATE up front, free memory is not unmapped
+// while less than this would stay mapped
+static uintptr_t retainBytes = 0;
+
+#ifndef MAP_FIXED_NOREPLACE
+#	define MAP_FIXED_NOREPLACE 0x100000
+#endif
 
 #ifdef MEASURE_TIME
 static uint64_t getNanos()
@@ -102,281 +106,2645 @@ static uint64_t getNanos()
 }
 #endif
 
-static void* mem_map(uintptr_t size)
+// number of bytes currently mapped for heap memory and the most that was
+// ever mapped at once
+static uintptr_t mappedBytes = 0;
+static uintptr_t maxMappedBytes = 0;
+
+// 'addr' is only a hint, unless MAP_FIXED_NOREPLACE is given. Kernels that
+// do not know that flag take it as a hint too, so the mapping is only kept
+// if it is at 'addr' then.
+static void* mem_map(uintptr_t size, int flags = 0, void *addr = NULL)
 {
-	void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	void *mem = mmap(addr, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
 	if(mem == MAP_FAILED) {
 		return 0;
 	}
+	if((flags & MAP_FIXED_NOREPLACE) != 0 && mem != addr) {
+		munmap(mem, size);
+		return 0;
+	}
 
+	const uintptr_t mapped = __atomic_add_fetch(&mappedBytes, size, __ATOMIC_RELAXED);
+	uintptr_t max = __atomic_load_n(&maxMappedBytes, __ATOMIC_RELAXED);
+	while(mapped > max && !__atomic_compare_exchange_n(&maxMappedBytes, &max, mapped, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		// another thread raised it meanwhile
+	}
 	return mem;
 }
 
 static void mem_unmap(void *mem, uintptr_t size)
 {
 	int err = munmap(mem, size);
-	(void)err;
-	//if(err != 0) {
-	//}
+	if(err == 0) {
+		__atomic_sub_fetch(&mappedBytes, size, __ATOMIC_RELAXED);
+	}
 }
 
-static os::res::TreeBlockAllocatorNoLock<ARCH_BLOCK_BITS> blockAllocator;
+// requests are routed by size to block allocators with different block
+// sizes, each with its own mapped regions, so large objects do not
+// fragment the space of the small ones. An engine gets requests whose
+// size is at least 8 of its blocks, this keeps the waste below 1/8.
+static const uintptr_t MEDIUM_BLOCK_BITS = 12;
+static const uintptr_t LARGE_BLOCK_BITS = 16;
+static const uintptr_t MEDIUM_MIN_SIZE = ((uintptr_t)8) << MEDIUM_BLOCK_BITS;
+static const uintptr_t LARGE_MIN_SIZE = ((uintptr_t)8) << LARGE_BLOCK_BITS;
+
+// tags of the engines in the allocation headers. The lifetime engines take
+// the small requests of malloc_hint(), each with its own regions, so
+// objects that live long do not pin the regions of short-lived ones.
+enum Engine
+{
+	SMALL_ENGINE = 0,
+	MEDIUM_ENGINE = 1,
+	LARGE_ENGINE = 2,
+	SHORT_ENGINE = 3,
+	LONG_ENGINE = 4,
+	PERMANENT_ENGINE = 5
+};
+
+static const uintptr_t ENGINES = 6;
+
+typedef os::res::TreeBlockAllocatorNoLock<ARCH_BLOCK_BITS> SmallBlockAllocator;
+typedef os::res::TreeBlockAllocatorNoLock<MEDIUM_BLOCK_BITS> MediumBlockAllocator;
+typedef os::res::TreeBlockAllocatorNoLock<LARGE_BLOCK_BITS> LargeBlockAllocator;
+
+static SmallBlockAllocator blockAllocator;
+static MediumBlockAllocator mediumBlockAllocator;
+static LargeBlockAllocator largeBlockAllocator;
+static SmallBlockAllocator shortBlockAllocator;
+static SmallBlockAllocator longBlockAllocator;
+static SmallBlockAllocator permanentBlockAllocator;
 //static os::res::ListBlockAllocator<NoLocker, USER_BLOCK_SIZE> blockAllocator;
 
+template<typename BlockAllocator, BlockAllocator *blockAllocator>
 class UserSpaceWrapper
 {
 	public:
 	static void* alloc(uintptr_t n)
 	{
-		return blockAllocator.alloc(n);
+		return blockAllocator->alloc(n);
 	}
 	static void free(void *ptr, uintptr_t n)
 	{
-		blockAllocator.free(ptr, n);
+		blockAllocator->free(ptr, n);
+	}
+	static void freeMerged(void *ptr, uintptr_t n)
+	{
+		blockAllocator->free(ptr, n, false);
+	}
+	static bool pushFree(void *ptr, uintptr_t n)
+	{
+		return blockAllocator->pushFree(ptr, n);
+	}
+	static void* popFree(uintptr_t n)
+	{
+		return blockAllocator->popFree(n);
 	}
 	static bool grow(void *ptr, uintptr_t a, uintptr_t b)
 	{
-		return blockAllocator.grow(ptr, a, b);
+		return blockAllocator->grow(ptr, a, b);
+	}
+	static void* allocBelow(uintptr_t n, uintptr_t limit)
+	{
+		return blockAllocator->allocBelow(n, limit);
+	}
+	static void* allocAtLeast(uintptr_t *n)
+	{
+		return blockAllocator->allocAtLeast(n);
+	}
+	static void* allocRange(uintptr_t min, uintptr_t max, uintptr_t align, uintptr_t *n)
+	{
+		return blockAllocator->allocRange(min, max, align, n);
+	}
+	static void* allocNear(uintptr_t hint, uintptr_t n)
+	{
+		return blockAllocator->allocNear(hint, n);
+	}
+	static void* allocWithinRange(uintptr_t low, uintptr_t high, uintptr_t n)
+	{
+		return blockAllocator->allocWithinRange(low, high, n);
 	}
 	static uintptr_t getBlockBits()
 	{
-		return blockAllocator.getBlockBits();
+		return blockAllocator->getBlockBits();
 	}
 };
 
-static os::res::WrapperAllocator<UserSpaceWrapper> fineAllocator;
-static FutexLock lock;
+static const uintptr_t USER_ALIGNMENT = 2 * sizeof(uintptr_t);
+
+static os::res::WrapperAllocator<UserSpaceWrapper<SmallBlockAllocator, &blockAllocator>,
+	USER_ALIGNMENT, SMALL_ENGINE> fineAllocator;
+static os::res::WrapperAllocator<UserSpaceWrapper<MediumBlockAllocator, &mediumBlockAllocator>,
+	USER_ALIGNMENT, MEDIUM_ENGINE> mediumAllocator;
+static os::res::WrapperAllocator<UserSpaceWrapper<LargeBlockAllocator, &largeBlockAllocator>,
+	USER_ALIGNMENT, LARGE_ENGINE> largeAllocator;
+static os::res::WrapperAllocator<UserSpaceWrapper<SmallBlockAllocator, &shortBlockAllocator>,
+	USER_ALIGNMENT, SHORT_ENGINE> shortAllocator;
+static os::res::WrapperAllocator<UserSpaceWrapper<SmallBlockAllocator, &longBlockAllocator>,
+	USER_ALIGNMENT, LONG_ENGINE> longAllocator;
+static os::res::WrapperAllocator<UserSpaceWrapper<SmallBlockAllocator, &permanentBlockAllocator>,
+	USER_ALIGNMENT, PERMANENT_ENGINE> permanentAllocator;
+static os::res::FutexLock lock;
+static bool initialized = false;
+
+// heap budget in bytes, 0 means no limit. Above the soft limit free memory
+// is purged before new memory is mapped, above the budget the pressure
+// callbacks are called before an allocation fails.
+static uintptr_t heapBudget = 0;
+static uintptr_t readCgroupLimit();
 
-class PrintIter
+static uintptr_t alignUp(uintptr_t numToRound, uintptr_t multiple)
 {
-	public:
-	uintptr_t blockBits;
-	uintptr_t numFreeBlocks;
+	uintptr_t mask = multiple - 1;
+    return (numToRound + mask) & ~mask;
+}
 
-	void init(uintptr_t bits)
-	{
-		blockBits = bits;
-		numFreeBlocks = 0;
+// read a size in bytes with an optional k, m or g suffix from the
+// environment, getenv() does not allocate memory
+static bool readTunable(const char *name, uintptr_t *out)
+{
+	const char *str = getenv(name);
+	if(str == 0 || *str < '0' || *str > '9') {
+		return false;
 	}
 
-	bool operator()(void *s, uintptr_t blocks)
-	{
-		const uintptr_t start = (uintptr_t)s;
-		const uintptr_t size = blocks << blockBits;
-		const uintptr_t end = start + size;
-
-		numFreeBlocks += 1;
-		fprintf(stderr, "\t[0x%" PRIxPTR " - 0x%" PRIxPTR "] %" PRIuPTR "\n", start, end, size);
+	// values above MAX_REQUEST are ignored, so the page rounding of the
+	// callers cannot wrap around
+	uintptr_t value = 0;
+	for(; *str >= '0' && *str <= '9'; ++str) {
+		value = value * 10 + (uintptr_t)(*str - '0');
+		if(value > MAX_REQUEST) {
+			return false;
+		}
+	}
 
-		return true;
+	uintptr_t shift = 0;
+	switch(*str) {
+		case 'g': case 'G': shift += 10; // fall through
+		case 'm': case 'M': shift += 10; // fall through
+		case 'k': case 'K': shift += 10; break;
+		default: break;
 	}
-};
+	if(value > (MAX_REQUEST >> shift)) {
+		return false;
+	}
+	value <<= shift;
 
-static uintptr_t alignUp(uintptr_t numToRound, uintptr_t multiple)
+	*out = value;
+	return true;
+}
+
+// called with the lock held
+static void setRefill(uintptr_t bytes, uintptr_t max)
 {
-	uintptr_t mask = multiple - 1;
-    return (numToRound + mask) & ~mask;
+	refillBytes = alignUp(bytes < PAGE_SIZE ? PAGE_SIZE : bytes, PAGE_SIZE);
+	__atomic_store_n(&refillMax, alignUp(max < refillBytes ? refillBytes : max, PAGE_SIZE), __ATOMIC_RELAXED);
+	__atomic_store_n(&refillNext, refillBytes, __ATOMIC_RELAXED);
 }
 
-void *malloc(size_t size)
+static bool maintenanceActive = false;
+
+// called with the lock held
+static void setDeferredLimits(uintptr_t bytes)
 {
-	if(size == 0) {
-		return NULL;
-	}
+	blockAllocator.setDeferredLimit(bytes >> blockAllocator.getBlockBits());
+	mediumBlockAllocator.setDeferredLimit(bytes >> mediumBlockAllocator.getBlockBits());
+	largeBlockAllocator.setDeferredLimit(bytes >> largeBlockAllocator.getBlockBits());
+	shortBlockAllocator.setDeferredLimit(bytes >> shortBlockAllocator.getBlockBits());
+	longBlockAllocator.setDeferredLimit(bytes >> longBlockAllocator.getBlockBits());
+	// permanent objects are not freed, nothing to reuse
+}
 
-	lock.lock();
+// called with the lock held
+static void flushDeferred()
+{
+	blockAllocator.flushDeferred();
+	mediumBlockAllocator.flushDeferred();
+	largeBlockAllocator.flushDeferred();
+	shortBlockAllocator.flushDeferred();
+	longBlockAllocator.flushDeferred();
+	permanentBlockAllocator.flushDeferred();
+}
 
-	#ifdef MORE_DEBUG
-	fprintf(stderr, "malloc(%" PRIuPTR ") -> ", (uintptr_t)size);
-	#endif
+// wait for the lock-free pops, before unmapping memory that was free
+static void waitForPops()
+{
+	blockAllocator.waitForPops();
+	mediumBlockAllocator.waitForPops();
+	largeBlockAllocator.waitForPops();
+	shortBlockAllocator.waitForPops();
+	longBlockAllocator.waitForPops();
+	permanentBlockAllocator.waitForPops();
+}
 
-	#ifdef MEASURE_TIME
-	uint64_t time = getNanos();
-	#endif
+// called with the lock held
+static void setDeferred(uintptr_t bytes)
+{
+	deferredBytes = bytes;
+	if(!maintenanceActive) {
+		setDeferredLimits(deferredBytes);
+	}
+}
 
-	void *out = fineAllocator.alloc(size);
-	if(out == 0) {
-		uintptr_t overhead = fineAllocator.overhead();
-		uintptr_t alignSize = alignUp(size + overhead, PAGE_SIZE);
-		if(alignSize < MIN_BLOCK_ALLOC) {
-			void *pages = mem_map(MIN_BLOCK_ALLOC);
-			if(pages != 0) {
-				blockAllocator.free(pages, MIN_BLOCK_ALLOC >> blockAllocator.getBlockBits());
-			}
-			out = fineAllocator.alloc(size);
-		}
-		else {
-			void *pages = mem_map(alignSize);
-			if(pages != 0) {
-				out = fineAllocator.writeAlignedHeader(1, pages, alignSize);
-			}
+// hand 'bytes' prefaulted bytes at 'pages' to the small engine and keep
+// them, called with the lock held. The pages are mapped before taking it.
+static void addReserve(void *pages, uintptr_t bytes)
+{
+	retainBytes += bytes;
+	blockAllocator.free(pages, bytes >> blockAllocator.getBlockBits());
+}
+
+// set when initAllocator() started, the first caller does the work
+static bool initializing = false;
+
+// called without the lock, before the first allocation. The environment and
+// the cgroup files are read and the reservation is mapped and prefaulted
+// without holding it, only the results are published with it held. Other
+// threads wait until that is done.
+static void initAllocator()
+{
+	if(__atomic_load_n(&initialized, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	if(__atomic_exchange_n(&initializing, true, __ATOMIC_ACQUIRE)) {
+		while(!__atomic_load_n(&initialized, __ATOMIC_ACQUIRE)) {
+			sched_yield();
 		}
+		return;
 	}
 
-	#ifdef MORE_DEBUG
-	fprintf(stderr, "0x%" PRIxPTR "\n", (uintptr_t)out);
-	#endif
+	const uintptr_t budget = readCgroupLimit();
 
-	#ifdef MEASURE_TIME
-	time = getNanos() - time;
-	fprintf(stderr, "malloc %" PRIu64 "\n", time);
-	#endif
+	uintptr_t refill = refillBytes;
+	uintptr_t max = 0;
+	readTunable("TREEALLOC_REFILL", &refill);
+	readTunable("TREEALLOC_REFILL_MAX", &max);
 
-	lock.unlock();
+	uintptr_t mmapValue;
+	uintptr_t trimValue;
+	uintptr_t deferredValue;
+	const bool hasMmap = readTunable("TREEALLOC_MMAP_THRESHOLD", &mmapValue);
+	const bool hasTrim = readTunable("TREEALLOC_TRIM_THRESHOLD", &trimValue);
+	if(!readTunable("TREEALLOC_DEFERRED", &deferredValue)) {
+		deferredValue = deferredBytes;
+	}
 
-	return out;
+	uintptr_t reserveBytes = 0;
+	void *reservePages = 0;
+	if(readTunable("TREEALLOC_RESERVE", &reserveBytes) && reserveBytes != 0) {
+		reserveBytes = alignUp(reserveBytes, PAGE_SIZE);
+		reservePages = mem_map(reserveBytes, MAP_POPULATE);
+	}
+
+	lock.lock();
+	heapBudget = budget;
+	setRefill(refill, max);
+	if(hasMmap) {
+		mmapThreshold = alignUp(mmapValue, PAGE_SIZE);
+	}
+	if(hasTrim) {
+		trimThreshold = alignUp(trimValue < PAGE_SIZE ? PAGE_SIZE : trimValue, PAGE_SIZE);
+	}
+	setDeferred(deferredValue);
+	if(reservePages != 0) {
+		addReserve(reservePages, reserveBytes);
+	}
+	__atomic_store_n(&initialized, true, __ATOMIC_RELEASE);
+	lock.unlock();
 }
 
-void* memalign(size_t alignment, size_t size)
+// the least free bytes of each engine since its deferred chunks were merged
+// the last time, see ReclaimBatch::mergeDeferred()
+static uintptr_t lowFreeBytes[ENGINES];
+
+// free runs of at least trimThreshold bytes that were taken out of the
+// block allocator with the lock held and are unmapped after releasing it
+class ReclaimBatch
 {
-	if(size == 0) {
-		return NULL;
+	public:
+	static const uintptr_t MAX_CHUNKS = 16;
+
+	private:
+	void *chunks[MAX_CHUNKS];
+	uintptr_t sizes[MAX_CHUNKS];
+	uintptr_t count;
+	uintptr_t bytes;
+
+	public:
+	void init()
+	{
+		count = 0;
+		bytes = 0;
 	}
 
-	if(!((alignment != 0) && !(alignment & (alignment - 1)))) {
-		return NULL;
+	template<typename BlockAllocator>
+	static uintptr_t freeBytesOf(BlockAllocator &engine)
+	{
+		return engine.getFreeCount() << engine.getBlockBits();
 	}
 
-	lock.lock();
+	// each deferred chunk may keep a region from being unmapped that is free
+	// otherwise. They are merged once the free memory of the engine grew by
+	// trimThreshold, so this happens at most once per that many bytes freed.
+	// The last chunks freed before the heap is empty may not add up to that,
+	// so they are also merged once nothing is in use any more.
+	template<typename BlockAllocator>
+	static void mergeDeferred(BlockAllocator &engine, uintptr_t *lowFree, uintptr_t inUse)
+	{
+		const uintptr_t freeBytes = freeBytesOf(engine);
+		if(freeBytes < *lowFree) {
+			*lowFree = freeBytes;
+		}
+		else if(freeBytes - *lowFree >= trimThreshold || (inUse == 0 && engine.getDeferredCount() != 0)) {
+			engine.flushDeferred();
+			*lowFree = freeBytes;
+		}
+	}
 
-	#ifdef MORE_DEBUG
-	fprintf(stderr, "memalign(%" PRIuPTR ", %" PRIuPTR ")\n", (uintptr_t)alignment, (uintptr_t)size);
-	#endif
+	template<typename BlockAllocator>
+	void collectFrom(BlockAllocator &engine, uintptr_t *lowFree, uintptr_t inUse, uintptr_t budget)
+	{
+		const uintptr_t blockBits = engine.getBlockBits();
+		const uintptr_t blockSize = ((uintptr_t)1) << blockBits;
+		const uintptr_t align = blockSize < PAGE_SIZE ? PAGE_SIZE : blockSize;
 
-	#ifdef MEASURE_TIME
-	uint64_t time = getNanos();
-	#endif
+		mergeDeferred(engine, lowFree, inUse);
 
-	void *out = fineAllocator.allocAligned(alignment, size);
-	if(out == 0) {
-		uintptr_t overhead = fineAllocator.overhead();
-		uintptr_t alignSize = alignUp(size + overhead + (alignment - 1), PAGE_SIZE);
-		if(alignSize < MIN_BLOCK_ALLOC) {
-			void *pages = mem_map(MIN_BLOCK_ALLOC);
-			if(pages != 0) {
-				blockAllocator.free(pages, MIN_BLOCK_ALLOC >> blockAllocator.getBlockBits());
+		while(count < MAX_CHUNKS && (budget == 0 || bytes < budget)) {
+			// keep the reservation
+			const uintptr_t mapped = __atomic_load_n(&mappedBytes, __ATOMIC_RELAXED) - bytes;
+			if(mapped < retainBytes + trimThreshold) {
+				return;
 			}
-			out = fineAllocator.allocAligned(alignment, size);
-		}
-		else {
-			void *pages = mem_map(alignSize);
-			if(pages != 0) {
-				out = fineAllocator.writeAlignedHeader(alignment, pages, alignSize);
+
+			uintptr_t blocks = alignUp(trimThreshold, align) >> blockBits;
+			void *reclaim = engine.allocLargest(align, &blocks);
+			if(reclaim == 0) {
+				return;
 			}
+
+			chunks[count] = reclaim;
+			sizes[count] = blocks << blockBits;
+			bytes += sizes[count];
+			count += 1;
 		}
 	}
 
-	#ifdef MEASURE_TIME
-	time = getNanos() - time;
-	fprintf(stderr, "memalign %" PRIu64 "\n", time);
-	#endif
+	// called with the lock held, stops after 'budget' bytes if it is not 0,
+	// returns true if the batch is full and there may be more to reclaim
+	bool collect(uintptr_t budget)
+	{
+		// the bytes in the chunks and the own mappings of the allocations
+		const uintptr_t freeBytes = freeBytesOf(largeBlockAllocator) + freeBytesOf(mediumBlockAllocator)
+			+ freeBytesOf(blockAllocator) + freeBytesOf(shortBlockAllocator) + freeBytesOf(longBlockAllocator)
+			+ freeBytesOf(permanentBlockAllocator);
+		const uintptr_t mapped = __atomic_load_n(&mappedBytes, __ATOMIC_RELAXED);
+		const uintptr_t inUse = mapped > freeBytes ? mapped - freeBytes : 0;
+
+		collectFrom(largeBlockAllocator, &lowFreeBytes[LARGE_ENGINE], inUse, budget);
+		collectFrom(mediumBlockAllocator, &lowFreeBytes[MEDIUM_ENGINE], inUse, budget);
+		collectFrom(blockAllocator, &lowFreeBytes[SMALL_ENGINE], inUse, budget);
+		collectFrom(shortBlockAllocator, &lowFreeBytes[SHORT_ENGINE], inUse, budget);
+		collectFrom(longBlockAllocator, &lowFreeBytes[LONG_ENGINE], inUse, budget);
+		collectFrom(permanentBlockAllocator, &lowFreeBytes[PERMANENT_ENGINE], inUse, budget);
+		return count == MAX_CHUNKS;
+	}
 
-	lock.unlock();
+	uintptr_t getBytes() const
+	{
+		return bytes;
+	}
 
-	return out;
+	void unmap()
+	{
+		if(count != 0) {
+			waitForPops();
+		}
+		for(uintptr_t i = 0; i < count; ++i) {
+			mem_unmap(chunks[i], sizes[i]);
+		}
+		count = 0;
+	}
+};
+
+// unmap free runs until 'budget' bytes are done, 0 means no limit
+static void reclaim(uintptr_t budget)
+{
+	ReclaimBatch batch;
+	uintptr_t done = 0;
+	bool more = true;
+
+	while(more && (budget == 0 || done < budget)) {
+		batch.init();
+
+		lock.lock();
+		more = batch.collect(budget == 0 ? 0 : budget - done);
+		lock.unlock();
+
+		batch.unmap();
+		done += batch.getBytes();
+	}
 }
 
-void free(void *mem)
+// the optional maintenance thread takes over merging deferred chunks and
+// unmapping free memory, so free() does not do it with the lock held
+static int32_t maintenanceRunning = 0;
+static uint64_t maintenanceInterval;
+static uintptr_t maintenanceBudget;
+static pthread_t maintenanceThread;
+
+// pieces of new mappings that the maintenance thread unmaps, so allocating
+// threads do not, see mem_map_aligned(). They are linked through their first
+// page.
+struct PendingUnmap
 {
-	if(mem == NULL) {
-		return;
+	PendingUnmap *next;
+	uintptr_t size;
+};
+
+static PendingUnmap *pendingUnmaps = 0;
+
+// unmap now, or later in the maintenance thread if it runs
+static void unmapLater(void *mem, uintptr_t size)
+{
+	PendingUnmap *pending = (PendingUnmap*)mem;
+
+	lock.lock();
+	const bool queued = maintenanceActive;
+	if(queued) {
+		pending->next = pendingUnmaps;
+		pending->size = size;
+		pendingUnmaps = pending;
+	}
+	lock.unlock();
+
+	if(!queued) {
+		mem_unmap(mem, size);
 	}
+}
 
+// merge the deferred chunks and unmap up to 'budget' bytes, 0 means no limit
+static void maintain(uintptr_t budget)
+{
 	lock.lock();
+	flushDeferred();
+	PendingUnmap *pending = pendingUnmaps;
+	pendingUnmaps = 0;
+	lock.unlock();
 
-	#ifdef MORE_DEBUG
-	PrintIter iter;
-	iter.init(blockAllocator.getBlockBits());
-	fprintf(stderr, "start free 0x%p\n", mem);
-	iter.init(blockAllocator.getBlockBits());
-	blockAllocator.iterate(iter);
-	fprintf(stderr, "\tblocks: %" PRIuPTR "\n\n", iter.numFreeBlocks);
-	#endif
+	while(pending != 0) {
+		PendingUnmap *next = pending->next;
+		mem_unmap(pending, pending->size);
+		pending = next;
+	}
 
-	#ifdef MEASURE_TIME
-	uint64_t time = getNanos();
-	#endif
+	reclaim(budget);
+}
 
-	fineAllocator.free(mem);
-	for(;;) {
-		uintptr_t blocks = MIN_BLOCK_ALLOC >> blockAllocator.getBlockBits();
-		void *reclaim = blockAllocator.allocLargest(PAGE_SIZE, &blocks);
-		if(reclaim == 0) {
+static void* maintenanceMain(void *arg)
+{
+	(void)arg;
+
+	while(__atomic_load_n(&maintenanceRunning, __ATOMIC_SEQ_CST) != 0) {
+		struct timespec timeout;
+		timeout.tv_sec = maintenanceInterval / 1000000000;
+		timeout.tv_nsec = maintenanceInterval % 1000000000;
+
+		// sleep until the interval passed or the thread is stopped
+		syscall(SYS_futex, &maintenanceRunning, FUTEX_WAIT_PRIVATE, 1, &timeout, NULL, 0);
+		if(__atomic_load_n(&maintenanceRunning, __ATOMIC_SEQ_CST) == 0) {
 			break;
 		}
 
-		mem_unmap(reclaim, blocks << blockAllocator.getBlockBits());
+		maintain(maintenanceBudget);
 	}
 
-	#ifdef MEASURE_TIME
-	time = getNanos() - time;
-	fprintf(stderr, "free %" PRIu64 "\n", time);
-	#endif
+	return NULL;
+}
 
-	#ifdef MORE_DEBUG
-	fprintf(stderr, "end free 0x%p\n", mem);
-	iter.init(blockAllocator.getBlockBits());
-	blockAllocator.iterate(iter);
-	fprintf(stderr, "\tblocks: %" PRIuPTR "\n\n", iter.numFreeBlocks);
-	#endif
+int treealloc_maintenance_start(unsigned int intervalMs, size_t budget)
+{
+	if(intervalMs == 0) {
+		return EINVAL;
+	}
+
+	// only one of several racing calls starts the thread
+	int32_t stopped = 0;
+	if(!__atomic_compare_exchange_n(&maintenanceRunning, &stopped, 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		return EBUSY;
+	}
+
+	maintenanceInterval = ((uint64_t)intervalMs) * 1000000;
+	maintenanceBudget = budget;
+
+	int err = pthread_create(&maintenanceThread, NULL, maintenanceMain, NULL);
+	if(err != 0) {
+		__atomic_store_n(&maintenanceRunning, 0, __ATOMIC_SEQ_CST);
+		return err;
+	}
 
+	// deferred chunks are only merged by the maintenance thread or when an
+	// allocation misses
+	initAllocator();
+	lock.lock();
+	maintenanceActive = true;
+	setDeferredLimits(~((uintptr_t)0));
 	lock.unlock();
+
+	return 0;
 }
 
-void* realloc(void *mem, size_t size)
+void treealloc_maintenance_stop(void)
 {
-	if(mem == NULL) {
-		return malloc(size);
+	if(__atomic_exchange_n(&maintenanceRunning, 0, __ATOMIC_SEQ_CST) == 0) {
+		return;
 	}
 
-	if(size == 0) {
-		free(mem);
-		return NULL;
-	}
+	syscall(SYS_futex, &maintenanceRunning, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	pthread_join(maintenanceThread, NULL);
 
 	lock.lock();
+	maintenanceActive = false;
+	setDeferred(deferredBytes);
+	lock.unlock();
 
-	#ifdef MORE_DEBUG
-	PrintIter iter;
-	iter.init(blockAllocator.getBlockBits());
-	fprintf(stderr, "start realloc 0x%p\n", mem);
-	iter.init(blockAllocator.getBlockBits());
-	blockAllocator.iterate(iter);
-	fprintf(stderr, "\tblocks: %" PRIuPTR "\n\n", iter.numFreeBlocks);
-	#endif
+	maintain(0);
+}
 
-	#ifdef MEASURE_TIME
-	uint64_t time = getNanos();
-	#endif
+static const uintptr_t MAX_PRESSURE_CALLBACKS = 8;
 
-	void *out = fineAllocator.realloc(mem, size);
-	if(out == 0) {
-		uintptr_t overhead = fineAllocator.overhead();
-		uintptr_t alignSize = alignUp(size + overhead, PAGE_SIZE);
-		if(alignSize < MIN_BLOCK_ALLOC) {
-			alignSize = MIN_BLOCK_ALLOC;
+struct PressureCallback
+{
+	void (*func)(size_t needed, void *arg);
+	void *arg;
+};
+
+static PressureCallback pressureCallbacks[MAX_PRESSURE_CALLBACKS];
+static uintptr_t numPressureCallbacks = 0;
+static bool pressureActive = false;
+
+// set in the thread that runs the callbacks, initial-exec so the access
+// does not allocate
+static __thread bool inPressureCallback __attribute__((tls_model("initial-exec"))) = false;
+
+static uintptr_t softLimit(uintptr_t limit)
+{
+	return limit - (limit >> 3);
+}
+
+// parse a decimal number or "max", returns 0 for "max" and on errors
+static uintptr_t parseLimit(const char *str)
+{
+	uintptr_t out = 0;
+	for(; *str >= '0' && *str <= '9'; ++str) {
+		out = out * 10 + (uintptr_t)(*str - '0');
+	}
+	return out;
+}
+
+// read a small file into 'buf', this must not allocate memory
+static bool readFile(const char *path, char *buf, uintptr_t size)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0) {
+		return false;
+	}
+
+	ssize_t len = read(fd, buf, size - 1);
+	close(fd);
+	if(len <= 0) {
+		return false;
+	}
+
+	buf[len] = '\0';
+	return true;
+}
+
+// the smallest memory.max of the cgroup v2 of this process and its parents,
+// 0 if there is none
+static uintptr_t readCgroupLimit()
+{
+	char cgroup[512];
+	if(!readFile("/proc/self/cgroup", cgroup, sizeof(cgroup))) {
+		return 0;
+	}
+
+	// cgroup v2 has a single line "0::/path"
+	const char *line = strstr(cgroup, "0::/");
+	if(line == 0 || (line != cgroup && line[-1] != '\n')) {
+		return 0;
+	}
+
+	static const char prefix[] = "/sys/fs/cgroup";
+	static const char suffix[] = "/memory.max";
+	char path[sizeof(prefix) + sizeof(cgroup) + sizeof(suffix)];
+	memcpy(path, prefix, sizeof(prefix) - 1);
+
+	uintptr_t len = sizeof(prefix) - 1;
+	for(const char *c = line + 3; *c != '\0' && *c != '\n'; ++c) {
+		path[len++] = *c;
+	}
+	while(len > sizeof(prefix) - 1 && path[len - 1] == '/') {
+		len -= 1;
+	}
+
+	uintptr_t out = 0;
+	for(;;) {
+		char value[32];
+		memcpy(path + len, suffix, sizeof(suffix));
+		if(readFile(path, value, sizeof(value))) {
+			const uintptr_t limit = parseLimit(value);
+			if(limit != 0 && (out == 0 || limit < out)) {
+				out = limit;
+			}
 		}
-		void *pages = mem_map(alignSize);
-		if(pages != 0) {
-			blockAllocator.free(pages, alignSize >> blockAllocator.getBlockBits());
+
+		// go to the parent, the root cgroup has no memory.max
+		while(len > sizeof(prefix) - 1 && path[len - 1] != '/') {
+			len -= 1;
+		}
+		if(len <= sizeof(prefix)) {
+			break;
 		}
-		out = fineAllocator.realloc(mem, size);
+		len -= 1;
 	}
 
-	#ifdef MEASURE_TIME
-	time = getNanos() - time;
-	fprintf(stderr, "realloc %" PRIu64 "\n", time);
-	#endif
+	return out;
+}
 
-	#ifdef MORE_DEBUG
-	fprintf(stderr, "end realloc 0x%p\n", mem);
-	iter.init(blockAllocator.getBlockBits());
+// give the pages of small free runs back to the system, the runs stay in
+// the block allocator. The first page of a run holds the free block and
+// is kept.
+class PurgeIter
+{
+	public:
+	uintptr_t blockBits;
+
+	// runs of this size or more are left to reclaim()
+	uintptr_t maxSize;
+
+	// free bytes that are left alone, the runs with the lowest addresses
+	uintptr_t keep;
+
+	// bytes given back
+	uintptr_t purged;
+
+	void init(uintptr_t max, uintptr_t keepBytes)
+	{
+		maxSize = max;
+		keep = keepBytes;
+		purged = 0;
+	}
+
+	void setBlockBits(uintptr_t bits)
+	{
+		blockBits = bits;
+	}
+
+	bool operator()(void *s, uintptr_t blocks)
+	{
+		const uintptr_t size = blocks << blockBits;
+		if(size >= maxSize) {
+			return true;
+		}
+		if(keep != 0) {
+			keep = size < keep ? keep - size : 0;
+			return true;
+		}
+
+		const uintptr_t start = alignUp(((uintptr_t)s) + 1, PAGE_SIZE);
+		const uintptr_t end = (((uintptr_t)s) + size) & ~((uintptr_t)PAGE_SIZE - 1);
+		if(start < end) {
+			madvise((void*)start, end - start, MADV_DONTNEED);
+			purged += end - start;
+		}
+		return true;
+	}
+};
+
+// called with the lock held
+static void purgeEngines(PurgeIter &iter)
+{
+	iter.setBlockBits(blockAllocator.getBlockBits());
 	blockAllocator.iterate(iter);
-	fprintf(stderr, "\tblocks: %" PRIuPTR "\n\n", iter.numFreeBlocks);
-	#endif
+	iter.setBlockBits(mediumBlockAllocator.getBlockBits());
+	mediumBlockAllocator.iterate(iter);
+	iter.setBlockBits(largeBlockAllocator.getBlockBits());
+	largeBlockAllocator.iterate(iter);
+	iter.setBlockBits(shortBlockAllocator.getBlockBits());
+	shortBlockAllocator.iterate(iter);
+	iter.setBlockBits(longBlockAllocator.getBlockBits());
+	longBlockAllocator.iterate(iter);
+	iter.setBlockBits(permanentBlockAllocator.getBlockBits());
+	permanentBlockAllocator.iterate(iter);
+}
+
+static void purge()
+{
+	lock.lock();
+	flushDeferred();
+
+	PurgeIter iter;
+	iter.init(trimThreshold, 0);
+	purgeEngines(iter);
+	lock.unlock();
+
+	reclaim(0);
+}
+
+static bool overBudget(uintptr_t limit, uintptr_t size)
+{
+	return limit != 0 && __atomic_load_n(&mappedBytes, __ATOMIC_RELAXED) + size > limit;
+}
+
+// map 'size' bytes at a multiple of 'align', which is a power of two
+static void* mem_map_aligned(uintptr_t size, uintptr_t align)
+{
+	if(align <= PAGE_SIZE) {
+		return mem_map(size);
+	}
+
+	const uintptr_t mapSize = size + align - PAGE_SIZE;
+	const uintptr_t mem = (uintptr_t)mem_map(mapSize);
+	if(mem == 0) {
+		return 0;
+	}
+
+	// cut off the unaligned head and the rest of the tail
+	const uintptr_t out = alignUp(mem, align);
+	if(out != mem) {
+		unmapLater((void*)mem, out - mem);
+	}
+	if(out + size != mem + mapSize) {
+		unmapLater((void*)(out + size), mem + mapSize - (out + size));
+	}
+	return (void*)out;
+}
+
+// make room for mapping 'size' more bytes of heap memory within the budget,
+// false if that is not possible
+static bool makeRoom(uintptr_t size)
+{
+	const uintptr_t limit = __atomic_load_n(&heapBudget, __ATOMIC_RELAXED);
+	if(overBudget(softLimit(limit), size)) {
+		purge();
+
+		if(overBudget(limit, size)) {
+			// let the application release memory, callbacks may call free()
+			// but allocations made by them fail instead of calling them again
+			if(inPressureCallback) {
+				return false;
+			}
+
+			// one thread runs the callbacks at a time, the others wait for
+			// it, the memory it released may be enough for them
+			while(__atomic_exchange_n(&pressureActive, true, __ATOMIC_ACQUIRE)) {
+				while(__atomic_load_n(&pressureActive, __ATOMIC_RELAXED)) {
+					sched_yield();
+				}
+			}
+
+			inPressureCallback = true;
+			const uintptr_t count = __atomic_load_n(&numPressureCallbacks, __ATOMIC_ACQUIRE);
+			for(uintptr_t i = 0; i < count && overBudget(limit, size); ++i) {
+				pressureCallbacks[i].func(size, pressureCallbacks[i].arg);
+				purge();
+			}
+			inPressureCallback = false;
+
+			__atomic_store_n(&pressureActive, false, __ATOMIC_RELEASE);
+
+			if(overBudget(limit, size)) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// map 'size' bytes of heap memory within the budget, the blocks of an
+// engine must start at a multiple of the block size
+static void* map_pages(uintptr_t size, uintptr_t align = PAGE_SIZE)
+{
+	if(!makeRoom(size)) {
+		return 0;
+	}
+	return mem_map_aligned(size, align);
+}
+
+// places in the range map_pages_within() tries
+static const uintptr_t WITHIN_PROBES = 64;
+
+// map_pages() for memory that lies completely in ['low', 'high'). The range
+// is usually mostly unmapped, e.g. below 4 GB, so a bounded number of places
+// spread over it are tried with MAP_FIXED_NOREPLACE, lowest first.
+static void* map_pages_within(uintptr_t low, uintptr_t high, uintptr_t size, uintptr_t align)
+{
+	const uintptr_t first = alignUp(low, align);
+	if(first < low || first >= high || high - first < size) {
+		return 0;
+	}
+	if(!makeRoom(size)) {
+		return 0;
+	}
+
+	const uintptr_t step = (high - first - size) / WITHIN_PROBES;
+	for(uintptr_t i = 0; i < WITHIN_PROBES; ++i) {
+		const uintptr_t addr = (first + step * i) & ~(align - 1);
+		void *mem = mem_map(size, MAP_FIXED_NOREPLACE, (void*)addr);
+		if(mem != 0) {
+			return mem;
+		}
+		if(step == 0) {
+			break;
+		}
+	}
+	return 0;
+}
+
+void treealloc_set_budget(size_t bytes)
+{
+	initAllocator();
+	lock.lock();
+	__atomic_store_n(&heapBudget, bytes, __ATOMIC_RELAXED);
+	lock.unlock();
+}
+
+size_t treealloc_get_budget(void)
+{
+	initAllocator();
+	lock.lock();
+	const uintptr_t out = heapBudget;
+	lock.unlock();
+	return out;
+}
+
+size_t treealloc_get_mapped(void)
+{
+	return __atomic_load_n(&mappedBytes, __ATOMIC_RELAXED);
+}
+
+int treealloc_register_pressure_callback(void (*func)(size_t needed, void *arg), void *arg)
+{
+	if(func == NULL) {
+		return EINVAL;
+	}
+
+	lock.lock();
+	if(numPressureCallbacks == MAX_PRESSURE_CALLBACKS) {
+		lock.unlock();
+		return ENOMEM;
+	}
+
+	pressureCallbacks[numPressureCallbacks].func = func;
+	pressureCallbacks[numPressureCallbacks].arg = arg;
+	__atomic_store_n(&numPressureCallbacks, numPressureCallbacks + 1, __ATOMIC_RELEASE);
+	lock.unlock();
+
+	return 0;
+}
+
+// size of the next refill of the block allocator, at least 'size' bytes
+static uintptr_t nextRefill(uintptr_t size)
+{
+	const uintptr_t out = __atomic_load_n(&refillNext, __ATOMIC_RELAXED);
+	const uintptr_t max = __atomic_load_n(&refillMax, __ATOMIC_RELAXED);
+	if(out < max) {
+		// racing threads may both double it, this is harmless
+		__atomic_store_n(&refillNext, out * 2 < max ? out * 2 : max, __ATOMIC_RELAXED);
+	}
+	return out < size ? size : out;
+}
+
+int mallopt(int param, int value)
+{
+	if(value < 0) {
+		return 0;
+	}
+
+	const uintptr_t bytes = (uintptr_t)value;
+	int out = 1;
+
+	// the reservation is mapped and prefaulted without holding the lock
+	void *reservePages = 0;
+	const uintptr_t reserveBytes = alignUp(bytes, PAGE_SIZE);
+	if(param == TREEALLOC_M_RESERVE && bytes != 0) {
+		reservePages = mem_map(reserveBytes, MAP_POPULATE);
+		if(reservePages == 0) {
+			return 0;
+		}
+	}
+
+	initAllocator();
+	lock.lock();
+	switch(param) {
+		case TREEALLOC_M_TRIM_THRESHOLD:
+			trimThreshold = alignUp(bytes < PAGE_SIZE ? PAGE_SIZE : bytes, PAGE_SIZE);
+			break;
+		case TREEALLOC_M_MMAP_THRESHOLD:
+			__atomic_store_n(&mmapThreshold, alignUp(bytes, PAGE_SIZE), __ATOMIC_RELAXED);
+			break;
+		case TREEALLOC_M_REFILL:
+			setRefill(bytes, refillMax);
+			break;
+		case TREEALLOC_M_REFILL_MAX:
+			setRefill(refillBytes, bytes);
+			break;
+		case TREEALLOC_M_DEFERRED:
+			setDeferred(bytes);
+			break;
+		case TREEALLOC_M_RESERVE:
+			if(reservePages != 0) {
+				addReserve(reservePages, reserveBytes);
+			}
+			break;
+		default:
+			out = 0;
+			break;
+	}
+	lock.unlock();
+
+	return out;
+}
+
+class PrintIter
+{
+	public:
+	uintptr_t blockBits;
+	uintptr_t numFreeBlocks;
+
+	void init(uintptr_t bits)
+	{
+		blockBits = bits;
+		numFreeBlocks = 0;
+	}
+
+	bool operator()(void *s, uintptr_t blocks)
+	{
+		const uintptr_t start = (uintptr_t)s;
+		const uintptr_t size = blocks << blockBits;
+		const uintptr_t end = start + size;
+
+		numFreeBlocks += 1;
+		fprintf(stderr, "\t[0x%" PRIxPTR " - 0x%" PRIxPTR "] %" PRIuPTR "\n", start, end, size);
+
+		return true;
+	}
+};
+
+// allocate one chunk from an engine, if 'actual' is not nullptr the engine
+// may hand out more and the usable size is stored there
+template<typename Allocator>
+static void* allocateChunk(Allocator &allocator, uintptr_t alignment, uintptr_t size, uintptr_t *actual)
+{
+	if(actual != nullptr) {
+		return allocator.allocAtLeast(size, actual);
+	}
+	return allocator.allocAligned(alignment, size);
+}
+
+// allocate from one engine, refill it or give the request its own mapping
+// if it has no fitting free run
+template<typename Allocator, typename BlockAllocator>
+static void* allocateFrom(Allocator &allocator, BlockAllocator &engine, uintptr_t alignment, uintptr_t size,
+	uintptr_t *actual = nullptr)
+{
+	// the header and alignment would wrap around for these
+	if(size > MAX_REQUEST || alignment > MAX_REQUEST) {
+		return 0;
+	}
+
+	// chunks that were freed without the lock are taken without it
+	if(actual == nullptr) {
+		void *out = allocator.allocLockFree(alignment, size);
+		if(out != 0) {
+			return out;
+		}
+	}
 
+	initAllocator();
+	lock.lock();
+	void *out = allocateChunk(allocator, alignment, size, actual);
 	lock.unlock();
 
+	if(out != 0) {
+		return out;
+	}
+
+	// engine regions are multiples of the page and the block size
+	const uintptr_t blockSize = ((uintptr_t)1) << engine.getBlockBits();
+	const uintptr_t granule = blockSize < PAGE_SIZE ? PAGE_SIZE : blockSize;
+	const uintptr_t alignSize = alignUp(size + allocator.overhead() + (alignment - 1), granule);
+	if(alignSize < __atomic_load_n(&mmapThreshold, __ATOMIC_RELAXED)) {
+		// map without holding the lock, but refill and allocate in one
+		// critical section, so no other thread can take the new memory
+		const uintptr_t refill = alignUp(nextRefill(alignSize), granule);
+		void *pages = map_pages(refill, blockSize);
+		if(pages != 0) {
+			lock.lock();
+			engine.free(pages, refill >> engine.getBlockBits());
+			engine.setWilderness(pages, refill >> engine.getBlockBits());
+			out = allocateChunk(allocator, alignment, size, actual);
+			lock.unlock();
+		}
+	}
+	else {
+		// the new mapping belongs to this thread only
+		void *pages = map_pages(alignSize, blockSize);
+		if(pages != 0) {
+			out = allocator.writeAlignedHeader(alignment, pages, alignSize);
+			if(actual != nullptr) {
+				*actual = allocator.getUserSize(out);
+			}
+		}
+	}
+
+	return out;
+}
+
+// route the request to the engine for its size, this is malloc() without
+// the allocation function semantics the compiler assumes for malloc, the
+// header in front of the result is accessed by realloc()
+static Engine routeEngine(uintptr_t alignment, uintptr_t size)
+{
+	const uintptr_t worstSize = size + alignment;
+	if(worstSize >= LARGE_MIN_SIZE) {
+		return LARGE_ENGINE;
+	}
+	if(worstSize >= MEDIUM_MIN_SIZE) {
+		return MEDIUM_ENGINE;
+	}
+	return SMALL_ENGINE;
+}
+
+static void* allocateIn(Engine engine, uintptr_t alignment, uintptr_t size)
+{
+	switch(engine) {
+		case MEDIUM_ENGINE: return allocateFrom(mediumAllocator, mediumBlockAllocator, alignment, size);
+		case LARGE_ENGINE: return allocateFrom(largeAllocator, largeBlockAllocator, alignment, size);
+		case SHORT_ENGINE: return allocateFrom(shortAllocator, shortBlockAllocator, alignment, size);
+		case LONG_ENGINE: return allocateFrom(longAllocator, longBlockAllocator, alignment, size);
+		case PERMANENT_ENGINE: return allocateFrom(permanentAllocator, permanentBlockAllocator, alignment, size);
+		default: return allocateFrom(fineAllocator, blockAllocator, alignment, size);
+	}
+}
+
+static void* allocate(uintptr_t alignment, uintptr_t size)
+{
+	return allocateIn(routeEngine(alignment, size), alignment, size);
+}
+
+// the engine that made an allocation, found by the tag in its header
+static void ownerFree(void *mem)
+{
+	switch(fineAllocator.getTag(mem)) {
+		case MEDIUM_ENGINE: mediumAllocator.free(mem); break;
+		case LARGE_ENGINE: largeAllocator.free(mem); break;
+		case SHORT_ENGINE: shortAllocator.free(mem); break;
+		case LONG_ENGINE: longAllocator.free(mem); break;
+		case PERMANENT_ENGINE: permanentAllocator.free(mem); break;
+		default: fineAllocator.free(mem); break;
+	}
+}
+
+static bool ownerFreeLockFree(void *mem)
+{
+	switch(fineAllocator.getTag(mem)) {
+		case MEDIUM_ENGINE: return mediumAllocator.freeLockFree(mem);
+		case LARGE_ENGINE: return largeAllocator.freeLockFree(mem);
+		case SHORT_ENGINE: return shortAllocator.freeLockFree(mem);
+		case LONG_ENGINE: return longAllocator.freeLockFree(mem);
+		case PERMANENT_ENGINE: return permanentAllocator.freeLockFree(mem);
+		default: return fineAllocator.freeLockFree(mem);
+	}
+}
+
+static void ownerFreeMerged(void *mem)
+{
+	switch(fineAllocator.getTag(mem)) {
+		case MEDIUM_ENGINE: mediumAllocator.freeMerged(mem); break;
+		case LARGE_ENGINE: largeAllocator.freeMerged(mem); break;
+		case SHORT_ENGINE: shortAllocator.freeMerged(mem); break;
+		case LONG_ENGINE: longAllocator.freeMerged(mem); break;
+		case PERMANENT_ENGINE: permanentAllocator.freeMerged(mem); break;
+		default: fineAllocator.freeMerged(mem); break;
+	}
+}
+
+static bool ownerResize(void *mem, uintptr_t size)
+{
+	switch(fineAllocator.getTag(mem)) {
+		case MEDIUM_ENGINE: return mediumAllocator.resize(mem, size);
+		case LARGE_ENGINE: return largeAllocator.resize(mem, size);
+		case SHORT_ENGINE: return shortAllocator.resize(mem, size);
+		case LONG_ENGINE: return longAllocator.resize(mem, size);
+		case PERMANENT_ENGINE: return permanentAllocator.resize(mem, size);
+		default: return fineAllocator.resize(mem, size);
+	}
+}
+
+static uintptr_t ownerReserveBelow(void *mem)
+{
+	switch(fineAllocator.getTag(mem)) {
+		case MEDIUM_ENGINE: return mediumAllocator.reserveBelow(mem);
+		case LARGE_ENGINE: return largeAllocator.reserveBelow(mem);
+		case SHORT_ENGINE: return shortAllocator.reserveBelow(mem);
+		case LONG_ENGINE: return longAllocator.reserveBelow(mem);
+		case PERMANENT_ENGINE: return permanentAllocator.reserveBelow(mem);
+		default: return fineAllocator.reserveBelow(mem);
+	}
+}
+
+static void* ownerMoveTo(void *mem, uintptr_t start)
+{
+	switch(fineAllocator.getTag(mem)) {
+		case MEDIUM_ENGINE: return mediumAllocator.moveTo(mem, start);
+		case LARGE_ENGINE: return largeAllocator.moveTo(mem, start);
+		case SHORT_ENGINE: return shortAllocator.moveTo(mem, start);
+		case LONG_ENGINE: return longAllocator.moveTo(mem, start);
+		case PERMANENT_ENGINE: return permanentAllocator.moveTo(mem, start);
+		default: return fineAllocator.moveTo(mem, start);
+	}
+}
+
+static uintptr_t ownerUserSize(void *mem)
+{
+	switch(fineAllocator.getTag(mem)) {
+		case MEDIUM_ENGINE: return mediumAllocator.getUserSize(mem);
+		case LARGE_ENGINE: return largeAllocator.getUserSize(mem);
+		case SHORT_ENGINE: return shortAllocator.getUserSize(mem);
+		case LONG_ENGINE: return longAllocator.getUserSize(mem);
+		case PERMANENT_ENGINE: return permanentAllocator.getUserSize(mem);
+		default: return fineAllocator.getUserSize(mem);
+	}
+}
+
+void *malloc(size_t size)
+{
+	if(size == 0) {
+		return NULL;
+	}
+
+	#ifdef MORE_DEBUG
+	fprintf(stderr, "malloc(%" PRIuPTR ") -> ", (uintptr_t)size);
+	#endif
+
+	#ifdef MEASURE_TIME
+	uint64_t time = getNanos();
+	#endif
+
+	void *out = allocate(1, size);
+
+	#ifdef MORE_DEBUG
+	fprintf(stderr, "0x%" PRIxPTR "\n", (uintptr_t)out);
+	#endif
+
+	#ifdef MEASURE_TIME
+	time = getNanos() - time;
+	fprintf(stderr, "malloc %" PRIu64 "\n", time);
+	#endif
+
+	return out;
+}
+
+void* memalign(size_t alignment, size_t size)
+{
+	if(size == 0) {
+		return NULL;
+	}
+
+	if(!((alignment != 0) && !(alignment & (alignment - 1)))) {
+		return NULL;
+	}
+
+	#ifdef MORE_DEBUG
+	fprintf(stderr, "memalign(%" PRIuPTR ", %" PRIuPTR ")\n", (uintptr_t)alignment, (uintptr_t)size);
+	#endif
+
+	#ifdef MEASURE_TIME
+	uint64_t time = getNanos();
+	#endif
+
+	void *out = allocate(alignment, size);
+
+	#ifdef MEASURE_TIME
+	time = getNanos() - time;
+	fprintf(stderr, "memalign %" PRIu64 "\n", time);
+	#endif
+
+	return out;
+}
+
+// free() and dallocx(), 'merged' skips deferred coalescing
+static void release(void *mem, bool merged)
+{
+	if(mem == NULL) {
+		return;
+	}
+
+	// small chunks go to the lock-free stacks of their engine
+	if(!merged && ownerFreeLockFree(mem)) {
+		return;
+	}
+
+	#ifdef MEASURE_TIME
+	uint64_t time = getNanos();
+	#endif
+
+	ReclaimBatch batch;
+	batch.init();
+
+	lock.lock();
+
+	#ifdef MORE_DEBUG
+	PrintIter iter;
+	iter.init(blockAllocator.getBlockBits());
+	fprintf(stderr, "start free 0x%p\n", mem);
+	iter.init(blockAllocator.getBlockBits());
+	blockAllocator.iterate(iter);
+	fprintf(stderr, "\tblocks: %" PRIuPTR "\n\n", iter.numFreeBlocks);
+	#endif
+
+	if(merged) {
+		ownerFreeMerged(mem);
+	}
+	else {
+		ownerFree(mem);
+	}
+
+	// take the free runs out of the block allocator, they are unmapped
+	// after releasing the lock
+	bool more = false;
+	if(!maintenanceActive) {
+		more = batch.collect(0);
+	}
+
+	#ifdef MORE_DEBUG
+	fprintf(stderr, "end free 0x%p\n", mem);
+	iter.init(blockAllocator.getBlockBits());
+	blockAllocator.iterate(iter);
+	fprintf(stderr, "\tblocks: %" PRIuPTR "\n\n", iter.numFreeBlocks);
+	#endif
+
+	lock.unlock();
+
+	batch.unmap();
+	if(more) {
+		reclaim(0);
+	}
+
+	#ifdef MEASURE_TIME
+	time = getNanos() - time;
+	fprintf(stderr, "free %" PRIu64 "\n", time);
+	#endif
+}
+
+void free(void *mem)
+{
+	release(mem, false);
+}
+
+void* realloc(void *mem, size_t size)
+{
+	if(mem == NULL) {
+		return malloc(size);
+	}
+
+	if(size == 0) {
+		free(mem);
+		return NULL;
+	}
+
+	// resizing in place would wrap around for these
+	if(size > MAX_REQUEST) {
+		return NULL;
+	}
+
+	#ifdef MEASURE_TIME
+	uint64_t time = getNanos();
+	#endif
+
+	lock.lock();
+
+	#ifdef MORE_DEBUG
+	PrintIter iter;
+	iter.init(blockAllocator.getBlockBits());
+	fprintf(stderr, "start realloc 0x%p\n", mem);
+	iter.init(blockAllocator.getBlockBits());
+	blockAllocator.iterate(iter);
+	fprintf(stderr, "\tblocks: %" PRIuPTR "\n\n", iter.numFreeBlocks);
+	#endif
+
+	const bool inPlace = ownerResize(mem, size);
+
+	#ifdef MORE_DEBUG
+	fprintf(stderr, "end realloc 0x%p\n", mem);
+	iter.init(blockAllocator.getBlockBits());
+	blockAllocator.iterate(iter);
+	fprintf(stderr, "\tblocks: %" PRIuPTR "\n\n", iter.numFreeBlocks);
+	#endif
+
+	lock.unlock();
+
+	void *out = mem;
+	if(!inPlace) {
+		// alloc, copy, free, the old memory still belongs to the caller, so
+		// it can be copied without holding the lock. Only growing moves, an
+		// allocation that is moved the second time gets geometric slack.
+		const uintptr_t oldSize = ownerUserSize(mem);
+		const uintptr_t growSize = fineAllocator.getGrowSize(mem, size);
+		out = allocate(1, growSize);
+		if(out == NULL && growSize != size) {
+			out = allocate(1, size);
+		}
+		if(out != NULL) {
+			fineAllocator.markGrown(out);
+			memops_copy(out, mem, oldSize < size ? oldSize : size);
+			free(mem);
+		}
+	}
+
+	#ifdef MEASURE_TIME
+	time = getNanos() - time;
+	fprintf(stderr, "realloc %" PRIu64 "\n", time);
+	#endif
+
+	return out;
+}
+
+// the flags of the *allocx() calls, see treealloc.h
+static const int X_LG_ALIGN_MASK = 0x3f;
+static const int X_ENGINE_SHIFT = 20;
+
+static uintptr_t xAlignment(int flags)
+{
+	return ((uintptr_t)1) << (flags & X_LG_ALIGN_MASK);
+}
+
+// the engine the flags ask for, false if they name none that exists or
+// the request is too large for any
+static bool xEngine(int flags, uintptr_t alignment, uintptr_t size, Engine *engine)
+{
+	if(size > MAX_REQUEST || alignment > MAX_REQUEST) {
+		return false;
+	}
+
+	const unsigned int code = ((unsigned int)flags) >> X_ENGINE_SHIFT;
+	if(code == 0) {
+		*engine = routeEngine(alignment, size);
+		return true;
+	}
+	if(code - 1 > LARGE_ENGINE) {
+		return false;
+	}
+	*engine = (Engine)(code - 1);
+	return true;
+}
+
+static uintptr_t engineAllocSize(Engine engine, uintptr_t alignment, uintptr_t size)
+{
+	switch(engine) {
+		case MEDIUM_ENGINE: return mediumAllocator.getAllocSize(alignment, size);
+		case LARGE_ENGINE: return largeAllocator.getAllocSize(alignment, size);
+		case SHORT_ENGINE: return shortAllocator.getAllocSize(alignment, size);
+		case LONG_ENGINE: return longAllocator.getAllocSize(alignment, size);
+		case PERMANENT_ENGINE: return permanentAllocator.getAllocSize(alignment, size);
+		default: return fineAllocator.getAllocSize(alignment, size);
+	}
+}
+
+void* malloc_hint(size_t size, int lifetime)
+{
+	if(size == 0) {
+		return NULL;
+	}
+
+	Engine engine = routeEngine(1, size);
+	if(engine == SMALL_ENGINE) {
+		switch(lifetime) {
+			case TREEALLOC_LIFETIME_SHORT: engine = SHORT_ENGINE; break;
+			case TREEALLOC_LIFETIME_LONG: engine = LONG_ENGINE; break;
+			case TREEALLOC_LIFETIME_PERMANENT: engine = PERMANENT_ENGINE; break;
+			default: break;
+		}
+	}
+	return allocateIn(engine, 1, size);
+}
+
+void* mallocx(size_t size, int flags)
+{
+	const uintptr_t alignment = xAlignment(flags);
+	Engine engine;
+	if(size == 0 || !xEngine(flags, alignment, size, &engine)) {
+		return NULL;
+	}
+
+	void *out = allocateIn(engine, alignment, size);
+	if(out != NULL && (flags & TREEALLOC_X_ZERO) != 0) {
+		memops_zero(out, size);
+	}
+	return out;
+}
+
+void* rallocx(void *mem, size_t size, int flags)
+{
+	if(mem == NULL) {
+		return mallocx(size, flags);
+	}
+
+	const uintptr_t alignment = xAlignment(flags);
+	Engine engine;
+	if(size == 0 || !xEngine(flags, alignment, size, &engine)) {
+		return NULL;
+	}
+
+	lock.lock();
+	const uintptr_t oldSize = ownerUserSize(mem);
+	const bool inPlace = (((uintptr_t)mem) & (alignment - 1)) == 0 && ownerResize(mem, size);
+	lock.unlock();
+
+	void *out = mem;
+	if(!inPlace) {
+		out = allocateIn(engine, alignment, size);
+		if(out == NULL) {
+			return NULL;
+		}
+		memops_copy(out, mem, oldSize < size ? oldSize : size);
+		release(mem, (flags & TREEALLOC_X_NOCACHE) != 0);
+	}
+
+	if(size > oldSize && (flags & TREEALLOC_X_ZERO) != 0) {
+		memops_zero(((char*)out) + oldSize, size - oldSize);
+	}
+	return out;
+}
+
+size_t xallocx(void *mem, size_t size, size_t extra, int flags)
+{
+	if(mem == NULL || size == 0) {
+		return 0;
+	}
+
+	// resizing in place would wrap around for these
+	if(size > MAX_REQUEST) {
+		return malloc_usable_size(mem);
+	}
+	if(extra > MAX_REQUEST - size) {
+		extra = MAX_REQUEST - size;
+	}
+
+	lock.lock();
+	const uintptr_t oldSize = ownerUserSize(mem);
+	if(extra == 0 || !ownerResize(mem, size + extra)) {
+		ownerResize(mem, size);
+	}
+	const uintptr_t newSize = ownerUserSize(mem);
+	lock.unlock();
+
+	if(newSize > oldSize && (flags & TREEALLOC_X_ZERO) != 0) {
+		memops_zero(((char*)mem) + oldSize, newSize - oldSize);
+	}
+	return newSize;
+}
+
+size_t sallocx(const void *mem, int flags)
+{
+	(void)flags;
+	return malloc_usable_size((void*)mem);
+}
+
+void dallocx(void *mem, int flags)
+{
+	release(mem, (flags & TREEALLOC_X_NOCACHE) != 0);
+}
+
+size_t nallocx(size_t size, int flags)
+{
+	const uintptr_t alignment = xAlignment(flags);
+	Engine engine;
+	if(size == 0 || !xEngine(flags, alignment, size, &engine)) {
+		return 0;
+	}
+	return engineAllocSize(engine, alignment, size);
+}
+
+struct treealloc_sized_ptr treealloc_alloc_at_least(size_t size)
+{
+	struct treealloc_sized_ptr out = { NULL, 0 };
+	if(size == 0) {
+		return out;
+	}
+
+	uintptr_t actual = 0;
+	switch(routeEngine(1, size)) {
+		case MEDIUM_ENGINE:
+			out.ptr = allocateFrom(mediumAllocator, mediumBlockAllocator, 1, size, &actual);
+			break;
+		case LARGE_ENGINE:
+			out.ptr = allocateFrom(largeAllocator, largeBlockAllocator, 1, size, &actual);
+			break;
+		default:
+			out.ptr = allocateFrom(fineAllocator, blockAllocator, 1, size, &actual);
+			break;
+	}
+	if(out.ptr != NULL) {
+		out.size = actual;
+	}
+	return out;
+}
+
+struct treealloc_sized_ptr treealloc_alloc_range(size_t minSize, size_t maxSize)
+{
+	struct treealloc_sized_ptr out = { NULL, 0 };
+	if(minSize == 0 || minSize > maxSize || minSize > MAX_REQUEST) {
+		return out;
+	}
+	if(maxSize > MAX_REQUEST) {
+		maxSize = MAX_REQUEST;
+	}
+
+	// take what the free runs hold first, in the engine for 'minSize', as
+	// runs of that size are the ones fragmentation leaves there
+	uintptr_t actual = 0;
+	initAllocator();
+	lock.lock();
+	switch(routeEngine(1, minSize)) {
+		case MEDIUM_ENGINE: out.ptr = mediumAllocator.allocRange(minSize, maxSize, &actual); break;
+		case LARGE_ENGINE: out.ptr = largeAllocator.allocRange(minSize, maxSize, &actual); break;
+		default: out.ptr = fineAllocator.allocRange(minSize, maxSize, &actual); break;
+	}
+	lock.unlock();
+
+	if(out.ptr != NULL && actual >= minSize) {
+		out.size = actual;
+		return out;
+	}
+	free(out.ptr);
+
+	// no free run holds 'minSize', map new memory
+	out = treealloc_alloc_at_least(maxSize);
+	if(out.ptr == NULL) {
+		out = treealloc_alloc_at_least(minSize);
+	}
+	if(out.size < minSize) {
+		free(out.ptr);
+		out.ptr = NULL;
+		out.size = 0;
+	}
+	return out;
+}
+
+void* treealloc_alloc_near(const void *hint, size_t size)
+{
+	if(size == 0 || size > MAX_REQUEST) {
+		return NULL;
+	}
+
+	void *out;
+	initAllocator();
+	lock.lock();
+	switch(routeEngine(1, size)) {
+		case MEDIUM_ENGINE: out = mediumAllocator.allocNear(hint, size); break;
+		case LARGE_ENGINE: out = largeAllocator.allocNear(hint, size); break;
+		default: out = fineAllocator.allocNear(hint, size); break;
+	}
+	lock.unlock();
+
+	if(out == NULL) {
+		// no free run is large enough, new memory is not near anything
+		out = allocate(1, size);
+	}
+	return out;
+}
+
+// take memory in ['low', 'high') from one engine, refill it with memory
+// mapped in the range if no free run there is large enough
+template<typename Allocator, typename BlockAllocator>
+static void* allocateWithin(Allocator &allocator, BlockAllocator &engine, uintptr_t low, uintptr_t high, uintptr_t size)
+{
+	lock.lock();
+	void *out = allocator.allocWithinRange(low, high, size);
+	lock.unlock();
+
+	if(out != 0) {
+		return out;
+	}
+
+	// a whole refill if the range has room for it, else just the request
+	const uintptr_t blockSize = ((uintptr_t)1) << engine.getBlockBits();
+	const uintptr_t granule = blockSize < PAGE_SIZE ? PAGE_SIZE : blockSize;
+	const uintptr_t alignSize = alignUp(size + allocator.overhead(), granule);
+	uintptr_t mapSize = alignUp(nextRefill(alignSize), granule);
+	void *pages = map_pages_within(low, high, mapSize, granule);
+	if(pages == 0 && mapSize != alignSize) {
+		mapSize = alignSize;
+		pages = map_pages_within(low, high, mapSize, granule);
+	}
+	if(pages == 0) {
+		return 0;
+	}
+
+	lock.lock();
+	engine.free(pages, mapSize >> engine.getBlockBits());
+	out = allocator.allocWithinRange(low, high, size);
+	lock.unlock();
+	return out;
+}
+
+void* treealloc_alloc_within(const void *low, const void *high, size_t size)
+{
+	if(size == 0 || size > MAX_REQUEST || (uintptr_t)low >= (uintptr_t)high) {
+		return NULL;
+	}
+
+	initAllocator();
+	switch(routeEngine(1, size)) {
+		case MEDIUM_ENGINE: return allocateWithin(mediumAllocator, mediumBlockAllocator, (uintptr_t)low, (uintptr_t)high, size);
+		case LARGE_ENGINE: return allocateWithin(largeAllocator, largeBlockAllocator, (uintptr_t)low, (uintptr_t)high, size);
+		default: return allocateWithin(fineAllocator, blockAllocator, (uintptr_t)low, (uintptr_t)high, size);
+	}
+}
+
+size_t malloc_usable_size(void *mem)
+{
+	if(mem == NULL) {
+		return 0;
+	}
+
+	lock.lock();
+	const size_t out = ownerUserSize(mem);
+	lock.unlock();
+
+	return out;
+}
+
+// unmap the free runs and give the pages inside the smaller ones back with
+// MADV_DONTNEED, the first 'pad' free bytes are left alone
+int malloc_trim(size_t pad)
+{
+	const uintptr_t mapped = __atomic_load_n(&mappedBytes, __ATOMIC_RELAXED);
+
+	lock.lock();
+	if(!initialized) {
+		lock.unlock();
+		return 0;
+	}
+	flushDeferred();
+	lock.unlock();
+
+	reclaim(0);
+
+	// the runs that are still there are below the trim threshold or kept
+	// for the reservation, they stay mapped. The reservation stays
+	// prefaulted.
+	PurgeIter iter;
+	iter.init(~((uintptr_t)0), pad + retainBytes);
+	lock.lock();
+	purgeEngines(iter);
+	lock.unlock();
+
+	return (iter.purged != 0 || __atomic_load_n(&mappedBytes, __ATOMIC_RELAXED) < mapped) ? 1 : 0;
+}
+
+struct EngineInfo
+{
+	uintptr_t freeBytes;
+	uintptr_t freeRuns;
+	uintptr_t deferredBytes;
+	uintptr_t largest;
+};
+
+// called with the lock held
+template<typename BlockAllocator>
+static void getEngineInfo(BlockAllocator &engine, EngineInfo *info)
+{
+	const uintptr_t blockBits = engine.getBlockBits();
+	info->freeBytes = engine.getFreeCount() << blockBits;
+	info->freeRuns = engine.getContBlockCount();
+	info->deferredBytes = engine.getDeferredCount() << blockBits;
+	info->largest = engine.getLargestFree();
+}
+
+// called with the lock held
+static void getAllEngineInfo(EngineInfo *engines)
+{
+	getEngineInfo(blockAllocator, &engines[SMALL_ENGINE]);
+	getEngineInfo(mediumBlockAllocator, &engines[MEDIUM_ENGINE]);
+	getEngineInfo(largeBlockAllocator, &engines[LARGE_ENGINE]);
+	getEngineInfo(shortBlockAllocator, &engines[SHORT_ENGINE]);
+	getEngineInfo(longBlockAllocator, &engines[LONG_ENGINE]);
+	getEngineInfo(permanentBlockAllocator, &engines[PERMANENT_ENGINE]);
+}
+
+struct treealloc_mallinfo treealloc_get_mallinfo(void)
+{
+	EngineInfo engines[ENGINES];
+
+	lock.lock();
+	getAllEngineInfo(engines);
+	lock.unlock();
+
+	struct treealloc_mallinfo out;
+	memset(&out, 0, sizeof(out));
+	out.arena = __atomic_load_n(&mappedBytes, __ATOMIC_RELAXED);
+	for(uintptr_t i = 0; i < ENGINES; ++i) {
+		out.ordblks += engines[i].freeRuns;
+		out.fsmblks += engines[i].deferredBytes;
+		out.fordblks += engines[i].freeBytes;
+		if(engines[i].largest > out.keepcost) {
+			out.keepcost = engines[i].largest;
+		}
+	}
+	out.uordblks = out.arena > out.fordblks ? out.arena - out.fordblks : 0;
+
+	return out;
+}
+
+struct treealloc_mallinfo mallinfo2(void)
+{
+	return treealloc_get_mallinfo();
+}
+
+// the format of the GNU C library, one heap per engine. The numbers are
+// taken with the lock held and printed without it, printing may allocate.
+int malloc_info(int options, FILE *fp)
+{
+	if(options != 0 || fp == NULL) {
+		return -1;
+	}
+
+	EngineInfo engines[ENGINES];
+	uintptr_t addrElems[ENGINES];
+	uintptr_t sizeElems[ENGINES];
+
+	lock.lock();
+	getAllEngineInfo(engines);
+	blockAllocator.getTreeElems(&addrElems[SMALL_ENGINE], &sizeElems[SMALL_ENGINE]);
+	mediumBlockAllocator.getTreeElems(&addrElems[MEDIUM_ENGINE], &sizeElems[MEDIUM_ENGINE]);
+	largeBlockAllocator.getTreeElems(&addrElems[LARGE_ENGINE], &sizeElems[LARGE_ENGINE]);
+	shortBlockAllocator.getTreeElems(&addrElems[SHORT_ENGINE], &sizeElems[SHORT_ENGINE]);
+	longBlockAllocator.getTreeElems(&addrElems[LONG_ENGINE], &sizeElems[LONG_ENGINE]);
+	permanentBlockAllocator.getTreeElems(&addrElems[PERMANENT_ENGINE], &sizeElems[PERMANENT_ENGINE]);
+	lock.unlock();
+
+	const uintptr_t mapped = __atomic_load_n(&mappedBytes, __ATOMIC_RELAXED);
+	const uintptr_t blockBits[ENGINES] = {ARCH_BLOCK_BITS, MEDIUM_BLOCK_BITS, LARGE_BLOCK_BITS,
+		ARCH_BLOCK_BITS, ARCH_BLOCK_BITS, ARCH_BLOCK_BITS};
+
+	uintptr_t freeBytes = 0;
+	uintptr_t freeRuns = 0;
+	uintptr_t deferredBytes = 0;
+	uintptr_t deferredCount = 0;
+
+	fprintf(fp, "<malloc version=\"1\">\n");
+	for(uintptr_t i = 0; i < ENGINES; ++i) {
+		fprintf(fp, "<heap nr=\"%" PRIuPTR "\">\n", i);
+		fprintf(fp, "<sizes>\n</sizes>\n");
+		fprintf(fp, "<total type=\"fast\" count=\"%" PRIuPTR "\" size=\"%" PRIuPTR "\"/>\n",
+			engines[i].deferredBytes >> blockBits[i], engines[i].deferredBytes);
+		fprintf(fp, "<total type=\"rest\" count=\"%" PRIuPTR "\" size=\"%" PRIuPTR "\"/>\n",
+			engines[i].freeRuns, engines[i].freeBytes - engines[i].deferredBytes);
+		fprintf(fp, "<tree block=\"%" PRIuPTR "\" addr=\"%" PRIuPTR "\" size=\"%" PRIuPTR "\" largest=\"%" PRIuPTR "\"/>\n",
+			((uintptr_t)1) << blockBits[i], addrElems[i], sizeElems[i], engines[i].largest);
+		fprintf(fp, "</heap>\n");
+
+		freeBytes += engines[i].freeBytes;
+		freeRuns += engines[i].freeRuns;
+		deferredBytes += engines[i].deferredBytes;
+		deferredCount += engines[i].deferredBytes >> blockBits[i];
+	}
+	fprintf(fp, "<total type=\"fast\" count=\"%" PRIuPTR "\" size=\"%" PRIuPTR "\"/>\n", deferredCount, deferredBytes);
+	fprintf(fp, "<total type=\"rest\" count=\"%" PRIuPTR "\" size=\"%" PRIuPTR "\"/>\n", freeRuns, freeBytes - deferredBytes);
+	fprintf(fp, "<total type=\"mmap\" count=\"0\" size=\"0\"/>\n");
+	fprintf(fp, "<system type=\"current\" size=\"%" PRIuPTR "\"/>\n", mapped);
+	fprintf(fp, "<system type=\"max\" size=\"%" PRIuPTR "\"/>\n", __atomic_load_n(&maxMappedBytes, __ATOMIC_RELAXED));
+	fprintf(fp, "<aspace type=\"total\" size=\"%" PRIuPTR "\"/>\n", mapped);
+	fprintf(fp, "<aspace type=\"mprotect\" size=\"%" PRIuPTR "\"/>\n", mapped);
+	fprintf(fp, "</malloc>\n");
+
+	return 0;
+}
+
+// movable allocations are reached through a table of handles, a handle is
+// the index of its entry plus one. The table grows in chunks that never
+// move. A free entry has no memory, its 'pins' hold the next free handle.
+struct HandleEntry
+{
+	void *mem;
+	uintptr_t pins;
+	uintptr_t flags;
+};
+
+// freed while pinned or moved, the memory goes at the last unpin or the end
+// of the move
+static const uintptr_t HANDLE_FREED = 1;
+// being copied by treealloc_compact() outside the lock
+static const uintptr_t HANDLE_MOVING = 2;
+// pinned while being copied, the copy may be stale
+static const uintptr_t HANDLE_TOUCHED = 4;
+
+static const uintptr_t HANDLE_CHUNK_ENTRIES = PAGE_SIZE * 4 / sizeof(HandleEntry);
+static const uintptr_t HANDLE_CHUNKS = 4096;
+
+static HandleEntry *handleChunks[HANDLE_CHUNKS];
+static uintptr_t handlesUsed = 0;
+static uintptr_t handlesFree = 0;
+
+static HandleEntry* handleEntry(uintptr_t index)
+{
+	return &handleChunks[index / HANDLE_CHUNK_ENTRIES][index % HANDLE_CHUNK_ENTRIES];
+}
+
+// called with the lock held, also returns entries that wait to be freed
+static HandleEntry* getHandle(size_t handle)
+{
+	if(handle == 0 || handle > handlesUsed) {
+		return 0;
+	}
+
+	HandleEntry *entry = handleEntry(handle - 1);
+	return entry->mem != 0 ? entry : 0;
+}
+
+// called with the lock held, frees the memory and the entry
+static void releaseHandle(size_t handle, HandleEntry *entry)
+{
+	ownerFree(entry->mem);
+	entry->mem = 0;
+	entry->flags = 0;
+	entry->pins = handlesFree;
+	handlesFree = handle;
+}
+
+// called with the lock held, returns 0 if the table is full or if it needs
+// another chunk of entries and 'spare' is 0. 'spare' is taken for it then.
+static size_t newHandle(void *mem, HandleEntry **spare)
+{
+	size_t handle = handlesFree;
+	if(handle != 0) {
+		HandleEntry *entry = handleEntry(handle - 1);
+		handlesFree = entry->pins;
+		entry->mem = mem;
+		entry->pins = 0;
+		entry->flags = 0;
+		return handle;
+	}
+
+	const uintptr_t index = handlesUsed;
+	const uintptr_t chunk = index / HANDLE_CHUNK_ENTRIES;
+	if(chunk >= HANDLE_CHUNKS) {
+		return 0;
+	}
+	if(handleChunks[chunk] == 0) {
+		if(*spare == 0) {
+			return 0;
+		}
+		handleChunks[chunk] = *spare;
+		*spare = 0;
+	}
+
+	HandleEntry *entry = handleEntry(index);
+	entry->mem = mem;
+	entry->pins = 0;
+	entry->flags = 0;
+	handlesUsed += 1;
+	return index + 1;
+}
+
+size_t movable_alloc(size_t size)
+{
+	if(size == 0 || size > MAX_REQUEST) {
+		return 0;
+	}
+
+	void *mem = allocate(1, size);
+	if(mem == 0) {
+		return 0;
+	}
+
+	// a new chunk of entries is mapped without the lock and the request
+	// is retried
+	const uintptr_t chunkSize = HANDLE_CHUNK_ENTRIES * sizeof(HandleEntry);
+	HandleEntry *spare = 0;
+	size_t handle;
+	for(;;) {
+		lock.lock();
+		handle = newHandle(mem, &spare);
+		const bool needChunk = handle == 0 && spare == 0 && handlesUsed / HANDLE_CHUNK_ENTRIES < HANDLE_CHUNKS;
+		if(handle == 0 && !needChunk) {
+			ownerFree(mem);
+		}
+		lock.unlock();
+
+		if(!needChunk) {
+			break;
+		}
+		spare = (HandleEntry*)mem_map(chunkSize);
+		if(spare == 0) {
+			lock.lock();
+			ownerFree(mem);
+			lock.unlock();
+			break;
+		}
+	}
+
+	// another thread added the chunk meanwhile
+	if(spare != 0) {
+		mem_unmap(spare, chunkSize);
+	}
+
+	return handle;
+}
+
+void movable_free(size_t handle)
+{
+	lock.lock();
+	HandleEntry *entry = getHandle(handle);
+	if(entry != 0) {
+		if(entry->pins == 0 && (entry->flags & HANDLE_MOVING) == 0) {
+			releaseHandle(handle, entry);
+		} else {
+			entry->flags |= HANDLE_FREED;
+		}
+	}
+	lock.unlock();
+}
+
+void* movable_pin(size_t handle)
+{
+	void *out = 0;
+
+	lock.lock();
+	HandleEntry *entry = getHandle(handle);
+	if(entry != 0 && (entry->flags & HANDLE_FREED) == 0) {
+		entry->pins += 1;
+		if(entry->flags & HANDLE_MOVING) {
+			entry->flags |= HANDLE_TOUCHED;
+		}
+		out = entry->mem;
+	}
+	lock.unlock();
+
+	return out;
+}
+
+void movable_unpin(size_t handle)
+{
+	lock.lock();
+	HandleEntry *entry = getHandle(handle);
+	if(entry != 0 && entry->pins != 0) {
+		entry->pins -= 1;
+		if(entry->pins == 0 && entry->flags == HANDLE_FREED) {
+			releaseHandle(handle, entry);
+		}
+	}
+	lock.unlock();
+}
+
+size_t treealloc_compact(size_t budget)
+{
+	uintptr_t moved = 0;
+
+	lock.lock();
+	// deferred chunks are holes too
+	flushDeferred();
+	const uintptr_t used = handlesUsed;
+	lock.unlock();
+
+	// the blocks below are reserved with the lock held and the copy is done
+	// without it. A pin meanwhile keeps the allocation where it is.
+	for(uintptr_t index = 0; index < used; ++index) {
+		if(budget != 0 && moved >= budget) {
+			break;
+		}
+
+		lock.lock();
+		HandleEntry *entry = handleEntry(index);
+		void *mem = entry->mem;
+		const uintptr_t start = mem != 0 && entry->pins == 0 && entry->flags == 0 ? ownerReserveBelow(mem) : 0;
+		if(start == 0) {
+			lock.unlock();
+			continue;
+		}
+		entry->flags = HANDLE_MOVING;
+		lock.unlock();
+
+		void *copy = ownerMoveTo(mem, start);
+
+		lock.lock();
+		if(entry->flags == HANDLE_MOVING) {
+			entry->mem = copy;
+			copy = mem;
+			moved += ownerUserSize(entry->mem);
+		}
+		ownerFree(copy);
+		entry->flags &= ~(HANDLE_MOVING | HANDLE_TOUCHED);
+		if(entry->pins == 0 && entry->flags == HANDLE_FREED) {
+			releaseHandle(index + 1, entry);
+		}
+		lock.unlock();
+	}
+
+	lock.lock();
+	flushDeferred();
+	lock.unlock();
+
+	// the space left behind was merged, give it back
+	reclaim(0);
+
+	return moved;
+}
+
+// every mapped region of a heap starts with this header, the regions of one
+// heap form a singly linked list
+struct HeapRegion
+{
+	HeapRegion *next;
+	uintptr_t size;
+};
+
+typedef os::res::TreeBlockAllocatorNoLock<ARCH_BLOCK_BITS> HeapBlockAllocator;
+
+struct heap
+{
+	os::res::FutexLock lock;
+	os::res::WrapperAllocator<HeapBlockAllocator> allocator;
+	HeapRegion *regions;
+
+	HeapBlockAllocator& blocks()
+	{
+		return allocator;
+	}
+
+	// map a new region that can hold at least 'size' bytes, this does not
+	// need the lock
+	static HeapRegion* mapRegion(uintptr_t size)
+	{
+		const uintptr_t headerSize = alignUp(sizeof(HeapRegion), USER_BLOCK_SIZE);
+
+		uintptr_t regionSize = alignUp(size + headerSize, PAGE_SIZE);
+		if(regionSize < MIN_BLOCK_ALLOC) {
+			regionSize = MIN_BLOCK_ALLOC;
+		}
+
+		HeapRegion *region = (HeapRegion*)map_pages(regionSize);
+		if(region != 0) {
+			region->size = regionSize;
+		}
+
+		return region;
+	}
+
+	// give a mapped region to the block allocator, called with the lock held
+	void addRegion(HeapRegion *region)
+	{
+		const uintptr_t headerSize = alignUp(sizeof(HeapRegion), USER_BLOCK_SIZE);
+
+		region->next = regions;
+		regions = region;
+
+		void *start = (void*)(((uintptr_t)region) + headerSize);
+		blocks().free(start, (region->size - headerSize) >> blocks().getBlockBits());
+	}
+};
+
+heap_t* heap_create(void)
+{
+	// the heap itself lives at the start of its first region
+	HeapRegion *region = (HeapRegion*)map_pages(MIN_BLOCK_ALLOC);
+	if(region == 0) {
+		return NULL;
+	}
+
+	region->next = 0;
+	region->size = MIN_BLOCK_ALLOC;
+
+	heap_t *heap = (heap_t*)(region + 1);
+	heap->lock.init();
+	heap->allocator.init();
+	heap->allocator.setDeferredLimit(DEFERRED_BYTES >> heap->blocks().getBlockBits());
+	heap->regions = region;
+
+	const uintptr_t headerSize = alignUp(sizeof(HeapRegion) + sizeof(heap_t), USER_BLOCK_SIZE);
+	void *start = (void*)(((uintptr_t)region) + headerSize);
+	heap->blocks().free(start, (MIN_BLOCK_ALLOC - headerSize) >> heap->blocks().getBlockBits());
+
+	return heap;
+}
+
+void* heap_alloc(heap_t *heap, size_t size)
+{
+	if(heap == NULL || size == 0 || size > MAX_REQUEST) {
+		return NULL;
+	}
+
+	heap->lock.lock();
+	void *out = heap->allocator.alloc(size);
+	heap->lock.unlock();
+
+	if(out == 0) {
+		HeapRegion *region = heap_t::mapRegion(size + heap->allocator.overhead());
+		if(region != 0) {
+			heap->lock.lock();
+			heap->addRegion(region);
+			out = heap->allocator.alloc(size);
+			heap->lock.unlock();
+		}
+	}
+
+	return out;
+}
+
+void heap_free(heap_t *heap, void *mem)
+{
+	if(heap == NULL || mem == NULL) {
+		return;
+	}
+
+	heap->lock.lock();
+	heap->allocator.free(mem);
+	heap->lock.unlock();
+}
+
+void heap_destroy(heap_t *heap)
+{
+	if(heap == NULL) {
+		return;
+	}
+
+	// the heap is part of one of its regions, do not touch it after the
+	// first munmap
+	HeapRegion *region = heap->regions;
+	while(region != 0) {
+		HeapRegion *next = region->next;
+		mem_unmap(region, region->size);
+		region = next;
+	}
+}
+
+// the mapped file, the lock in it is private to the process that has the
+// file open
+struct PersistentHeap : public os::res::MappedHeap<ARCH_BLOCK_BITS, os::res::FutexLock>
+{
+	typedef os::res::MappedHeap<ARCH_BLOCK_BITS, os::res::FutexLock> Super;
+
+	PersistentHeap() : Super()
+	{
+	}
+
+	PersistentHeap(const char *NO_INIT) : Super(NO_INIT)
+	{
+	}
+};
+
+// an open persistent heap, 'fd' holds the exclusive flock() on the file
+// until the heap is closed
+struct pheap
+{
+	PersistentHeap *mapped;
+	int fd;
+};
+
+// file mappings are not part of the memory budget
+static void file_unmap(void *mem, uintptr_t size)
+{
+	munmap(mem, size);
+}
+
+// map 'size' bytes of 'fd' at exactly 'addr', fails if that range is in use
+static void* file_map_fixed(int fd, uintptr_t size, uintptr_t addr)
+{
+	void *mem = mmap((void*)addr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+	if(mem == MAP_FAILED) {
+		return 0;
+	}
+
+	// older kernels treat the address just as a hint
+	if((uintptr_t)mem != addr) {
+		file_unmap(mem, size);
+		return 0;
+	}
+
+	return mem;
+}
+
+// a heap file that was created or sized here and could not be set up is
+// removed again, an empty file that was there before is left empty
+static void discardNew(int fd, const char *path, bool created)
+{
+	if(created) {
+		unlink(path);
+	}
+	else if(ftruncate(fd, 0) != 0) {
+		// nothing else to undo
+	}
+	close(fd);
+}
+
+pheap_t* pheap_open(const char *path, size_t size, void *base, int flags)
+{
+	bool created = true;
+	int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if(fd < 0 && errno == EEXIST) {
+		created = false;
+		fd = open(path, O_RDWR | O_CLOEXEC);
+	}
+	if(fd < 0) {
+		return NULL;
+	}
+
+	// the lock in the heap only works inside one process, a second one
+	// would reset it and both would change the trees at the same time
+	struct stat st;
+	if(flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &st) != 0) {
+		if(created) {
+			unlink(path);
+		}
+		close(fd);
+		return NULL;
+	}
+
+	const bool isNew = (st.st_size == 0);
+	uintptr_t mapSize = (uintptr_t)st.st_size;
+	uintptr_t addr = (uintptr_t)base;
+
+	if(isNew) {
+		mapSize = alignUp(size, PAGE_SIZE);
+		if(mapSize <= PersistentHeap::getHeaderSize() || ftruncate(fd, mapSize) != 0) {
+			discardNew(fd, path, created);
+			return NULL;
+		}
+	}
+	else if(addr == 0) {
+		char header[sizeof(PersistentHeap)];
+		if(pread(fd, header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+			close(fd);
+			return NULL;
+		}
+		addr = PersistentHeap::getPreviousBase(header);
+	}
+
+	void *mem = 0;
+	if(addr != 0) {
+		mem = file_map_fixed(fd, mapSize, addr);
+	}
+	if(mem == 0 && (addr == 0 || (flags & PHEAP_RELOCATE) != 0)) {
+		mem = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if(mem == MAP_FAILED) {
+			mem = 0;
+		}
+	}
+
+	pheap_t *heap = 0;
+	if(mem != 0) {
+		heap = (pheap_t*)allocate(1, sizeof(pheap_t));
+	}
+	if(heap == 0) {
+		if(mem != 0) {
+			file_unmap(mem, mapSize);
+		}
+		if(isNew) {
+			discardNew(fd, path, created);
+		}
+		else {
+			close(fd);
+		}
+		return NULL;
+	}
+
+	bool valid;
+	if(isNew) {
+		heap->mapped = new (mem) PersistentHeap();
+		valid = heap->mapped->format(mapSize);
+	}
+	else {
+		heap->mapped = new (mem) PersistentHeap("NO_INIT");
+		valid = heap->mapped->attach(mapSize);
+		if(valid) {
+			// the previous user may have died while holding the lock
+			heap->mapped->resetLock();
+		}
+	}
+
+	if(!valid) {
+		release(heap, false);
+		file_unmap(mem, mapSize);
+		if(isNew) {
+			discardNew(fd, path, created);
+		}
+		else {
+			close(fd);
+		}
+		return NULL;
+	}
+
+	heap->fd = fd;
+	return heap;
+}
+
+void pheap_close(pheap_t *heap)
+{
+	if(heap == NULL) {
+		return;
+	}
+
+	const uintptr_t size = heap->mapped->getSize();
+	msync(heap->mapped, size, MS_SYNC);
+	file_unmap(heap->mapped, size);
+
+	// this also drops the flock()
+	close(heap->fd);
+	release(heap, false);
+}
+
+void* pheap_alloc(pheap_t *heap, size_t size)
+{
+	if(heap == NULL || size == 0 || size > MAX_REQUEST) {
+		return NULL;
+	}
+
+	return heap->mapped->alloc(size);
+}
+
+void pheap_free(pheap_t *heap, void *mem)
+{
+	if(heap == NULL || mem == NULL) {
+		return;
+	}
+
+	heap->mapped->free(mem);
+}
+
+void* pheap_get_root(pheap_t *heap)
+{
+	return heap->mapped->getRoot();
+}
+
+void pheap_set_root(pheap_t *heap, void *mem)
+{
+	heap->mapped->setRoot(mem);
+}
+
+size_t pheap_offset(pheap_t *heap, const void *mem)
+{
+	return heap->mapped->toOffset(mem);
+}
+
+void* pheap_pointer(pheap_t *heap, size_t offset)
+{
+	return heap->mapped->fromOffset(offset);
+}
+
+struct shm_heap : public os::res::MappedHeap<ARCH_BLOCK_BITS, os::res::SharedFutexLock>
+{
+	typedef os::res::MappedHeap<ARCH_BLOCK_BITS, os::res::SharedFutexLock> Super;
+
+	shm_heap() : Super()
+	{
+	}
+
+	shm_heap(const char *NO_INIT) : Super(NO_INIT)
+	{
+	}
+};
+
+shm_heap_t* shm_heap_create(const char *name, size_t size, int *fd)
+{
+	if(name == NULL || fd == NULL) {
+		return NULL;
+	}
+
+	const uintptr_t mapSize = alignUp(size, PAGE_SIZE);
+	if(mapSize <= shm_heap::getHeaderSize()) {
+		return NULL;
+	}
+
+	int shmFd;
+	if(name[0] == '/') {
+		shmFd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	}
+	else {
+		shmFd = memfd_create(name, MFD_CLOEXEC);
+	}
+	if(shmFd < 0) {
+		return NULL;
+	}
+
+	void *mem = MAP_FAILED;
+	if(ftruncate(shmFd, mapSize) == 0) {
+		mem = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, shmFd, 0);
+	}
+	if(mem == MAP_FAILED) {
+		if(name[0] == '/') {
+			shm_unlink(name);
+		}
+		close(shmFd);
+		return NULL;
+	}
+
+	shm_heap_t *heap = new (mem) shm_heap();
+	heap->format(mapSize);
+
+	*fd = shmFd;
+	return heap;
+}
+
+shm_heap_t* shm_heap_attach(int fd)
+{
+	struct stat st;
+	if(fstat(fd, &st) != 0) {
+		return NULL;
+	}
+
+	char header[sizeof(shm_heap)];
+	if(pread(fd, header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+		return NULL;
+	}
+
+	// the heap is in use by other processes, so it cannot be relocated and
+	// has to be mapped at the same address everywhere
+	const uintptr_t addr = shm_heap::getPreviousBase(header);
+	if(addr == 0) {
+		return NULL;
+	}
+
+	const uintptr_t mapSize = (uintptr_t)st.st_size;
+	void *mem = file_map_fixed(fd, mapSize, addr);
+	if(mem == 0) {
+		return NULL;
+	}
+
+	shm_heap_t *heap = new (mem) shm_heap("NO_INIT");
+	if(!heap->attach(mapSize)) {
+		file_unmap(mem, mapSize);
+		return NULL;
+	}
+
+	return heap;
+}
+
+shm_heap_t* shm_heap_open(const char *name)
+{
+	int fd = shm_open(name, O_RDWR, 0600);
+	if(fd < 0) {
+		return NULL;
+	}
+
+	shm_heap_t *heap = shm_heap_attach(fd);
+	close(fd);
+	return heap;
+}
+
+void shm_heap_detach(shm_heap_t *heap)
+{
+	if(heap == NULL) {
+		return;
+	}
+
+	file_unmap(heap, heap->getSize());
+}
+
+size_t shm_heap_alloc(shm_heap_t *heap, size_t size)
+{
+	if(heap == NULL || size == 0 || size > MAX_REQUEST) {
+		return 0;
+	}
+
+	return heap->toOffset(heap->alloc(size));
+}
+
+void shm_heap_free(shm_heap_t *heap, size_t handle)
+{
+	if(heap == NULL || handle == 0) {
+		return;
+	}
+
+	heap->free(heap->fromOffset(handle));
+}
+
+void* shm_heap_pointer(shm_heap_t *heap, size_t handle)
+{
+	return heap->fromOffset(handle);
+}
+
+size_t shm_heap_handle(shm_heap_t *heap, const void *mem)
+{
+	return heap->toOffset(mem);
+}
+
+// range allocators, the free ranges are kept in nodes from a common pool
+struct RangeTag;
+typedef os::res::ExternalFreeBlock<RangeTag> RangeBlock;
+typedef os::res::TreeBlockAllocatorGeneric<0, RangeBlock, os::res::NoLocker> RangeBlockAllocator;
+
+// offsets are moved up by this inside the block allocator, which reserves
+// the start address 0. It is a multiple of every allowed alignment.
+static const uintptr_t RANGE_BIAS = ((uintptr_t)1) << (sizeof(uintptr_t) * 8 - 2);
+
+// memory for nodes is taken with malloc() in pieces of this size
+static const uintptr_t RANGE_NODE_SLAB = 4096;
+
+// guards all range allocators and the node pool
+static os::res::FutexLock rangeLock;
+
+struct range_allocator
+{
+	RangeBlockAllocator blocks;
+};
+
+// make sure the next call of the block allocator finds a node, called with
+// 'rangeLock' held
+static bool rangeSpareNode()
+{
+	if(RangeBlock::getSpareNodes() != 0) {
+		return true;
+	}
+
+	void *slab = malloc(RANGE_NODE_SLAB);
+	if(slab == NULL) {
+		return false;
+	}
+
+	RangeBlock::addNodes(slab, RANGE_NODE_SLAB);
+	return true;
+}
+
+range_allocator_t* range_allocator_create(void)
+{
+	range_allocator_t *ranges = (range_allocator_t*)malloc(sizeof(range_allocator_t));
+	if(ranges == NULL) {
+		return NULL;
+	}
+
+	ranges->blocks.init();
+	return ranges;
+}
+
+void range_allocator_destroy(range_allocator_t *ranges)
+{
+	if(ranges == NULL) {
+		return;
+	}
+
+	rangeLock.lock();
+	ranges->blocks.clear();
+	rangeLock.unlock();
+
+	free(ranges);
+}
+
+size_t range_alloc(range_allocator_t *ranges, size_t length, size_t alignment)
+{
+	if(ranges == NULL || length == 0 || length >= RANGE_BIAS) {
+		return RANGE_NONE;
+	}
+
+	// power of two
+	if(alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > RANGE_BIAS) {
+		return RANGE_NONE;
+	}
+
+	rangeLock.lock();
+	void *out = 0;
+	if(rangeSpareNode()) {
+		out = ranges->blocks.allocAligned(alignment, length);
+	}
+	rangeLock.unlock();
+
+	if(out == 0) {
+		return RANGE_NONE;
+	}
+	return ((uintptr_t)out) - RANGE_BIAS;
+}
+
+int range_free(range_allocator_t *ranges, size_t offset, size_t length)
+{
+	if(ranges == NULL || length == 0 || offset >= RANGE_BIAS || length > RANGE_BIAS - offset) {
+		return EINVAL;
+	}
+
+	rangeLock.lock();
+	if(!rangeSpareNode()) {
+		rangeLock.unlock();
+		return ENOMEM;
+	}
+	ranges->blocks.free((void*)(RANGE_BIAS + offset), length);
+	rangeLock.unlock();
+
+	return 0;
+}
+
+size_t range_get_free(range_allocator_t *ranges)
+{
+	if(ranges == NULL) {
+		return 0;
+	}
+
+	rangeLock.lock();
+	const size_t out = ranges->blocks.getFreeCount();
+	rangeLock.unlock();
+
 	return out;
 }
 
@@ -0,0 +1,243 @@
+#ifndef   TREEALLOC_HEADER
+#define   TREEALLOC_HEADER
+
+// non-standard interface of tree.so, the standard malloc family is declared
+// by the C library
+
+#include <stddef.h> /* size_t */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// independent heaps, each with its own block allocator and its own mapped
+// regions. Memory of a heap must be released with heap_free() on the same
+// heap, never with free(). heap_destroy() unmaps all regions of the heap at
+// once, all pointers into the heap become invalid.
+typedef struct heap heap_t;
+
+heap_t* heap_create(void);
+void*   heap_alloc(heap_t *heap, size_t size);
+void    heap_free(heap_t *heap, void *ptr);
+void    heap_destroy(heap_t *heap);
+
+// persistent heaps backed by a file. The allocator state and all free blocks
+// live in the file, so a heap survives a restart of the process. The file is
+// mapped at 'base' or, if 'base' is NULL, at the address it was mapped at the
+// last time. If that address is not available and PHEAP_RELOCATE is given the
+// heap is mapped elsewhere and relocated, pointers stored inside the heap are
+// not adjusted then, use pheap_offset()/pheap_pointer() for those.
+// 'size' is only used when the file is created. The heap is locked with
+// flock() while it is open, pheap_open() fails if it is open already, also
+// in another process. A file that pheap_open() created and could not set up
+// is removed again.
+#define PHEAP_RELOCATE 1
+
+typedef struct pheap pheap_t;
+
+pheap_t* pheap_open(const char *path, size_t size, void *base, int flags);
+void     pheap_close(pheap_t *heap);
+void*    pheap_alloc(pheap_t *heap, size_t size);
+void     pheap_free(pheap_t *heap, void *ptr);
+void*    pheap_get_root(pheap_t *heap);
+void     pheap_set_root(pheap_t *heap, void *ptr);
+size_t   pheap_offset(pheap_t *heap, const void *ptr);
+void*    pheap_pointer(pheap_t *heap, size_t offset);
+
+// heaps in shared memory, usable by several processes at the same time.
+// shm_heap_create() creates a memfd, or a POSIX shared memory object if 'name'
+// starts with '/', and returns its descriptor in 'fd'. Other processes
+// attach with that descriptor (inherited or passed over a unix socket) or
+// with shm_heap_open() by name. Allocations are identified by handles, which
+// are offsets that are valid in every process, 0 is never a valid handle.
+// The free blocks inside the heap link to each other with absolute pointers,
+// so shm_heap_attach() and shm_heap_open() map the heap at the address the
+// creator mapped it at and fail if that range is in use in the attaching
+// process. Attach early, before the address space fills up, or fork() after
+// creating the heap.
+typedef struct shm_heap shm_heap_t;
+
+shm_heap_t* shm_heap_create(const char *name, size_t size, int *fd);
+shm_heap_t* shm_heap_attach(int fd);
+shm_heap_t* shm_heap_open(const char *name);
+void        shm_heap_detach(shm_heap_t *heap);
+size_t      shm_heap_alloc(shm_heap_t *heap, size_t size);
+void        shm_heap_free(shm_heap_t *heap, size_t handle);
+void*       shm_heap_pointer(shm_heap_t *heap, size_t handle);
+size_t      shm_heap_handle(shm_heap_t *heap, const void *ptr);
+
+// start a thread that merges deferred chunks and gives free memory back to
+// the system every 'intervalMs' milliseconds, at most 'budget' bytes per
+// wake-up, 0 means no limit. While it runs, malloc() and free() do not give
+// memory back to the system, the thread also unmaps the unaligned ends of
+// new mappings. Only when the memory budget is reached, see below, the
+// allocating thread merges, unmaps and purges memory itself. Returns 0, or
+// an errno value, EBUSY if the thread runs already.
+int  treealloc_maintenance_start(unsigned int intervalMs, size_t budget);
+void treealloc_maintenance_stop(void);
+
+// budget for the memory mapped by malloc() and the heaps, 0 means no limit.
+// It defaults to the cgroup v2 memory.max of the process. Above 7/8 of the
+// budget free memory is merged, unmapped and purged with MADV_DONTNEED
+// before more memory is mapped. If the budget would still be exceeded, the
+// registered pressure callbacks are called with the number of bytes needed,
+// they may free memory. The allocation fails if that did not help.
+// Registering returns 0 or an errno value, at most 8 callbacks are kept.
+void   treealloc_set_budget(size_t bytes);
+size_t treealloc_get_budget(void);
+size_t treealloc_get_mapped(void);
+int    treealloc_register_pressure_callback(void (*func)(size_t needed, void *arg), void *arg);
+
+// tree.so also implements malloc_usable_size(), malloc_trim(), mallinfo2()
+// and malloc_info() of the GNU C library, which declares them in <malloc.h>.
+// malloc_trim() unmaps free runs and gives the pages inside the remaining
+// ones back with MADV_DONTNEED. This is the layout of struct mallinfo2,
+// treealloc_get_mallinfo() returns the same as mallinfo2().
+struct treealloc_mallinfo
+{
+	size_t arena;    // bytes mapped by the allocator
+	size_t ordblks;  // number of free runs
+	size_t smblks;   // always 0
+	size_t hblks;    // always 0, large requests are counted in 'arena'
+	size_t hblkhd;   // always 0
+	size_t usmblks;  // always 0
+	size_t fsmblks;  // bytes in deferred chunks, see TREEALLOC_DEFERRED
+	size_t uordblks; // bytes in use, including headers and heaps
+	size_t fordblks; // free bytes, including deferred chunks
+	size_t keepcost; // size of the largest free run
+};
+
+struct treealloc_mallinfo treealloc_get_mallinfo(void);
+
+// malloc() with a hint how long the object lives. Small requests of each
+// lifetime go to a block allocator with its own regions, so a few objects
+// that live long do not keep the regions of the short-lived ones from being
+// given back to the system. Larger requests and unknown lifetimes are
+// placed as by malloc(). The memory is released with free(), realloc()
+// places a moved object as malloc() would.
+#define TREEALLOC_LIFETIME_SHORT      1
+#define TREEALLOC_LIFETIME_LONG       2
+#define TREEALLOC_LIFETIME_PERMANENT  3
+
+void* malloc_hint(size_t size, int lifetime);
+
+// allocation calls that take a flags word, with the same flag encoding as
+// the MALLOCX_* flags of jemalloc. The alignment is given as its base 2
+// logarithm. TREEALLOC_X_ZERO zeroes the requested bytes, for rallocx() and
+// xallocx() the bytes behind the old size. TREEALLOC_X_NOCACHE frees without
+// deferred coalescing, so the memory is merged at once. TREEALLOC_X_ENGINE
+// picks the block engine instead of routing by size.
+// xallocx() only resizes in place, to 'size' + 'extra' if possible and else
+// to 'size', and returns the usable size, which is the old one if nothing
+// could be done. nallocx() returns the usable size mallocx() would give,
+// for alignments above 16 bytes the least one, 0 if the flags are invalid
+// or the size or alignment can never be allocated.
+#define TREEALLOC_X_LG_ALIGN(la)  ((int)(la))
+#define TREEALLOC_X_ALIGN(a)      ((int)__builtin_ctzl((unsigned long)(a)))
+#define TREEALLOC_X_ZERO          ((int)0x40)
+#define TREEALLOC_X_NOCACHE       ((int)0x100)
+#define TREEALLOC_X_ENGINE(e)     ((int)(((unsigned int)(e) + 1) << 20))
+
+#define TREEALLOC_ENGINE_SMALL    0
+#define TREEALLOC_ENGINE_MEDIUM   1
+#define TREEALLOC_ENGINE_LARGE    2
+
+void*  mallocx(size_t size, int flags);
+void*  rallocx(void *ptr, size_t size, int flags);
+size_t xallocx(void *ptr, size_t size, size_t extra, int flags);
+size_t sallocx(const void *ptr, int flags);
+void   dallocx(void *ptr, int flags);
+size_t nallocx(size_t size, int flags);
+
+// malloc() that returns the usable size with the pointer, like
+// __size_returning_new. The size is at least 'size' and includes the rest of
+// the last block, so containers can use it as their capacity. Free runs that
+// are less than an eighth larger than needed are handed out whole. The
+// memory is released with free().
+struct treealloc_sized_ptr
+{
+	void *ptr;
+	size_t size;
+};
+
+struct treealloc_sized_ptr treealloc_alloc_at_least(size_t size);
+
+// allocate between 'minSize' and 'maxSize' bytes, as much as one free run
+// holds. A run that holds 'maxSize' is chosen by best fit, else the largest
+// one. Only if no free run holds 'minSize' new memory is mapped. The usable
+// size is returned with the pointer, it may exceed 'maxSize' by the rest of
+// the last block.
+struct treealloc_sized_ptr treealloc_alloc_range(size_t minSize, size_t maxSize);
+
+// allocations placed by address, released with free().
+// treealloc_alloc_near() takes the free run closest to 'hint', e.g. the
+// parent of a tree node, at the place closest to it. It maps new memory,
+// wherever that lands, if no free run is large enough. The free runs are
+// searched outwards from 'hint', this takes time in the number of runs
+// passed, up to all of them.
+// treealloc_alloc_within() returns memory that lies completely in
+// ['low', 'high'), e.g. below 4 GB for 32 bit compressed pointers, at the
+// lowest free address there. If no free run there is large enough, new
+// memory is mapped in the range at one of a bounded number of places, it
+// returns NULL if none of them is free.
+void* treealloc_alloc_near(const void *hint, size_t size);
+void* treealloc_alloc_within(const void *low, const void *high, size_t size);
+
+// movable allocations, reached through handles instead of pointers.
+// treealloc_compact() moves them into free space at lower addresses, so the
+// free space behind them merges and can be given back to the system. It
+// moves at most about 'budget' bytes, 0 means no limit, and returns the
+// number of bytes moved. movable_pin() returns the current address of an
+// allocation and keeps it in place until the matching movable_unpin().
+// Allocations are copied without the lock held, one pinned meanwhile stays
+// where it is. movable_free() of a pinned allocation takes effect at its
+// last movable_unpin(), the handle can not be pinned again until then.
+// 0 is never a valid handle.
+size_t movable_alloc(size_t size);
+void   movable_free(size_t handle);
+void*  movable_pin(size_t handle);
+void   movable_unpin(size_t handle);
+size_t treealloc_compact(size_t budget);
+
+// allocators for ranges of numbers that are not memory of this process,
+// e.g. extents of a file, offsets in a memfd or slots of a pinned I/O buffer
+// pool. The free ranges are kept outside of the managed space, which is never
+// touched. Offsets and lengths are in units of the caller. Ranges are handed
+// to the allocator with range_free(), which returns 0 or an errno value.
+// range_alloc() picks the best fitting free range, 'alignment' is a power of
+// two, it returns RANGE_NONE if no free range is large enough. Freed ranges
+// are merged with their free neighbours. Offsets must be below 2^62 on 64
+// bit machines.
+#define RANGE_NONE ((size_t)-1)
+
+typedef struct range_allocator range_allocator_t;
+
+range_allocator_t* range_allocator_create(void);
+void               range_allocator_destroy(range_allocator_t *ranges);
+size_t             range_alloc(range_allocator_t *ranges, size_t length, size_t alignment);
+int                range_free(range_allocator_t *ranges, size_t offset, size_t length);
+size_t             range_get_free(range_allocator_t *ranges);
+
+// parameters of mallopt(), which returns 1 on success and 0 otherwise.
+// Sizes are in bytes. The same tunables are read from the environment
+// before the first allocation, with an optional k, m or g suffix:
+//   TREEALLOC_REFILL          first refill of the heap, default 2m
+//   TREEALLOC_REFILL_MAX      each refill doubles the next up to this size
+//   TREEALLOC_MMAP_THRESHOLD  requests this large get their own mapping
+//   TREEALLOC_TRIM_THRESHOLD  free runs this large are unmapped
+//   TREEALLOC_DEFERRED        freed chunks kept unmerged for reuse
+//   TREEALLOC_RESERVE         mapped and prefaulted at startup, the heap
+//                             does not shrink below it
+// The trim and mmap thresholds use the numbers of the glibc parameters.
+#define TREEALLOC_M_TRIM_THRESHOLD  (-1)
+#define TREEALLOC_M_MMAP_THRESHOLD  (-3)
+#define TREEALLOC_M_REFILL          (-100)
+#define TREEALLOC_M_REFILL_MAX      (-101)
+#define TREEALLOC_M_DEFERRED        (-102)
+#define TREEALLOC_M_RESERVE         (-103)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TREEALLOC_HEADER */